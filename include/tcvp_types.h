@@ -40,6 +40,7 @@ typedef struct tcvp_data_packet {
     int flags;
     uint64_t pts, dts;
     u_int samples;
+    u_int trim;                 /* with TCVP_PKT_FLAG_TRIM */
     void *private;
 } tcvp_data_packet_t;
 
@@ -78,6 +79,11 @@ typedef union tcvp_packet {
 #define TCVP_PKT_FLAG_KEY               0x04
 #define TCVP_PKT_FLAG_DISCONT           0x08
 #define TCVP_PKT_FLAG_TOPFIELDFIRST     0x10
+#define TCVP_PKT_FLAG_SCATTER           0x20 /* planes are payload slices */
+#define TCVP_PKT_FLAG_DIRECT            0x40 /* data is from next->get_buffer,
+                                                private holds the handle */
+#define TCVP_PKT_FLAG_TRIM              0x80 /* drop the first 'trim'
+                                                decoded samples */
 
 #define STREAM_TYPE_VIDEO     1
 #define STREAM_TYPE_AUDIO     2
@@ -144,6 +150,13 @@ struct muxed_stream {
     void *private;
 };
 
+/* Value of the "tcvp/stats" attribute of a muxed stream.  get
+   returns a malloc'd snapshot of the demuxer's counters. */
+typedef struct tcvp_stats {
+    char *(*get)(void *);
+    void *private;
+} tcvp_stats_t;
+
 /* tcvp_pipe_t MUST be allocated with tcalloc */
 typedef struct tcvp_pipe tcvp_pipe_t;
 struct tcvp_pipe {
@@ -154,10 +167,21 @@ struct tcvp_pipe {
     int (*probe)(tcvp_pipe_t *, tcvp_data_packet_t *, stream_t *);
     int (*flush)(tcvp_pipe_t *, int drop);
     int (*buffer)(tcvp_pipe_t *, float);
+    /* Direct rendering: return a tcalloc'd handle for a frame buffer
+       of at least width x height, or NULL.  The buffer stays valid
+       until the handle is tcfree'd. */
+    void *(*get_buffer)(tcvp_pipe_t *, int width, int height,
+                        u_char **data, int *strides);
+    /* How late, in 27 MHz ticks, frames are reaching the output.
+       Negative when ahead.  Decoders may skip work when late. */
+    int64_t (*lateness)(tcvp_pipe_t *);
     tcvp_pipe_t *next;
     void *private;
+    int flags;
 };
 
+#define TCVP_PIPE_FLAG_SCATTER 0x1 /* accepts TCVP_PKT_FLAG_SCATTER */
+
 #define PROBE_OK      1
 #define PROBE_FAIL    2
 #define PROBE_AGAIN   3
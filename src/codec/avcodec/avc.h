@@ -44,11 +44,14 @@ typedef struct avc_codec {
     AVFrame *frame;
     uint64_t ptsq[PTSQSIZE];
     int complete;
+    int skip, skip_frames;
 
     int have_params;
 } avc_codec_t;
 
 extern char *avc_codec_name(char *);
 extern void avc_free_packet(void *);
+extern int avc_get_buffer(AVCodecContext *, AVFrame *);
+extern void avc_release_buffer(AVCodecContext *, AVFrame *);
 
 #endif
@@ -46,6 +46,8 @@ avc_free_packet(void *v)
 {
     tcvp_data_packet_t *p = v;
     free(p->sizes);
+    if(p->flags & TCVP_PKT_FLAG_DIRECT)
+        tcfree(p->private);
 }
 
 extern void
@@ -72,6 +74,12 @@ avc_flush(tcvp_pipe_t *p, int drop)
     if(drop && ac->ctx->codec)
         avcodec_flush_buffers(ac->ctx);
 
+    if(drop && ac->skip){
+        ac->ctx->skip_frame = AVDISCARD_DEFAULT;
+        ac->ctx->skip_loop_filter = AVDISCARD_DEFAULT;
+        ac->skip = 0;
+    }
+
     return 0;
 }
 
@@ -84,6 +92,7 @@ avc_new(tcvp_pipe_t *p, stream_t *s, tcconf_section_t *cs,
     AVCodecContext *avctx;
     AVCodecParserContext *pctx = NULL;
     char *avcname;
+    int direct = 1;
     int err;
 
     avcname = avc_codec_name(s->common.codec);
@@ -138,6 +147,16 @@ avc_new(tcvp_pipe_t *p, stream_t *s, tcconf_section_t *cs,
         ac->pts = 0;
         ac->frame = avcodec_alloc_frame();
         memset(ac->ptsq, 0xff, sizeof(ac->ptsq));
+        ac->skip_frames = 1;
+        tcconf_getvalue(cs, "skip_frames", "%i", &ac->skip_frames);
+
+        tcconf_getvalue(cs, "direct_rendering", "%i", &direct);
+        if(direct && avc->capabilities & CODEC_CAP_DR1){
+            avctx->opaque = p;
+            avctx->get_buffer = avc_get_buffer;
+            avctx->release_buffer = avc_release_buffer;
+            avctx->flags |= CODEC_FLAG_EMU_EDGE;
+        }
 
         p->format.common.codec = "video/raw-i420";
         break;
@@ -24,6 +24,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include <tcstring.h>
 #include <tctypes.h>
 #include <tcalloc.h>
@@ -32,6 +34,38 @@
 #include <avcodec_tc2.h>
 #include "avc.h"
 
+/* Trade quality for speed while the output reports frames arriving
+   late: past one frame period skip non-reference frames, past three
+   also the loop filter.  Each step is undone when the lateness falls
+   a period below its threshold. */
+static void
+avc_skip(tcvp_pipe_t *p, avc_codec_t *vc)
+{
+    int64_t fp = vc->ptsn / vc->ptsd;
+    int64_t late;
+    int skip = vc->skip;
+
+    if(!p->next->lateness)
+        return;
+
+    late = p->next->lateness(p->next);
+
+    if(skip < 2 && late > (2 * skip + 1) * fp)
+        skip++;
+    else if(skip > 0 && late < (2 * skip - 2) * fp)
+        skip--;
+
+    if(skip == vc->skip)
+        return;
+
+    tc2_print("AVCODEC", TC2_PRINT_VERBOSE, "%lli us late, skip level %i\n",
+              late / 27, skip);
+
+    vc->ctx->skip_frame = skip > 0? AVDISCARD_NONREF: AVDISCARD_DEFAULT;
+    vc->ctx->skip_loop_filter = skip > 1? AVDISCARD_ALL: AVDISCARD_DEFAULT;
+    vc->skip = skip;
+}
+
 static int
 do_decvideo(tcvp_pipe_t *p, tcvp_data_packet_t *pk, int probe)
 {
@@ -62,6 +96,9 @@ do_decvideo(tcvp_pipe_t *p, tcvp_data_packet_t *pk, int probe)
         dts = pk->dts;
     }
 
+    if(vc->skip_frames && !probe)
+        avc_skip(p, vc);
+
     while(insize > 0){
         uint8_t *buf = NULL;
         int bufsize = 0;
@@ -122,7 +159,12 @@ do_decvideo(tcvp_pipe_t *p, tcvp_data_packet_t *pk, int probe)
             }
             out->planes = i;
 
-            out->flags = TCVP_PKT_FLAG_PTS;
+            if(vc->frame->type == FF_BUFFER_TYPE_USER){
+                out->flags |= TCVP_PKT_FLAG_DIRECT;
+                out->private = tcref(vc->frame->opaque);
+            }
+
+            out->flags |= TCVP_PKT_FLAG_PTS;
             if (vc->frame->reordered_opaque != AV_NOPTS_VALUE) {
                 out->pts = vc->frame->reordered_opaque;
                 vc->pts = out->pts * vc->ptsd;
@@ -142,7 +184,6 @@ do_decvideo(tcvp_pipe_t *p, tcvp_data_packet_t *pk, int probe)
             }
             vc->pts += vc->ptsn + vc->frame->repeat_pict * vc->ptsn / 2;
 
-            out->private = NULL;
             p->next->input(p->next, (tcvp_packet_t *) out);
         }
     }
@@ -152,6 +193,68 @@ do_decvideo(tcvp_pipe_t *p, tcvp_data_packet_t *pk, int probe)
     return 0;
 }
 
+/* Decode straight into frames of the next pipe when it offers them.
+   Anything it can't take falls back to the default buffers. */
+extern int
+avc_get_buffer(AVCodecContext *ctx, AVFrame *pic)
+{
+    tcvp_pipe_t *p = ctx->opaque;
+    int align[AV_NUM_DATA_POINTERS];
+    u_char *data[4];
+    int strides[4];
+    int w = ctx->width, h = ctx->height;
+    void *buf = NULL;
+    int i;
+
+    if((ctx->pix_fmt == PIX_FMT_YUV420P || ctx->pix_fmt == PIX_FMT_YUVJ420P) &&
+       p->next && p->next->get_buffer){
+        avcodec_align_dimensions2(ctx, &w, &h, align);
+        buf = p->next->get_buffer(p->next, w, h, data, strides);
+    }
+
+    for(i = 0; buf && i < 3; i++){
+        if(strides[i] % align[i] || (uintptr_t) data[i] % align[i]){
+            tcfree(buf);
+            buf = NULL;
+        }
+    }
+
+    if(!buf)
+        return avcodec_default_get_buffer(ctx, pic);
+
+    for(i = 0; i < 3; i++){
+        pic->data[i] = data[i];
+        pic->linesize[i] = strides[i];
+    }
+    pic->data[3] = NULL;
+    pic->linesize[3] = 0;
+
+    pic->opaque = buf;
+    pic->type = FF_BUFFER_TYPE_USER;
+    pic->reordered_opaque = ctx->reordered_opaque;
+#if LIBAVCODEC_VERSION_MAJOR < 55
+    /* Driver frames come back with unknown contents.  Without this
+       mpegvideo assumes it is being handed the same picture again and
+       leaves skipped macroblocks untouched. */
+    pic->age = INT_MAX;
+#endif
+
+    return 0;
+}
+
+extern void
+avc_release_buffer(AVCodecContext *ctx, AVFrame *pic)
+{
+    if(pic->type != FF_BUFFER_TYPE_USER){
+        avcodec_default_release_buffer(ctx, pic);
+        return;
+    }
+
+    tcfree(pic->opaque);
+    pic->opaque = NULL;
+    memset(pic->data, 0, sizeof(pic->data));
+}
+
 extern int
 avc_decvideo(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
 {
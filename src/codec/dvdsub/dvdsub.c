@@ -46,10 +46,17 @@ typedef struct dvdsub {
     uint32_t *palette;
 } dvdsub_t;
 
+/* Images are passed on as "overlay/yuva420": premultiplied 4:2:0
+   planes Y, A, U, V and chroma alpha, at even x, y, w and h, followed
+   by a table of uint16_t pairs giving the columns [x0, x1) holding
+   anything visible in each pair of rows. */
+#define DVDSUB_PLANES 6
+
 typedef struct dvdsub_packet {
     tcvp_data_packet_t pk;
-    u_char *data;
-    int size;
+    u_char *data[DVDSUB_PLANES];
+    int sizes[DVDSUB_PLANES];
+    u_char *buf;
 } dvdsub_packet_t;
 
 static int
@@ -213,7 +220,79 @@ static void
 dvdsub_freepk(void *p)
 {
     dvdsub_packet_t *pk = p;
-    free(pk->data);
+    free(pk->buf);
+}
+
+static inline int
+premul(int c, int a)
+{
+    return (c * a + 127) / 255;
+}
+
+/* Convert a decoded AYUV image with 4-bit alpha, offset by (dx, dy)
+   within the w x h packet, to premultiplied planes and find the
+   visible span of each row pair. */
+static void
+dvdsub_planes(dvdsub_packet_t *pk, uint32_t *img, int iw, int ih,
+              int dx, int dy)
+{
+    int w = pk->pk.w, h = pk->pk.h;
+    u_char *yp = pk->data[0], *ap = pk->data[1];
+    u_char *up = pk->data[2], *vp = pk->data[3], *cap = pk->data[4];
+    uint16_t *span = (uint16_t *) pk->data[5];
+    int x, y;
+
+    memset(pk->buf, 0, 2 * w * h + 3 * (w / 2) * (h / 2));
+
+    for(y = 0; y < ih; y++){
+        for(x = 0; x < iw; x++){
+            uint32_t c = img[y * iw + x];
+            int a = (c >> 24) * 17;
+            int o = (y + dy) * w + x + dx;
+            yp[o] = premul((c >> 16) & 0xff, a);
+            ap[o] = a;
+        }
+    }
+
+    for(y = 0; y < h / 2; y++){
+        int x0 = w, x1 = 0;
+
+        for(x = 0; x < w / 2; x++){
+            int u = 0, v = 0, a = 0;
+            int i, j;
+
+            for(i = 0; i < 2; i++){
+                for(j = 0; j < 2; j++){
+                    int ix = 2 * x + j - dx, iy = 2 * y + i - dy;
+                    uint32_t c;
+                    int ca;
+
+                    if(ix < 0 || ix >= iw || iy < 0 || iy >= ih)
+                        continue;
+
+                    c = img[iy * iw + ix];
+                    ca = (c >> 24) * 17;
+                    u += premul((c >> 8) & 0xff, ca);
+                    v += premul(c & 0xff, ca);
+                    a += ca;
+                }
+            }
+
+            up[y * w / 2 + x] = (u + 2) / 4;
+            vp[y * w / 2 + x] = (v + 2) / 4;
+            cap[y * w / 2 + x] = (a + 2) / 4;
+
+            if(ap[2 * y * w + 2 * x] | ap[2 * y * w + 2 * x + 1] |
+               ap[(2 * y + 1) * w + 2 * x] | ap[(2 * y + 1) * w + 2 * x + 1]){
+                if(x0 == w)
+                    x0 = 2 * x;
+                x1 = 2 * x + 2;
+            }
+        }
+
+        span[2 * y] = x0 < x1? x0: 0;
+        span[2 * y + 1] = x0 < x1? x1: 0;
+    }
 }
 
 static int
@@ -222,7 +301,8 @@ dvdsub_decode_packet(tcvp_pipe_t *p, int str)
     dvdsub_t *ds = p->private;
     dvdsub_image_t dsi;
     dvdsub_packet_t *pk;
-    uint32_t *buf;
+    uint32_t *img, *buf;
+    int dx, dy, w, h, size;
     int i;
 
     tc2_print("DVDSUB", TC2_PRINT_DEBUG, "psize %x, bpos %x\n",
@@ -231,29 +311,50 @@ dvdsub_decode_packet(tcvp_pipe_t *p, int str)
     memset(&dsi, 0, sizeof(dsi));
     dvdsub_info(&dsi, ds->buf, ds->psize);
 
+    if(dsi.width <= 0 || dsi.height <= 0){
+        ds->bpos = 0;
+        return 0;
+    }
+
+    img = buf = malloc(dsi.width * dsi.height * sizeof(*img));
+    for(i = 0; i < dsi.height; i++){
+        dec_line((i & 1)? &dsi.odd: &dsi.even, dsi.width, buf,
+                 &dsi, ds->palette);
+        buf += dsi.width;
+    }
+
+    dx = dsi.x & 1;
+    dy = dsi.y & 1;
+    w = (dsi.width + dx + 1) & ~1;
+    h = (dsi.height + dy + 1) & ~1;
+    size = 2 * w * h + 3 * (w / 2) * (h / 2);
+
     pk = tcallocdz(sizeof(*pk), NULL, dvdsub_freepk);
-    pk->size = dsi.width * dsi.height * 4;
-    pk->data = malloc(pk->size);
+    pk->buf = malloc(size + h * sizeof(uint16_t));
+    pk->data[0] = pk->buf;
+    pk->data[1] = pk->data[0] + w * h;
+    pk->data[2] = pk->data[1] + w * h;
+    pk->data[3] = pk->data[2] + (w / 2) * (h / 2);
+    pk->data[4] = pk->data[3] + (w / 2) * (h / 2);
+    pk->data[5] = pk->data[4] + (w / 2) * (h / 2);
+    pk->sizes[0] = pk->sizes[1] = w;
+    pk->sizes[2] = pk->sizes[3] = pk->sizes[4] = w / 2;
+    pk->sizes[5] = h * sizeof(uint16_t);
     pk->pk.type = TCVP_PKT_TYPE_DATA;
     pk->pk.stream = str;
-    pk->pk.data = &pk->data;
-    pk->pk.sizes = &pk->size;
-    pk->pk.planes = 1;
-    pk->pk.x = dsi.x;
-    pk->pk.y = dsi.y;
-    pk->pk.w = dsi.width;
-    pk->pk.h = dsi.height;
+    pk->pk.data = pk->data;
+    pk->pk.sizes = pk->sizes;
+    pk->pk.planes = DVDSUB_PLANES;
+    pk->pk.x = dsi.x - dx;
+    pk->pk.y = dsi.y - dy;
+    pk->pk.w = w;
+    pk->pk.h = h;
     pk->pk.flags = TCVP_PKT_FLAG_PTS;
     pk->pk.pts = ds->pts + dsi.start * 270000;
     pk->pk.dts = ds->pts + dsi.end * 270000;
 
-    buf = (uint32_t *) pk->data;
-
-    for(i = 0; i < dsi.height; i++){
-        dec_line((i & 1)? &dsi.odd: &dsi.even, dsi.width, buf,
-                 &dsi, ds->palette);
-        buf += dsi.width;
-    }
+    dvdsub_planes(pk, img, dsi.width, dsi.height, dx, dy);
+    free(img);
 
     ds->bpos = 0;
 
@@ -367,7 +468,7 @@ dvdsub_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
     }
 
     p->format = *s;
-    p->format.common.codec = "overlay/raw";
+    p->format.common.codec = "overlay/yuva420";
     return PROBE_OK;
 }
 
@@ -387,7 +488,7 @@ dvdsub_new(tcvp_pipe_t *p, stream_t *s, tcconf_section_t *cs,
     ds->buf = malloc(ds->bsize);
 
     p->format = *s;
-    p->format.common.codec = "overlay/raw";
+    p->format.common.codec = "overlay/yuva420";
     p->private = ds;
 
     return 0;
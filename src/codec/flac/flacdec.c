@@ -35,6 +35,9 @@ typedef struct flac_decode {
     u_char *data;
     int size;
     int frame;
+    int skip;
+    int pflags;
+    uint64_t pts;
 } flac_decode_t;
 
 typedef struct flac_decode_packet {
@@ -79,19 +82,30 @@ flac_write(const FLAC__StreamDecoder *fsd, const FLAC__Frame *fr,
            const FLAC__int32 *const buf[], void *d)
 {
     tcvp_pipe_t *p = d;
+    flac_decode_t *fd = p->private;
     flac_decode_packet_t *fp;
     int samples = fr->header.blocksize;
+    int skip = 0;
     int16_t *out;
     int i, j;
 
     tc2_print("FLACDEC", TC2_PRINT_DEBUG, "flac_write()\n");
 
+    if(fd->skip){
+        skip = fd->skip < samples? fd->skip: samples;
+        fd->skip -= skip;
+        samples -= skip;
+        fd->pts += skip * 27000000LL / fr->header.sample_rate;
+        if(!samples)
+            return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+    }
+
     fp = tcallocdz(sizeof(*fp), NULL, flac_free_pk);
     fp->size = sizeof(*out) * fr->header.channels * samples;
     out = malloc(fp->size);
     fp->data = (u_char *) out;
 
-    for(i = 0; i < samples; i++)
+    for(i = skip; i < skip + samples; i++)
         for(j = 0; j < fr->header.channels; j++)
             *out++ = buf[j][i];
 
@@ -99,6 +113,9 @@ flac_write(const FLAC__StreamDecoder *fsd, const FLAC__Frame *fr,
     fp->pk.data = &fp->data;
     fp->pk.sizes = &fp->size;
     fp->pk.samples = samples;
+    fp->pk.flags = fd->pflags;
+    fp->pk.pts = fd->pts;
+    fd->pflags = 0;
 
     p->next->input(p->next, (tcvp_packet_t *) fp);
 
@@ -135,6 +152,10 @@ flacdec_decode(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
 
     fd->data = pk->data[0];
     fd->size = pk->sizes[0];
+    fd->pflags = pk->flags & TCVP_PKT_FLAG_PTS;
+    fd->pts = pk->pts;
+    if(pk->flags & TCVP_PKT_FLAG_TRIM)
+        fd->skip = pk->trim;
 
     while(fd->size > 0){
         FLAC__stream_decoder_process_single(fd->fsd);
@@ -151,6 +172,19 @@ flacdec_decode(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
     return 0;
 }
 
+extern int
+flacdec_flush(tcvp_pipe_t *p, int drop)
+{
+    flac_decode_t *fd = p->private;
+
+    if(drop){
+        FLAC__stream_decoder_flush(fd->fsd);
+        fd->skip = 0;
+    }
+
+    return 0;
+}
+
 extern int
 flacdec_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
 {
@@ -51,6 +51,7 @@ typedef struct mad_dec {
     int bufsize;
     u_char *buf;
     uint64_t npts;
+    int skip;
 } mad_dec_t;
 
 typedef struct mp3_frame {
@@ -174,7 +175,7 @@ static int
 output(tcvp_pipe_t *tp, struct mad_pcm *pcm, int stream)
 {
     mad_dec_t *md = tp->private;
-    unsigned int channels, samples;
+    unsigned int channels, samples, skip;
     const mad_fixed_t *left, *right;
     mad_packet_t *mp;
     int16_t *dp;
@@ -184,6 +185,18 @@ output(tcvp_pipe_t *tp, struct mad_pcm *pcm, int stream)
     left = pcm->samples[0];
     right = pcm->samples[1];
 
+    if(md->skip){
+        skip = min(md->skip, samples);
+        md->skip -= skip;
+        samples -= skip;
+        left += skip;
+        right += skip;
+        if(md->npts != -1LL)
+            md->npts += skip * 27000000LL / pcm->samplerate;
+        if(!samples)
+            return 0;
+    }
+
     mp = mad_alloc(channels, samples, stream);
     if(md->npts != -1LL){
         mp->pk.flags |= TCVP_PKT_FLAG_PTS;
@@ -249,6 +262,9 @@ mad_decode(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
             md->npts -= 1152 * 27000000LL / p->format.audio.sample_rate;
     }
 
+    if(pk->flags & TCVP_PKT_FLAG_TRIM)
+        md->skip += pk->trim;
+
     while(size > 0){
         u_char *fd;
         int bs, fs;
@@ -315,6 +331,7 @@ mad_flush(tcvp_pipe_t *p, int drop)
 
     if(drop){
         md->bs = 0;
+        md->skip = 0;
     }
 
     return 0;
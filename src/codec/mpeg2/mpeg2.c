@@ -44,6 +44,7 @@ typedef struct mpeg_dec {
     int flush;
     mpeg_buf_t *free_bufs, *used_bufs;
     int nfree;
+    int skip;
     pthread_mutex_t lock;
 } mpeg_dec_t;
 
@@ -174,6 +175,35 @@ mpeg_free_packet(void *p)
     mpeg_release_buf(mp->mpd, mp->buf);
 }
 
+/* Skip B pictures while the output reports frames arriving more than
+   a frame period late, until it has caught up. */
+static void
+mpeg_skip(tcvp_pipe_t *p, mpeg_dec_t *mpd)
+{
+    const mpeg2_picture_t *pic = mpd->info->current_picture;
+    int64_t late;
+    int skip = mpd->skip;
+
+    if(!tcvp_codec_mpeg2_conf_skip_frames || !p->next->lateness || !pic)
+        return;
+
+    late = p->next->lateness(p->next);
+
+    if(late > mpd->info->sequence->frame_period)
+        skip = 1;
+    else if(late < 0)
+        skip = 0;
+
+    if(skip != mpd->skip){
+        tc2_print("MPEG2", TC2_PRINT_VERBOSE, "%lli us late, %s B pictures\n",
+                  late / 27, skip? "skipping": "decoding");
+        mpd->skip = skip;
+    }
+
+    mpeg2_skip(mpd->mpeg2, skip && (pic->flags & PIC_MASK_CODING_TYPE) ==
+               PIC_FLAG_CODING_TYPE_B);
+}
+
 extern int
 mpeg_decode(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
 {
@@ -212,6 +242,7 @@ mpeg_decode(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
         case STATE_PICTURE:
             fbuf = mpeg_alloc(mpd);
             mpeg2_set_buf(mpd->mpeg2, fbuf->data, fbuf);
+            mpeg_skip(p, mpd);
             break;
         case STATE_SLICE:
         case STATE_END:
@@ -261,7 +292,10 @@ mpeg_decode(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
                     mpd->pts += nf * mpd->info->sequence->frame_period / 2;
                 }
                 pic->pk.private = pic;
-                p->next->input(p->next, (tcvp_packet_t *) pic);
+                if(mpd->info->display_picture->flags & PIC_FLAG_SKIP)
+                    tcfree(pic);
+                else
+                    p->next->input(p->next, (tcvp_packet_t *) pic);
             }
 
             if(mpd->info->discard_fbuf){
@@ -338,6 +372,10 @@ mpeg_flush(tcvp_pipe_t *p, int drop)
 /*      mpeg2_reset(mpd->mpeg2, 1); */
         mpd->flush = 2;
         mpd->pts = -1LL;
+        if(mpd->skip){
+            mpeg2_skip(mpd->mpeg2, 0);
+            mpd->skip = 0;
+        }
         /* FIXME: the buffers should be flushed here, but the reference
            counting becomes a nightmare */
 /*      mpeg_flush_bufs(mpd); */
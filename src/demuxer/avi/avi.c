@@ -84,6 +84,7 @@ typedef struct avi_idx1 {
     uint32_t size;
 } avi_idx1_t;
 
+/* Decoded index entry. */
 typedef struct avi_index {
     uint64_t pts;
     uint64_t offset;
@@ -91,14 +92,39 @@ typedef struct avi_index {
     uint32_t flags;
 } avi_index_t;
 
+/* The index is stored per stream in blocks of up to AVI_IDX_BLOCK
+   entries.  Each entry holds its offset relative to the start of the
+   block and its size with the keyframe flag in the top bit.  Audio
+   timestamps are recomputed from the byte and block counts at the
+   start of the block.  Keyframe entry numbers are kept separately. */
+
+#define AVI_IDX_BLOCK 256
+#define AVI_IDX_KEY (1U << 31)
+
+typedef struct avi_index_block {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t blocknum;
+    uint32_t first;
+} avi_index_block_t;
+
+typedef struct avi_index_entry {
+    uint32_t offset;
+    uint32_t size;
+} avi_index_entry_t;
+
 typedef struct avi_stream {
     int scale;
     int rate;
     int sample_size;
     int block_align;
     int wavex;
-    avi_index_t *index;
+    avi_index_entry_t *index;
     int idxlen, idxsize;
+    avi_index_block_t *iblk;
+    int nblk, blksize;
+    uint32_t *keys;
+    int nkeys, keysize;
     uint64_t blocknum;
     uint64_t size;
     int pkt;
@@ -112,9 +138,11 @@ typedef struct avi_file {
     int idxok;
     uint32_t movi_start;
     avi_stream_t *streams;
-    avi_index_t **index;
-    int idxlen;
-    int pkt;
+    int idxloaded;
+    uint64_t idx1_pos;
+    uint32_t idx1_size;
+    uint64_t *indx;
+    int nindx;
     int has_video;
     uint64_t fpos;
 } avi_file_t;
@@ -187,44 +215,200 @@ avi_add_index(muxed_stream_t *ms, int s, uint64_t offset,
 {
     avi_file_t *af = ms->private;
     avi_stream_t *st = &af->streams[s];
-    int ixl = st->idxlen;
+    avi_index_block_t *ib = st->nblk? st->iblk + st->nblk - 1: NULL;
+    avi_index_entry_t *ie;
 
     if(st->idxlen == st->idxsize){
-        st->idxsize = st->idxsize? st->idxsize * 2: 65536;
+        st->idxsize = st->idxsize? st->idxsize * 2: 4096;
         st->index = realloc(st->index, st->idxsize * sizeof(*st->index));
     }
 
+    if(!ib || st->idxlen - ib->first == AVI_IDX_BLOCK ||
+       offset < ib->offset || offset - ib->offset > UINT32_MAX){
+        if(st->nblk == st->blksize){
+            st->blksize = st->blksize? st->blksize * 2: 64;
+            st->iblk = realloc(st->iblk, st->blksize * sizeof(*st->iblk));
+        }
+        ib = st->iblk + st->nblk++;
+        ib->offset = offset;
+        ib->size = st->size;
+        ib->blocknum = st->blocknum;
+        ib->first = st->idxlen;
+    }
+
     if(ms->streams[s].stream_type == STREAM_TYPE_AUDIO)
         flags &= ~AVI_FLAG_KEYFRAME;
 
-    st->index[ixl].offset = offset;
-    st->index[ixl].size = size;
-    st->index[ixl].flags = flags;
+    size &= ~AVI_IDX_KEY;
+
+    ie = st->index + st->idxlen;
+    ie->offset = offset - ib->offset;
+    ie->size = size;
+
+    if(flags & AVI_FLAG_KEYFRAME){
+        ie->size |= AVI_IDX_KEY;
+        if(st->nkeys == st->keysize){
+            st->keysize = st->keysize? st->keysize * 2: 1024;
+            st->keys = realloc(st->keys, st->keysize * sizeof(*st->keys));
+        }
+        st->keys[st->nkeys++] = st->idxlen;
+    }
+
+    if(st->block_align){
+        st->blocknum += (size + st->block_align - 1) / st->block_align;
+    } else {
+        st->blocknum++;
+    }
+
+    st->size += size;
+    st->idxlen++;
+
+    return 0;
+}
+
+static avi_index_block_t *
+avi_index_block(avi_stream_t *st, int i)
+{
+    int b = i / AVI_IDX_BLOCK;
+
+    if(b >= st->nblk)
+        b = st->nblk - 1;
+    while(b > 0 && st->iblk[b].first > i)
+        b--;
+    while(b + 1 < st->nblk && st->iblk[b+1].first <= i)
+        b++;
+
+    return st->iblk + b;
+}
+
+/* Decode entry i of stream s. */
+static void
+avi_index_get(muxed_stream_t *ms, int s, int i, avi_index_t *ai)
+{
+    avi_file_t *af = ms->private;
+    avi_stream_t *st = &af->streams[s];
+    avi_index_block_t *ib = avi_index_block(st, i);
+    avi_index_entry_t *ie = st->index + i;
+
+    ai->offset = ib->offset + ie->offset;
+    ai->size = ie->size & ~AVI_IDX_KEY;
+    ai->flags = ie->size & AVI_IDX_KEY? AVI_FLAG_KEYFRAME: 0;
+    ai->pts = 0;
+
+    if(ms->streams[s].stream_type == STREAM_TYPE_AUDIO){
+        uint64_t size = ib->size, blocknum = ib->blocknum;
+        int j;
+
+        for(j = ib->first; j < i; j++){
+            uint32_t sz = st->index[j].size & ~AVI_IDX_KEY;
+            size += sz;
+            if(st->block_align)
+                blocknum += (sz + st->block_align - 1) / st->block_align;
+            else
+                blocknum++;
+        }
 
-    if(ms->streams[s].stream_type == STREAM_TYPE_AUDIO) {
         if(!st->sample_size && st->scale && st->rate){
-            st->index[ixl].pts = 27000000LL * st->blocknum *
-                st->scale / st->rate;
+            ai->pts = 27000000LL * blocknum * st->scale / st->rate;
         } else if(st->wavex && st->block_align && st->rate){
-            st->index[ixl].pts =
-                27000000LL * st->size / st->block_align * st->scale / st->rate;
+            ai->pts =
+                27000000LL * size / st->block_align * st->scale / st->rate;
         } else if(st->sample_size && st->rate){
-            st->index[ixl].pts =
-                27000000LL * st->size / st->sample_size * st->scale / st->rate;
+            ai->pts =
+                27000000LL * size / st->sample_size * st->scale / st->rate;
         }
-        if(st->block_align){
-            st->blocknum += (size + st->block_align - 1) / st->block_align;
-        } else {
-            st->blocknum++;
+    } else if(ms->streams[s].stream_type == STREAM_TYPE_VIDEO && st->rate){
+        ai->pts = 27000000LL * i * st->scale / st->rate;
+    }
+}
+
+static uint64_t
+avi_index_offset(avi_stream_t *st, int i)
+{
+    return avi_index_block(st, i)->offset + st->index[i].offset;
+}
+
+/* First entry of stream s with offset >= pos. */
+static int
+avi_index_find_pos(avi_stream_t *st, uint64_t pos)
+{
+    int lo = 0, hi = st->idxlen;
+
+    while(lo < hi){
+        int m = (lo + hi) / 2;
+        if(avi_index_offset(st, m) < pos)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+
+    return lo;
+}
+
+/* First entry of stream s with pts >= time. */
+static int
+avi_index_find_pts(muxed_stream_t *ms, int s, uint64_t time)
+{
+    avi_file_t *af = ms->private;
+    int lo = 0, hi = af->streams[s].idxlen;
+    avi_index_t ai;
+
+    while(lo < hi){
+        int m = (lo + hi) / 2;
+        avi_index_get(ms, s, m, &ai);
+        if(ai.pts < time)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+
+    return lo;
+}
+
+/* First keyframe of stream s with pts >= time, or -1. */
+static int
+avi_index_find_key(muxed_stream_t *ms, int s, uint64_t time)
+{
+    avi_stream_t *st = &((avi_file_t *) ms->private)->streams[s];
+    int lo = 0, hi = st->nkeys;
+    avi_index_t ai;
+
+    while(lo < hi){
+        int m = (lo + hi) / 2;
+        avi_index_get(ms, s, st->keys[m], &ai);
+        if(ai.pts < time)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+
+    return lo < st->nkeys? st->keys[lo]: -1;
+}
+
+/* The stream whose next index entry comes first in the file, or -1
+   if all are exhausted. */
+static int
+avi_index_next(muxed_stream_t *ms, uint64_t *offset)
+{
+    avi_file_t *af = ms->private;
+    uint64_t off = -1;
+    int i, s = -1;
+
+    for(i = 0; i < ms->n_streams; i++){
+        avi_stream_t *st = af->streams + i;
+        if(st->pkt < st->idxlen){
+            uint64_t o = avi_index_offset(st, st->pkt);
+            if(o < off){
+                off = o;
+                s = i;
+            }
         }
-    } else if(ms->streams[s].stream_type == STREAM_TYPE_VIDEO){
-        st->index[ixl].pts = 27000000LL * ixl * st->scale / st->rate;
     }
 
-    st->size += size;
-    st->idxlen++;
+    if(s >= 0 && offset)
+        *offset = off;
 
-    return 0;
+    return s;
 }
 
 static int
@@ -235,9 +419,15 @@ avi_read_idx1(muxed_stream_t *ms, uint32_t size)
     int idxl = size / sizeof(avi_idx1_t);
     int i, s;
     avi_idx1_t idx1;
+    const avi_idx1_t *map;
+
+    /* Parse the index in place if the file is mapped. */
+    map = url_readahead_map(af->file, idxl * sizeof(avi_idx1_t));
 
     for(i = 0; i < idxl; i++){
-        if(af->file->read(&idx1, sizeof(idx1), 1, af->file) <= 0)
+        if(map)
+            memcpy(&idx1, map + i, sizeof(idx1));
+        else if(af->file->read(&idx1, sizeof(idx1), 1, af->file) <= 0)
             break;
 
         if(!valid_tag(idx1.tag, 0)){
@@ -361,40 +551,33 @@ avi_read_indx(muxed_stream_t *ms)
     return 0;
 }
 
+/* The index is read on the first packet or seek, using the chunk
+   positions noted while parsing the header. */
 static void
-avi_merge_index(muxed_stream_t *ms)
+avi_load_index(muxed_stream_t *ms)
 {
     avi_file_t *af = ms->private;
-    int i, j;
+    uint64_t pos = af->file->tell(af->file);
+    int i, n = 0;
 
-    for(i = 0; i < ms->n_streams; i++){
-        af->idxlen += af->streams[i].idxlen;
-    }
+    af->idxloaded = 1;
 
-    if(af->idxlen){
-        avi_index_t *sx[ms->n_streams];
-        for(i = 0; i < ms->n_streams; i++)
-            sx[i] = af->streams[i].index;
-
-        af->index = calloc(af->idxlen, sizeof(*af->index));
-        for(i = 0; i < af->idxlen; i++){
-            int x = -1;
-            for(j = 0; j < ms->n_streams; j++){
-                if(!sx[j])
-                    continue;
-                if(!af->index[i])
-                    af->index[i] = sx[j];
-                if(af->index[i] && sx[j]->offset <= af->index[i]->offset){
-                    af->index[i] = sx[j];
-                    x = j;
-                }
-            }
-            if(x >= 0 &&
-               ++sx[x] - af->streams[x].index == af->streams[x].idxlen){
-                sx[x] = NULL;
-            }
+    if(af->nindx){
+        for(i = 0; i < af->nindx; i++){
+            af->file->seek(af->file, af->indx[i], SEEK_SET);
+            avi_read_indx(ms);
         }
+    } else if(af->idx1_size){
+        af->file->seek(af->file, af->idx1_pos, SEEK_SET);
+        avi_read_idx1(ms, af->idx1_size);
     }
+
+    for(i = 0; i < ms->n_streams; i++)
+        n += af->streams[i].idxlen;
+
+    tc2_print("AVI", TC2_PRINT_DEBUG, "loaded %i index entries\n", n);
+
+    af->file->seek(af->file, pos, SEEK_SET);
 }
 
 static muxed_stream_t *
@@ -407,7 +590,6 @@ avi_header(url_t *f)
     uint32_t ftime = 0, start = 0;
     char st[5] = {[4] = 0};
     uint64_t fsize, pos;
-    int odml_idx = 0;
     stream_t *vs = NULL;
 
     fsize = f->size;
@@ -642,13 +824,13 @@ avi_header(url_t *f)
             break;
         }
         case TAG('i','d','x','1'):{
-            if(!odml_idx)
-                avi_read_idx1(ms, size);
+            af->idx1_pos = pos;
+            af->idx1_size = size;
             break;
         }
         case TAG('i','n','d','x'):{
-            avi_read_indx(ms);
-            odml_idx = 1;
+            af->indx = realloc(af->indx, (af->nindx + 1) * sizeof(*af->indx));
+            af->indx[af->nindx++] = pos;
             break;
         }
         case TAG('R','I','F','F'):{
@@ -696,8 +878,6 @@ avi_header(url_t *f)
         f->seek(f, pos + size, SEEK_SET);
     }
 
-    avi_merge_index(ms);
-
     if(vs){
         ms->time = (uint64_t) vs->video.frames * vs->video.frame_rate.den *
             27000000LL / vs->video.frame_rate.num;
@@ -758,11 +938,16 @@ avi_packet(muxed_stream_t *ms, int stream)
     uint32_t flags = 0;
     uint64_t pts = 0;
     int pflags = 0;
-    uint64_t pos;
+    uint64_t pos, ipos;
+    avi_stream_t *sp;
+    int istr;
 
     if(stream > -2 && (pk = tclist_shift(af->packets)))
         return (tcvp_packet_t *) pk;
 
+    if(!af->idxloaded)
+        avi_load_index(ms);
+
     /* FIXME: get rid of gotos */
  again:
     pos = af->file->tell(af->file);
@@ -792,8 +977,8 @@ avi_packet(muxed_stream_t *ms, int stream)
                       "Bad chunk tag %02x%02x%02x%02x:%s @ %08llx\n",
                       tag[0], tag[1], tag[2], tag[3],
                       strtag(tag, stag), pos);
-        if(!tried_index && af->idxok > 256 && af->idxlen > af->pkt){
-            uint64_t p = af->index[af->pkt]->offset;
+        if(!tried_index && af->idxok > 256 && avi_index_next(ms, &ipos) >= 0){
+            uint64_t p = ipos;
             tc2_print("AVI", TC2_PRINT_DEBUG, "Index => %16llx\n", p);
             af->file->seek(af->file, p, SEEK_SET);
             tried_index++;
@@ -806,11 +991,11 @@ avi_packet(muxed_stream_t *ms, int stream)
             tried_bkup++;
             goto again;
         } else if(skipped < max_skip && af->idxok > 256 &&
-                  af->idxlen > af->pkt){
+                  (istr = avi_index_next(ms, &ipos)) >= 0){
             if(!skipped)
                 tc2_print("AVI", TC2_PRINT_WARNING, "Skipping chunk.\n");
-            af->file->seek(af->file, af->index[af->pkt]->offset, SEEK_SET);
-            af->pkt++;
+            af->file->seek(af->file, ipos, SEEK_SET);
+            af->streams[istr].pkt++;
             skipped++;
             goto again;
         } else if(scan < max_scan){
@@ -852,17 +1037,17 @@ avi_packet(muxed_stream_t *ms, int stream)
         scan++;
     }
 
-    if(af->index){
-        int i;
+    if(af->idxok || avi_index_next(ms, NULL) >= 0){
+        int i, found = 0;
 
-        for(i = af->pkt; i < af->idxlen; i++){
-            if(pos <= af->index[i]->offset){
-                af->pkt = i;
-                break;
-            }
+        for(i = 0; i < ms->n_streams; i++){
+            avi_stream_t *st = af->streams + i;
+            while(st->pkt < st->idxlen && avi_index_offset(st, st->pkt) < pos)
+                st->pkt++;
+            found |= st->pkt < st->idxlen;
         }
 
-        if(i != af->pkt){
+        if(!found && af->idxok){
             tc2_print("AVI", TC2_PRINT_WARNING, "Can't resync index.\n");
             af->idxok = 0;
         }
@@ -881,25 +1066,30 @@ avi_packet(muxed_stream_t *ms, int stream)
         tried_bkup = 0;
         scan = 0;
         skipped = 0;
-        af->pkt++;
         goto again;
     }
 
-    if(af->pkt < af->idxlen){
-        if(af->index[af->pkt]->offset == pos){
+    sp = af->streams + str;
+    if(sp->pkt < sp->idxlen){
+        avi_index_t ai;
+
+        avi_index_get(ms, str, sp->pkt, &ai);
+        if(ai.offset == pos){
             af->idxok++;
-            flags = af->index[af->pkt]->flags;
+            flags = ai.flags;
             if(flags & AVI_FLAG_KEYFRAME)
                 pflags |= TCVP_PKT_FLAG_KEY;
-            pts = af->index[af->pkt]->pts + starttime;
+            pts = ai.pts + starttime;
             pflags |= TCVP_PKT_FLAG_DTS;
+            sp->pkt++;
         } else if(af->idxok){
             tc2_print("AVI", TC2_PRINT_WARNING,
                       "index mismatch stream %i\n", str);
             af->idxok = 0;
         }
-    } else if(af->pkt == af->idxlen){
+    } else if(sp->idxlen && sp->pkt == sp->idxlen){
         tc2_print("AVI", TC2_PRINT_WARNING, "truncated index\n");
+        sp->pkt++;
     }
 
     af->fpos = pos;
@@ -919,8 +1109,6 @@ avi_packet(muxed_stream_t *ms, int stream)
         pk->pk.pts = pts;
     }
 
-    af->pkt++;
-
     return (tcvp_packet_t *) pk;
 }
 
@@ -932,29 +1120,45 @@ avi_seek(muxed_stream_t *ms, uint64_t time)
     avi_packet_t *pk;
     int fi[ms->n_streams];
     int i, cfi = 0;
+    uint64_t t0 = time;
+    avi_index_t ai;
+
+    if(!af->idxloaded)
+        avi_load_index(ms);
+
+    /* Land on the first video keyframe at or after the requested
+       time, starting at the earliest chunk of any stream at or after
+       the requested time. */
+    if(af->has_video){
+        for(i = 0; i < ms->n_streams; i++){
+            int k;
+            if(ms->streams[i].stream_type != STREAM_TYPE_VIDEO)
+                continue;
+            if((k = avi_index_find_key(ms, i, t0)) < 0)
+                continue;
+            avi_index_get(ms, i, k, &ai);
+            time = ai.pts;
+            pos = ai.offset;
+            break;
+        }
+        if(pos == -1)
+            return -1LL;
+    }
 
-    for(i = 0; i < af->idxlen; i++){
-        if(time <= af->index[i]->pts){
-            if(af->index[i]->offset < pos)
-                pos = af->index[i]->offset;
-            if(!af->has_video)
-                break;
-            if(af->index[i]->flags & AVI_FLAG_KEYFRAME){
-                time = af->index[i]->pts;
-                break;
-            }
+    for(i = 0; i < ms->n_streams; i++){
+        int e = avi_index_find_pts(ms, i, t0);
+        if(e < af->streams[i].idxlen){
+            avi_index_get(ms, i, e, &ai);
+            if(ai.offset < pos)
+                pos = ai.offset;
         }
     }
 
     if(pos == -1)
         return -1LL;
 
-    for(i = 0; i < af->idxlen; i++){
-        if(af->index[i]->offset >= pos){
-            af->pkt = i;
-            break;
-        }
-    }
+    for(i = 0; i < ms->n_streams; i++)
+        af->streams[i].pkt = avi_index_find_pos(af->streams + i, pos);
 
     while((pk = tclist_shift(af->packets)))
         avi_free_packet(&pk->pk);
@@ -1004,19 +1208,24 @@ avi_packet_ni(muxed_stream_t *ms, int str)
     if(str < 0)
         return avi_packet(ms, str);
 
+    if(!af->idxloaded)
+        avi_load_index(ms);
+
     if(as->pkt < as->idxlen){
-        avi_index_t *ai = as->index + as->pkt++;
+        avi_index_t ai;
+
+        avi_index_get(ms, str, as->pkt++, &ai);
 
-        pk = avi_alloc_packet(ai->size);
-        af->file->seek(af->file, ai->offset + 8, SEEK_SET);
-        af->file->read(pk->data, 1, ai->size, af->file);
+        pk = avi_alloc_packet(ai.size);
+        af->file->seek(af->file, ai.offset + 8, SEEK_SET);
+        af->file->read(pk->data, 1, ai.size, af->file);
         pk->pk.stream = str;
         pk->pk.flags = 0;
-        if(ai->flags & AVI_FLAG_KEYFRAME)
+        if(ai.flags & AVI_FLAG_KEYFRAME)
             pk->pk.flags |= TCVP_PKT_FLAG_KEY;
         pk->pk.flags |= TCVP_PKT_FLAG_DTS;
-        pk->pk.dts = ai->pts;
-        pk->flags = ai->flags;
+        pk->pk.dts = ai.pts;
+        pk->flags = ai.flags;
     }
 
     return (tcvp_packet_t *) pk;
@@ -1026,31 +1235,24 @@ static uint64_t
 avi_seek_ni(muxed_stream_t *ms, uint64_t time)
 {
     avi_file_t *af = ms->private;
+    avi_index_t ai;
     int i, j;
 
+    if(!af->idxloaded)
+        avi_load_index(ms);
+
     for(j = 0; j < ms->n_streams; j++){
-        if(ms->used_streams[j]){
-            for(i = 0; i < af->streams[j].idxlen; i++){
-                if(time <= af->streams[j].index[i].pts){
-                    if(ms->streams[j].stream_type != STREAM_TYPE_VIDEO ||
-                       (af->streams[j].index[i].flags & AVI_FLAG_KEYFRAME))
-                        break;
-                }
-            }
-            if(ms->streams[j].stream_type == STREAM_TYPE_VIDEO)
-                time = af->streams[j].index[i].pts;
+        if(ms->used_streams[j] &&
+           ms->streams[j].stream_type == STREAM_TYPE_VIDEO &&
+           (i = avi_index_find_key(ms, j, time)) >= 0){
+            avi_index_get(ms, j, i, &ai);
+            time = ai.pts;
         }
     }
 
     for(j = 0; j < ms->n_streams; j++){
-        if(ms->used_streams[j]){
-            for(i = 0; i < af->streams[j].idxlen; i++){
-                if(time <= af->streams[j].index[i].pts){
-                    af->streams[j].pkt = i;
-                    break;
-                }
-            }
-        }
+        if(ms->used_streams[j])
+            af->streams[j].pkt = avi_index_find_pts(ms, j, time);
     }
 
     return time;
@@ -1068,10 +1270,12 @@ avi_free(void *p)
     for(i = 0; i < ms->n_streams; i++){
         free(ms->streams[i].common.codec_data);
         free(af->streams[i].index);
+        free(af->streams[i].iblk);
+        free(af->streams[i].keys);
     }
 
     free(af->streams);
-    free(af->index);
+    free(af->indx);
 
     tcfree(af->file);
     free(af);
@@ -40,7 +40,15 @@ typedef struct flac_metadata {
 #define FLAC_META_CUESHEET       5
 #define FLAC_META_INVALID      127
 
+#define FLAC_MIN_HEADER_SIZE 6
+
 extern uint8_t flac_crc8(const uint8_t *data, unsigned len);
 extern uint16_t flac_crc16(const uint8_t *data, unsigned len);
 
+extern int flr_frame_header(u_char *buf, int size);
+extern uint64_t flr_frame_number(u_char *buf);
+
+extern demux_index_t *flac_index_scan(char *name, uint64_t start,
+                                      int blocksize, int sample_rate);
+
 #endif
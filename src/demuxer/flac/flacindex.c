@@ -0,0 +1,148 @@
+/**
+    Copyright (C) 2006  Michael Ahlberg, Måns Rullgård
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+**/
+
+/* Frame walker for the FLAC seek index.
+
+   Entries map the first sample of a frame to its offset from the
+   first frame header, like SEEKTABLE points.  The table itself lives
+   in demux/index; it is either filled from the SEEKTABLE or built
+   there by running fidx_walk, keeping a frame every half second.  A
+   frame is only recorded once the CRC-16 up to the next header
+   matches. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tcendian.h>
+#include <flacfile_tc2.h>
+#include "flac.h"
+
+#define IDX_CHUNK 262144
+#define IDX_MAGIC "TCVPFLI2"
+
+struct fidx_stream {
+    uint64_t start;
+    int blocksize;
+};
+
+/* Offset of the next frame header in buf[i..n), or -1. */
+static int
+fidx_next_header(uint8_t *buf, int i, int n)
+{
+    for(; i < n - FLAC_MIN_HEADER_SIZE; i++){
+        if(buf[i] != 0xff)
+            continue;
+        if(flr_frame_header(buf + i, n - i) > 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Walk frames from where the table left off, which is always at a
+   frame header.  f is the start of the current frame within buf, j a
+   candidate for the next one. */
+static void
+fidx_walk(demux_index_t *idx, url_t *u, void *private)
+{
+    struct fidx_stream *fs = private;
+    uint64_t bpos, s;
+    int n = 0, f = 0, j;
+    int eof = 0, stop = 0;
+    uint8_t *buf;
+
+    demux_index_resume(idx, &bpos, &s);
+
+    if(u->seek(u, fs->start + bpos, SEEK_SET))
+        return;
+
+    buf = malloc(IDX_CHUNK);
+
+    while(!stop && !eof){
+        int r = u->read(buf + n, 1, IDX_CHUNK - n, u);
+
+        if(r <= 0)
+            eof = 1;
+        else
+            n += r;
+
+        j = f + FLAC_MIN_HEADER_SIZE;
+
+        while((j = fidx_next_header(buf, j, n)) > 0){
+            uint16_t crc = flac_crc16(buf + f, j - f - 2);
+
+            if(crc != htob_16(unaligned16(buf + j - 2))){
+                j++;
+                continue;
+            }
+
+            if(flr_frame_header(buf + f, j - f) > 0)
+                demux_index_add(idx, flr_frame_number(buf + f) *
+                                fs->blocksize, bpos + f);
+
+            f = j;
+            j += FLAC_MIN_HEADER_SIZE;
+        }
+
+        if(f == 0 && n == IDX_CHUNK){
+            /* no frame end in a full buffer, resync */
+            f = fidx_next_header(buf, 1, n);
+            if(f < 0)
+                f = n - FLAC_MIN_HEADER_SIZE;
+        }
+
+        memmove(buf, buf + f, n - f);
+        n -= f;
+        bpos += f;
+        f = 0;
+
+        stop = demux_index_progress(idx, bpos, 0, eof);
+    }
+
+    free(buf);
+}
+
+/* Start indexing the frames of a file.  start is the offset of the
+   first frame header. */
+extern demux_index_t *
+flac_index_scan(char *name, uint64_t start, int blocksize, int sample_rate)
+{
+    struct fidx_stream *fs;
+    demux_index_t *idx;
+
+    fs = malloc(sizeof(*fs));
+    fs->start = start;
+    fs->blocksize = blocksize;
+
+    idx = demux_index_open(name, IDX_MAGIC, tcvp_format_flac_conf_index_dir,
+                           "flacindex", sample_rate / 2, fidx_walk, fs);
+    if(!idx){
+        free(fs);
+        return NULL;
+    }
+
+    demux_index_scan(idx);
+
+    return idx;
+}
@@ -40,6 +40,10 @@ typedef struct flacread {
     int bpos, bend;
     int frame;
     int eof;
+    uint64_t start;
+    int blocksize;
+    uint64_t target;
+    demux_index_t *index;
 } flacread_t;
 
 typedef struct flacread_packet {
@@ -48,8 +52,6 @@ typedef struct flacread_packet {
     int size;
 } flacread_packet_t;
 
-#define MIN_HEADER_SIZE 6
-
 static void
 flr_free_pk(void *p)
 {
@@ -76,7 +78,27 @@ utf8_size(int v)
     return s;
 }
 
-static int
+/* Frame number from the UTF-8 coded field of a fixed block size
+   frame header. */
+extern uint64_t
+flr_frame_number(u_char *buf)
+{
+    u_char *p = buf + 4;
+    int n = utf8_size(*p);
+    uint64_t v;
+    int i;
+
+    if(n == 1)
+        return *p;
+
+    v = *p & ((1 << (7 - n)) - 1);
+    for(i = 1; i < n; i++)
+        v = v << 6 | (p[i] & 0x3f);
+
+    return v;
+}
+
+extern int
 flr_frame_header(u_char *buf, int size)
 {
     u_char *p = buf;
@@ -144,6 +166,46 @@ flr_frame_header(u_char *buf, int size)
     return hsize;
 }
 
+static uint64_t
+flr_sample(flacread_t *flr, u_char *p)
+{
+    return flr_frame_number(p) * flr->blocksize;
+}
+
+/* After a seek, drop frames that end before the target sample.  next
+   is the offset of the following frame header. */
+static int
+flr_skip(flacread_t *flr, int next)
+{
+    if(flr->target == -1LL || next > flr->bend - FLAC_MIN_HEADER_SIZE)
+        return 0;
+
+    return flr_sample(flr, flr->buf + next) <= flr->target;
+}
+
+/* Timestamp a frame, trimming the samples before a seek target. */
+static void
+flr_stamp(flacread_t *flr, flacread_packet_t *fp)
+{
+    uint64_t fs;
+
+    if(!flr->blocksize || !flr->s.audio.sample_rate)
+        return;
+
+    fs = flr_sample(flr, fp->data);
+
+    if(flr->target != -1LL){
+        if(flr->target > fs){
+            fp->pk.flags |= TCVP_PKT_FLAG_TRIM;
+            fp->pk.trim = flr->target - fs;
+        }
+        flr->target = -1LL;
+    }
+
+    fp->pk.flags |= TCVP_PKT_FLAG_PTS;
+    fp->pk.pts = fs * 27000000LL / flr->s.audio.sample_rate;
+}
+
 extern tcvp_packet_t *
 flr_packet(muxed_stream_t *ms, int s)
 {
@@ -167,7 +229,7 @@ flr_packet(muxed_stream_t *ms, int s)
 
         tc2_print("FLAC", TC2_PRINT_DEBUG+2, "searching for header @%4x\n", i);
 
-        for(; i < flr->bend - MIN_HEADER_SIZE; i++){
+        for(; i < flr->bend - FLAC_MIN_HEADER_SIZE; i++){
             hsize = flr_frame_header(flr->buf + i, flr->bend - i);
             if(hsize > 0)
                 break;
@@ -180,7 +242,7 @@ flr_packet(muxed_stream_t *ms, int s)
             uint16_t crc, fcrc;
             int size;
 
-            if(i == flr->bend - MIN_HEADER_SIZE){
+            if(i == flr->bend - FLAC_MIN_HEADER_SIZE){
                 i = flr->bend;
                 flr->eof++;
             }
@@ -193,13 +255,14 @@ flr_packet(muxed_stream_t *ms, int s)
                       "frame %3i @%4x, size %5i header %i, crc %04x %04x\n",
                       flr->frame++, flr->bpos, size, hsize, crc, fcrc);
 
-            if(crc == fcrc){
+            if(crc == fcrc && !flr_skip(flr, i)){
                 fp = tcallocdz(sizeof(*fp), NULL, flr_free_pk);
                 fp->pk.data = &fp->data;
                 fp->pk.sizes = &fp->size;
                 fp->size = size;
                 fp->data = flr->buf + flr->bpos;
                 fp->buf = tcref(flr->buf);
+                flr_stamp(flr, fp);
             }
 
             if(crc == fcrc || (i < flr->bend - 2 &&
@@ -213,7 +276,7 @@ flr_packet(muxed_stream_t *ms, int s)
             }
         }
 
-        if(i >= flr->bend - (hsize > 0? hsize: MIN_HEADER_SIZE) && !flr->eof){
+        if(i >= flr->bend - (hsize > 0? hsize: FLAC_MIN_HEADER_SIZE) && !flr->eof){
             u_char *nb;
 
             if(flr->bpos == 0)
@@ -353,6 +416,22 @@ flr_metadata(url_t *u, flac_metadata_t *fm)
     return 0;
 }
 
+static void
+flr_seektable(flacread_t *flr, u_char *p, int size)
+{
+    for(; size >= 18; p += 18, size -= 18){
+        uint64_t sample = htob_64(unaligned64(p));
+        uint64_t pos = htob_64(unaligned64(p + 8));
+
+        if(sample == -1LL)
+            continue;
+
+        if(!flr->index)
+            flr->index = demux_index_new(0);
+        demux_index_add(flr->index, sample, pos);
+    }
+}
+
 static int
 flr_header(muxed_stream_t *ms)
 {
@@ -364,6 +443,9 @@ flr_header(muxed_stream_t *ms)
         switch(fm.type){
         case FLAC_META_STREAMINFO:
             err = flr_streaminfo(ms, &flr->s, fm.data, fm.size);
+            if(!err && htob_16(unaligned16(fm.data)) ==
+               htob_16(unaligned16(fm.data + 2)))
+                flr->blocksize = htob_16(unaligned16(fm.data));
             flr->s.common.codec_data = fm.data;
             flr->s.common.codec_data_size = fm.size;
             fm.data = NULL;
@@ -372,6 +454,7 @@ flr_header(muxed_stream_t *ms)
             err = flr_comment(ms, fm.data, fm.size);
             break;
         case FLAC_META_SEEKTABLE:
+            flr_seektable(flr, fm.data, fm.size);
             break;
         case FLAC_META_APPLICATION:
             break;
@@ -399,12 +482,81 @@ flr_free(void *p)
     muxed_stream_t *ms = p;
     flacread_t *flr = ms->private;
 
+    if(flr->index)
+        tcfree(flr->index);
     tcfree(flr->url);
     tcfree(flr->buf);
     free(flr->s.common.codec_data);
     free(flr);
 }
 
+/* Fill the buffer from the current position and move to the first
+   frame header in it. */
+static int
+flr_sync(flacread_t *flr)
+{
+    int n, i;
+
+    tcfree(flr->buf);
+    flr->buf = tcalloc(flr->bufsize);
+    flr->bpos = 0;
+    flr->bend = 0;
+    flr->eof = 0;
+
+    n = flr->url->read(flr->buf, 1, flr->bufsize, flr->url);
+    if(n <= 0)
+        return -1;
+    flr->bend = n;
+
+    for(i = 0; i < n - FLAC_MIN_HEADER_SIZE; i++){
+        if(flr_frame_header(flr->buf + i, n - i) > 0){
+            flr->bpos = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static uint64_t
+flr_seek(muxed_stream_t *ms, uint64_t time)
+{
+    flacread_t *flr = ms->private;
+    int rate = flr->s.audio.sample_rate;
+    uint64_t sample, isample, pos;
+
+    sample = time * rate / 27000000;
+    if(sample >= flr->s.audio.samples)
+        return -1LL;
+
+    if(!flr->index || demux_index_find(flr->index, sample, &isample, &pos)){
+        uint64_t size = flr->url->size - flr->start;
+        double bps = (double) size / flr->s.audio.samples;
+
+        /* guess, one second early */
+        isample = sample > rate? sample - rate: 0;
+        pos = isample * bps;
+    }
+
+    if(flr->url->seek(flr->url, flr->start + pos, SEEK_SET) ||
+       flr_sync(flr))
+        return -1LL;
+
+    isample = flr_sample(flr, flr->buf + flr->bpos);
+    if(isample > sample)
+        sample = isample;
+
+    tc2_print("FLAC", TC2_PRINT_DEBUG,
+              "seek to sample %llu from frame at %llu, sample %llu\n",
+              (unsigned long long) sample,
+              (unsigned long long) (flr->start + pos + flr->bpos),
+              (unsigned long long) isample);
+
+    flr->target = sample;
+
+    return sample * 27000000LL / rate;
+}
+
 extern muxed_stream_t *
 flr_open(char *name, url_t *u, tcconf_section_t *conf, tcvp_timer_t *tm)
 {
@@ -437,6 +589,20 @@ flr_open(char *name, url_t *u, tcconf_section_t *conf, tcvp_timer_t *tm)
 
     flr->bufsize = BUFSIZE;
     flr->buf = tcalloc(flr->bufsize);
+    flr->target = -1LL;
+
+    if(flr->blocksize && flr->s.audio.sample_rate && flr->s.audio.samples &&
+       !(u->flags & URL_FLAG_STREAMED)){
+        int index = tcvp_format_flac_conf_index;
+
+        tcconf_getvalue(conf, "index", "%i", &index);
+
+        flr->start = u->tell(u);
+        if(!flr->index && index)
+            flr->index = flac_index_scan(name, flr->start, flr->blocksize,
+                                         flr->s.audio.sample_rate);
+        ms->seek = flr_seek;
+    }
 
     return ms;
 }
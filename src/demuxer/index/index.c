@@ -0,0 +1,425 @@
+/**
+    Copyright (C) 2005  Michael Ahlberg, Måns Rullgård
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+**/
+
+/* On-disk cache for demuxer seek indexes.
+
+   A cache file is named by a hash of the file name, size and the
+   first bytes of the file, and holds a header followed by an array
+   of fixed size entries whose layout is up to the demuxer.  Files
+   are written to a temporary name and renamed into place, so a
+   reader never sees a partial index.  Demuxers that seek by sample
+   keep their tables here and supply only a frame walker. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <tcstring.h>
+#include <tcalloc.h>
+#include <tctypes.h>
+#include <index_tc2.h>
+
+#define FNV_PRIME 0x100000001b3ULL
+
+/* Cache file name for a file, or NULL if there is no usable cache
+   directory.  dir overrides the default ~/.tcvp/<sub>. */
+extern char *
+idx_cache(char *name, uint64_t size, u_char *key, int ksize,
+          char *dir, char *sub)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    char *home, *cn;
+    int i;
+
+    for(i = 0; name[i]; i++)
+        h = (h ^ (u_char) name[i]) * FNV_PRIME;
+    for(i = 0; i < 8; i++)
+        h = (h ^ ((size >> (8 * i)) & 0xff)) * FNV_PRIME;
+    for(i = 0; i < ksize; i++)
+        h = (h ^ key[i]) * FNV_PRIME;
+
+    if(!dir){
+        if(!(home = getenv("HOME"))){
+            tc2_print("INDEX", TC2_PRINT_WARNING,
+                      "HOME not set, %s will not be cached\n", sub);
+            return NULL;
+        }
+        dir = alloca(strlen(home) + strlen(sub) + 8);
+        sprintf(dir, "%s/.tcvp/%s", home, sub);
+    }
+
+    if(tcmkpath(dir, 0755)){
+        tc2_print("INDEX", TC2_PRINT_WARNING,
+                  "can't create %s, %s will not be cached\n", dir, sub);
+        return NULL;
+    }
+
+    cn = malloc(strlen(dir) + 18);
+    sprintf(cn, "%s/%016llx", dir, (unsigned long long) h);
+
+    return cn;
+}
+
+/* Read a cached index.  hdr->magic and hdr->size must match the
+   file; the rest of hdr is filled in.  Returns the hdr->n entries,
+   or NULL if there is no valid cache. */
+extern void *
+idx_load(char *cache, demux_index_header_t *hdr, size_t esize)
+{
+    demux_index_header_t fh;
+    void *e = NULL;
+    FILE *f;
+
+    if(!(f = fopen(cache, "r")))
+        return NULL;
+
+    if(fread(&fh, sizeof(fh), 1, f) != 1 ||
+       memcmp(fh.magic, hdr->magic, 8) || fh.size != hdr->size)
+        goto out;
+
+    if(!(e = malloc(fh.n * esize + 1)))
+        goto out;
+
+    if(fread(e, esize, fh.n, f) != fh.n){
+        tc2_print("INDEX", TC2_PRINT_WARNING, "%s: short index\n", cache);
+        free(e);
+        e = NULL;
+        goto out;
+    }
+
+    *hdr = fh;
+
+out:
+    fclose(f);
+    return e;
+}
+
+/* Write an index.  Returns 0 on success. */
+extern int
+idx_save(char *cache, demux_index_header_t *hdr, void *e, size_t esize)
+{
+    char *tmp;
+    FILE *f;
+    int ok;
+
+    tmp = alloca(strlen(cache) + 5);
+    sprintf(tmp, "%s.tmp", cache);
+
+    if(!(f = fopen(tmp, "w"))){
+        tc2_print("INDEX", TC2_PRINT_WARNING, "can't write %s\n", tmp);
+        return -1;
+    }
+
+    ok = fwrite(hdr, sizeof(*hdr), 1, f) == 1 &&
+        fwrite(e, esize, hdr->n, f) == hdr->n;
+
+    if(fclose(f) || !ok || rename(tmp, cache)){
+        tc2_print("INDEX", TC2_PRINT_WARNING, "can't write %s\n", cache);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Sample tables.
+
+   A table maps the first sample of a frame to its byte offset, kept
+   sorted and thinned to one entry per interval samples.  Tables are
+   filled directly by the demuxer, e.g. from a seek table in the
+   file, or by a thread running the demuxer's frame walker on its
+   own handle.  A walked table is loaded from the cache when opened
+   and saved when the walk ends. */
+
+#define IDX_KEY_BYTES 4096
+
+struct demux_index_entry {
+    uint64_t sample;
+    uint64_t pos;
+};
+
+struct demux_index {
+    pthread_mutex_t lock;
+    pthread_t th;
+    int running;
+    volatile int stop;
+    char *name;
+    char *cache;
+    char magic[8];
+    uint64_t size;
+    int interval;
+    demux_index_walk_t walk;
+    void *private;
+    uint64_t done;
+    uint64_t samples;
+    int complete;
+    int dirty;
+    struct demux_index_entry *e;
+    int n, a;
+};
+
+static void
+idx_free(void *p)
+{
+    demux_index_t *idx = p;
+
+    if(idx->running){
+        idx->stop = 1;
+        pthread_join(idx->th, NULL);
+    }
+
+    pthread_mutex_destroy(&idx->lock);
+    free(idx->e);
+    free(idx->cache);
+    free(idx->name);
+    free(idx->private);
+}
+
+/* Empty, complete table to be filled with idx_add.  interval is the
+   minimum sample distance between entries. */
+extern demux_index_t *
+idx_new(int interval)
+{
+    demux_index_t *idx;
+
+    idx = tcallocdz(sizeof(*idx), NULL, idx_free);
+    pthread_mutex_init(&idx->lock, NULL);
+    idx->interval = interval;
+    idx->complete = 1;
+
+    return idx;
+}
+
+static void
+idx_load_table(demux_index_t *idx)
+{
+    demux_index_header_t hdr;
+    struct demux_index_entry *e;
+
+    memcpy(hdr.magic, idx->magic, 8);
+    hdr.size = idx->size;
+
+    if(!(e = idx_load(idx->cache, &hdr, sizeof(*e))))
+        return;
+
+    pthread_mutex_lock(&idx->lock);
+    free(idx->e);
+    idx->e = e;
+    idx->n = idx->a = hdr.n;
+    idx->done = hdr.done;
+    idx->samples = hdr.samples;
+    idx->complete = hdr.complete;
+    pthread_mutex_unlock(&idx->lock);
+
+    tc2_print("INDEX", TC2_PRINT_DEBUG,
+              "loaded %i index entries, %llu bytes indexed\n",
+              hdr.n, (unsigned long long) hdr.done);
+}
+
+static void
+idx_save_table(demux_index_t *idx)
+{
+    demux_index_header_t hdr;
+
+    pthread_mutex_lock(&idx->lock);
+    memcpy(hdr.magic, idx->magic, 8);
+    hdr.size = idx->size;
+    hdr.done = idx->done;
+    hdr.samples = idx->samples;
+    hdr.complete = idx->complete;
+    hdr.n = idx->n;
+    idx_save(idx->cache, &hdr, idx->e, sizeof(*idx->e));
+    idx->dirty = 0;
+    pthread_mutex_unlock(&idx->lock);
+}
+
+/* Table of a file to be built by walk, loaded from the cache in dir,
+   default ~/.tcvp/<sub>, if there is one.  private is passed to walk
+   and freed with the table. */
+extern demux_index_t *
+idx_open(char *name, char *magic, char *dir, char *sub, int interval,
+         demux_index_walk_t walk, void *private)
+{
+    demux_index_t *idx;
+    u_char key[IDX_KEY_BYTES];
+    url_t *u;
+    int n;
+
+    if(!(u = url_open(name, "r")))
+        return NULL;
+
+    idx = idx_new(interval);
+    idx->complete = 0;
+    idx->name = strdup(name);
+    memcpy(idx->magic, magic, 8);
+    idx->size = u->size;
+    idx->walk = walk;
+    idx->private = private;
+
+    n = u->read(key, 1, IDX_KEY_BYTES, u);
+    u->close(u);
+
+    if(n <= 0){
+        tcfree(idx);
+        return NULL;
+    }
+
+    idx->cache = idx_cache(name, idx->size, key, n, dir, sub);
+    if(idx->cache)
+        idx_load_table(idx);
+
+    return idx;
+}
+
+static void *
+idx_run(void *p)
+{
+    demux_index_t *idx = p;
+    url_t *u;
+
+    if(!(u = url_open(idx->name, "r")))
+        return NULL;
+
+    idx->walk(idx, u, idx->private);
+    u->close(u);
+
+    tc2_print("INDEX", TC2_PRINT_DEBUG, "%s: %i index entries%s\n",
+              idx->name, idx->n, idx->complete? "": " (partial)");
+
+    if(idx->cache && idx->dirty)
+        idx_save_table(idx);
+
+    return NULL;
+}
+
+/* Finish the table in the background.  Does nothing if it is
+   complete or already being built. */
+extern void
+idx_scan(demux_index_t *idx)
+{
+    pthread_mutex_lock(&idx->lock);
+    if(!idx->complete && !idx->running &&
+       !pthread_create(&idx->th, NULL, idx_run, idx))
+        idx->running = 1;
+    pthread_mutex_unlock(&idx->lock);
+}
+
+/* Add an entry.  Entries before the last one, or closer to it than
+   the interval, are dropped. */
+extern void
+idx_add(demux_index_t *idx, uint64_t sample, uint64_t pos)
+{
+    pthread_mutex_lock(&idx->lock);
+    if(idx->n && (sample <= idx->e[idx->n-1].sample ||
+                  sample < idx->e[idx->n-1].sample + idx->interval))
+        goto out;
+    if(idx->n == idx->a){
+        idx->a = idx->a? 2 * idx->a: 256;
+        idx->e = realloc(idx->e, idx->a * sizeof(*idx->e));
+    }
+    idx->e[idx->n].sample = sample;
+    idx->e[idx->n].pos = pos;
+    idx->n++;
+    idx->dirty = 1;
+out:
+    pthread_mutex_unlock(&idx->lock);
+}
+
+/* Find the last entry at or before sample.  Fails unless the table
+   reaches past sample. */
+extern int
+idx_find(demux_index_t *idx, uint64_t sample, uint64_t *isample,
+         uint64_t *pos)
+{
+    int lo = 0, hi, ok;
+
+    pthread_mutex_lock(&idx->lock);
+
+    hi = idx->n;
+    while(lo < hi){
+        int m = (lo + hi) / 2;
+        if(idx->e[m].sample <= sample)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+
+    ok = lo > 0 && (lo < idx->n || idx->complete);
+    if(ok){
+        *isample = idx->e[lo-1].sample;
+        *pos = idx->e[lo-1].pos;
+    }
+
+    pthread_mutex_unlock(&idx->lock);
+
+    return ok? 0: -1;
+}
+
+/* Total sample count, once the walk has reached the end and the
+   walker counted samples. */
+extern int
+idx_samples(demux_index_t *idx, uint64_t *samples)
+{
+    int ok;
+
+    pthread_mutex_lock(&idx->lock);
+    ok = idx->complete && idx->samples;
+    if(ok)
+        *samples = idx->samples;
+    pthread_mutex_unlock(&idx->lock);
+
+    return ok? 0: -1;
+}
+
+/* Where the walk stopped last time: a byte offset at a frame unless
+   the walker was resyncing, and the sample count there. */
+extern void
+idx_resume(demux_index_t *idx, uint64_t *done, uint64_t *samples)
+{
+    pthread_mutex_lock(&idx->lock);
+    *done = idx->done;
+    *samples = idx->samples;
+    pthread_mutex_unlock(&idx->lock);
+}
+
+/* Called by the walker after each chunk.  Pauses to keep the walk
+   from competing with playback, and returns nonzero when the walk
+   should stop. */
+extern int
+idx_progress(demux_index_t *idx, uint64_t done, uint64_t samples,
+             int complete)
+{
+    pthread_mutex_lock(&idx->lock);
+    idx->done = done;
+    idx->samples = samples;
+    if(complete)
+        idx->complete = 1;
+    pthread_mutex_unlock(&idx->lock);
+
+    if(!complete && tcvp_demux_index_conf_delay > 0)
+        usleep(tcvp_demux_index_conf_delay * 1000);
+
+    return idx->stop;
+}
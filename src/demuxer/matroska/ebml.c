@@ -157,6 +157,42 @@ ebml_get_vint(url_t *u, int *vs)
     return val;
 }
 
+extern uint64_t
+ebml_mem_int(const u_char *p, int size)
+{
+    uint64_t val = 0;
+
+    while(size--)
+        val = val << 8 | *p++;
+
+    return val;
+}
+
+/* Variable size integer from memory.  Returns the number of bytes
+   used, or -1 if invalid or truncated. */
+extern int
+ebml_mem_vint(const u_char *p, int size, uint64_t *val)
+{
+    int n = 1, a;
+
+    if(size < 1 || !(a = *p))
+        return -1;
+
+    while(a < 0x80){
+        n++;
+        a <<= 1;
+    }
+
+    if(n > size)
+        return -1;
+
+    *val = *p++ & (0xff >> n);
+    for(a = 1; a < n; a++)
+        *val = *val << 8 | *p++;
+
+    return n;
+}
+
 extern int
 ebml_element(url_t *u, uint64_t *id, uint64_t *size, uint64_t *psize)
 {
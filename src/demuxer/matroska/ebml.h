@@ -57,6 +57,8 @@ typedef int (*ebml_element_callback_t)(uint64_t id, uint64_t size, void *);
 #define EBML_CB_ERROR   -1
 
 extern uint64_t ebml_get_vint(url_t *u, int *s);
+extern uint64_t ebml_mem_int(const u_char *p, int size);
+extern int ebml_mem_vint(const u_char *p, int size, uint64_t *val);
 extern uint64_t ebml_get_int(url_t *u, int size);
 extern double ebml_get_float(url_t *u, int size);
 extern char *ebml_get_string(url_t *u, int size);
@@ -109,10 +109,10 @@ typedef struct matroska_block {
     int16_t time;
     u_int flags;
     u_int frames;
-    u_int size;
-    u_int *fsizes;
+    u_int fsizes[256];
     int frame;
     uint64_t duration;
+    u_char *data;
 } matroska_block_t;
 
 typedef struct matroska_cueposition {
@@ -127,6 +127,11 @@ typedef struct matroska_cuepoint {
     int npositions;
 } matroska_cuepoint_t;
 
+typedef struct matroska_cluster {
+    uint64_t pos;
+    uint64_t time;
+} matroska_cluster_t;
+
 typedef struct matroska {
     url_t *u;
     uint64_t segment_start;
@@ -140,15 +145,24 @@ typedef struct matroska {
     matroska_cuepoint_t *cues;
     int ncues, mcues;
     int haveinfo, havetracks, havecues;
+    matroska_cluster_t *clusters;
+    int nclusters, mclusters;
 
     uint64_t clustertime;
+    uint64_t clusterpos;
     matroska_block_t block;
+
+    u_char *buf;
+    int bsize;
+    int bpos, bend;
+    uint64_t bufpos;
 } matroska_t;
 
 typedef struct matroska_packet {
     tcvp_data_packet_t pk;
     u_char *data;
     int size;
+    u_char *buf;
 } matroska_packet_t;
 
 typedef struct matroska_codec {
@@ -162,25 +176,13 @@ typedef struct matroska_ptr {
     void *p;
 } matroska_ptr_t;
 
-static matroska_codec_t msk_codecs[];
+#define MSK_SCAN_CHUNK 65536
+#define MSK_SEEK_MIN   65536
+#define MSK_BUFSIZE    (1 << 20)
+#define MSK_PADDING    32
+#define MSK_MAX_ELEMENT (64 << 20)
 
-static int
-xiph_int(url_t *u, int *vs)
-{
-    int val = 0, v;
-
-    if(vs)
-        *vs = 0;
-
-    do {
-        v = url_getc(u);
-        val += v;
-        if(vs)
-            (*vs)++;
-    } while(v == 255);
-
-    return val;
-}
+static matroska_codec_t msk_codecs[];
 
 static int
 xiph_int_mem(u_char *p, int size, int *vs)
@@ -589,6 +591,14 @@ msk_cb_cues(uint64_t id, uint64_t size, void *p)
     return EBML_CB_SUCCESS;
 }
 
+static int
+msk_cue_cmp(const void *p1, const void *p2)
+{
+    const matroska_cuepoint_t *c1 = p1, *c2 = p2;
+
+    return c1->time < c2->time? -1: c1->time > c2->time;
+}
+
 static matroska_codec_t *
 msk_find_codec(char *id)
 {
@@ -688,67 +698,209 @@ msk_create_streams(muxed_stream_t *ms)
     return 0;
 }
 
+/* Clusters are read through a refcounted buffer that packets point
+   into.  A buffer is never written to once handed out; refilling
+   moves the unread tail to a new one. */
+static void
+msk_reset_buf(matroska_t *msk, uint64_t pos)
+{
+    msk->bufpos = pos;
+    msk->bpos = 0;
+    msk->bend = 0;
+}
+
+/* Make size bytes available at bpos.  Returns the number of bytes
+   available, which is less than size only at end of file. */
+static int
+msk_fill(matroska_t *msk, int size)
+{
+    int n = msk->bend - msk->bpos;
+    int bsize;
+    u_char *nb;
+
+    if(n >= size)
+        return n;
+
+    bsize = size > MSK_BUFSIZE? size: MSK_BUFSIZE;
+    nb = tcalloc(bsize + MSK_PADDING);
+    if(!nb)
+        return n;
+
+    if(n)
+        memcpy(nb, msk->buf + msk->bpos, n);
+    if(msk->buf)
+        tcfree(msk->buf);
+
+    msk->buf = nb;
+    msk->bsize = bsize;
+    msk->bufpos += msk->bpos;
+    msk->bpos = 0;
+    msk->bend = n;
+
+    while(msk->bend < size){
+        int r = msk->u->read(msk->buf + msk->bend, 1,
+                             msk->bsize - msk->bend, msk->u);
+        if(r <= 0)
+            break;
+        msk->bend += r;
+    }
+
+    memset(msk->buf + msk->bend, 0, MSK_PADDING);
+
+    return msk->bend;
+}
+
+static int
+msk_element(matroska_t *msk, uint64_t *id, uint64_t *size)
+{
+    int n = msk_fill(msk, 12);
+    u_char *p = msk->buf + msk->bpos;
+    int s, t;
+
+    if((s = ebml_mem_vint(p, n, id)) < 0)
+        return -1;
+    if((t = ebml_mem_vint(p + s, n - s, size)) < 0)
+        return -1;
+
+    msk->bpos += s + t;
+
+    return 0;
+}
+
+/* Return a pointer to the next size bytes and step past them. */
+static u_char *
+msk_get(matroska_t *msk, uint64_t size)
+{
+    u_char *p;
+
+    if(size > MSK_MAX_ELEMENT || msk_fill(msk, size) < size)
+        return NULL;
+
+    p = msk->buf + msk->bpos;
+    msk->bpos += size;
+
+    return p;
+}
+
+static void
+msk_skip(matroska_t *msk, uint64_t size)
+{
+    uint64_t pos;
+
+    if(size <= msk->bend - msk->bpos){
+        msk->bpos += size;
+        return;
+    }
+
+    pos = msk->bufpos + msk->bpos + size;
+    msk->u->seek(msk->u, pos, SEEK_SET);
+    msk_reset_buf(msk, pos);
+}
+
 static int
-msk_block(matroska_t *msk, uint64_t size)
+msk_block(matroska_t *msk, u_char *p, int size)
 {
     matroska_block_t *mb = &msk->block;
-    int ss;
+    u_char *end = p + size;
+    int s, i;
+
+    if((s = ebml_mem_vint(p, size, &mb->track)) < 0 || size < s + 3)
+        return -1;
+    p += s;
 
-    mb->size = size;
-    mb->track = ebml_get_vint(msk->u, &ss);
-    mb->size -= ss;
-    url_get16b(msk->u, &mb->time);
-    mb->size -= 2;
-    mb->flags = url_getc(msk->u);
-    mb->size--;
+    mb->time = p[0] << 8 | p[1];
+    mb->flags = p[2];
+    p += 3;
 
     tc2_print("MATROSKA", TC2_PRINT_DEBUG+3,
-              "block on track %lli [%i], flags %x\n",
-              mb->track, msk->map[mb->track], mb->flags);
+              "block on track %lli, flags %x\n", mb->track, mb->flags);
 
     if(mb->flags & 0x6){
-        mb->frames = url_getc(msk->u) + 1;
-        mb->size--;
-        mb->fsizes = calloc(mb->frames, sizeof(*mb->fsizes));
+        if(p == end)
+            return -1;
+        mb->frames = *p++ + 1;
 
         if(mb->flags & 0x2){
-            int i, ts = 0;
+            int64_t fs, ts = 0;
             for(i = 0; i < mb->frames - 1; i++){
                 if(mb->flags & 0x4){
-                    int fs = ebml_get_vint(msk->u, &ss);
+                    uint64_t v;
+                    if((s = ebml_mem_vint(p, end - p, &v)) < 0)
+                        return -1;
+                    fs = v;
                     if(i){
-                        fs -= (1 << (8 * ss - ss - 1)) - 1;
+                        fs -= (1LL << (7 * s - 1)) - 1;
                         fs += mb->fsizes[i - 1];
                     }
-                    mb->fsizes[i] = fs;
                 } else {
-                    mb->fsizes[i] = xiph_int(msk->u, &ss);
+                    fs = xiph_int_mem(p, end - p, &s);
                 }
-                ts += mb->fsizes[i];
-                mb->size -= ss;
+                if(fs < 0 || fs > end - p)
+                    return -1;
+                mb->fsizes[i] = fs;
+                ts += fs;
+                p += s;
             }
-            mb->fsizes[i] = mb->size - ts;
+            if(ts > end - p)
+                return -1;
+            mb->fsizes[i] = end - p - ts;
         } else {
-            int i;
             for(i = 0; i < mb->frames; i++)
-                mb->fsizes[i] = mb->size / mb->frames;
+                mb->fsizes[i] = (end - p) / mb->frames;
         }
     } else {
         mb->frames = 1;
-        mb->fsizes = calloc(mb->frames, sizeof(*mb->fsizes));
-        mb->fsizes[0] = mb->size;
+        mb->fsizes[0] = end - p;
     }
 
+    mb->data = p;
     mb->frame = 0;
 
     return 0;
 }
 
+static int
+msk_blockgroup(matroska_t *msk, u_char *p, int size)
+{
+    u_char *end = p + size, *block = NULL;
+    int bsize = 0;
+
+    msk->block.duration = 0;
+
+    while(p < end){
+        uint64_t id, esize;
+        int s, t;
+
+        if((s = ebml_mem_vint(p, end - p, &id)) < 0 ||
+           (t = ebml_mem_vint(p + s, end - p - s, &esize)) < 0 ||
+           esize > end - p - s - t)
+            return -1;
+        p += s + t;
+
+        switch(id){
+        case MATROSKA_ID_BLOCK:
+            block = p;
+            bsize = esize;
+            break;
+        case MATROSKA_ID_BLOCKDURATION:
+            msk->block.duration = ebml_mem_int(p, esize);
+            tc2_print("MATROSKA", TC2_PRINT_DEBUG+3, "  duration %lli\n",
+                      msk->block.duration);
+            break;
+        }
+
+        p += esize;
+    }
+
+    if(!block)
+        return -1;
+
+    return msk_block(msk, block, bsize);
+}
+
 static void
 msk_free_block(matroska_block_t *mb)
 {
-    free(mb->fsizes);
-    mb->fsizes = NULL;
     mb->frames = 0;
     mb->frame = 0;
     mb->duration = 0;
@@ -758,78 +910,103 @@ static void
 msk_free_pk(void *p)
 {
     matroska_packet_t *mp = p;
-    free(mp->data);
+
+    if(mp->buf)
+        tcfree(mp->buf);
+    else
+        free(mp->data);
 }
 
-static int
-msk_cb_blockgroup(uint64_t id, uint64_t size, void *p)
+/* Cluster index for files without cues.  Entries are the positions
+   of cluster contents, kept sorted, and are added as clusters are
+   read or found while bisecting. */
+static void
+msk_add_cluster(matroska_t *msk, uint64_t pos, uint64_t time)
 {
-    matroska_t *msk = p;
+    int lo = 0, hi = msk->nclusters;
 
-    switch(id){
-    case MATROSKA_ID_BLOCK:
-        if(msk_block(msk, size) < 0)
-            return EBML_CB_ERROR;
-        return EBML_CB_BREAK;
-    case MATROSKA_ID_BLOCKDURATION:
-        msk->block.duration = ebml_get_int(msk->u, size);
-        tc2_print("MATROSKA", TC2_PRINT_DEBUG+3, "  duration %lli\n",
-                  msk->block.duration);
-        break;
-    case MATROSKA_ID_SLICES:
-        tc2_print("MATROSKA", TC2_PRINT_DEBUG, "slices %lli\n", size);
-        return EBML_CB_UNKNOWN;
-        break;
-    default:
-        return EBML_CB_UNKNOWN;
+    while(lo < hi){
+        int m = (lo + hi) / 2;
+        if(msk->clusters[m].pos < pos)
+            lo = m + 1;
+        else
+            hi = m;
     }
 
-    return EBML_CB_SUCCESS;
+    if(lo < msk->nclusters && msk->clusters[lo].pos == pos)
+        return;
+
+    if(msk->nclusters == msk->mclusters){
+        msk->mclusters = msk->mclusters? 2 * msk->mclusters: 256;
+        msk->clusters = realloc(msk->clusters,
+                                msk->mclusters * sizeof(*msk->clusters));
+    }
+
+    memmove(msk->clusters + lo + 1, msk->clusters + lo,
+            (msk->nclusters - lo) * sizeof(*msk->clusters));
+    msk->clusters[lo].pos = pos;
+    msk->clusters[lo].time = time;
+    msk->nclusters++;
 }
 
 static tcvp_packet_t *
 msk_packet(muxed_stream_t *ms, int str)
 {
     matroska_t *msk = ms->private;
+    matroska_block_t *mb = &msk->block;
     matroska_packet_t *pk;
     matroska_track_t *mt;
     int data_size;
     int trackidx;
 
-    while(!msk->block.frames){
+    while(!mb->frames){
         uint64_t id, size;
-        if(ebml_element(msk->u, &id, &size, NULL))
+        u_char *p;
+        int err;
+
+        if(msk_element(msk, &id, &size))
             return NULL;
 
         switch(id){
         case MATROSKA_ID_CLUSTER:
+            msk->clusterpos = msk->bufpos + msk->bpos;
             break;
         case MATROSKA_ID_TIMECODE:
-            msk->clustertime = ebml_get_int(msk->u, size);
-            break;
-        case MATROSKA_ID_BLOCKGROUP:
-            if(ebml_read_elements(msk->u, size, msk_cb_blockgroup, msk))
+            if(!(p = msk_get(msk, size)))
                 return NULL;
-            if(!ms->used_streams[msk->map[msk->block.track]]){
-                msk->u->seek(msk->u, msk->block.size, SEEK_CUR);
-                msk_free_block(&msk->block);
-            }
+            msk->clustertime = ebml_mem_int(p, size);
+            if(msk->clusterpos && !msk->ncues)
+                msk_add_cluster(msk, msk->clusterpos, msk->clustertime);
+            msk->clusterpos = 0;
             break;
+        case MATROSKA_ID_BLOCKGROUP:
         case MATROSKA_ID_SIMPLEBLOCK:
-            if(msk_block(msk, size) < 0)
+            if(!(p = msk_get(msk, size)))
                 return NULL;
+            if(id == MATROSKA_ID_BLOCKGROUP)
+                err = msk_blockgroup(msk, p, size);
+            else
+                err = msk_block(msk, p, size);
+            if(err < 0){
+                tc2_print("MATROSKA", TC2_PRINT_WARNING,
+                          "bad block @%lli\n", msk->bufpos + msk->bpos);
+                msk_free_block(mb);
+            } else if(mb->track >= msk->mapsize ||
+                      !ms->used_streams[msk->map[mb->track]]){
+                msk_free_block(mb);
+            }
             break;
         default:
-            msk->u->seek(msk->u, size, SEEK_CUR);
+            msk_skip(msk, size);
             break;
         }
     }
 
-    trackidx = msk->map[msk->block.track];
+    trackidx = msk->map[mb->track];
     mt = msk->tracks + trackidx;
 
     tc2_print("MATROSKA", TC2_PRINT_DEBUG+3, "packet on track %lli [%i]\n",
-              msk->block.track, trackidx);
+              mb->track, trackidx);
 
     pk = tcallocdz(sizeof(*pk), NULL, msk_free_pk);
     pk->pk.type = TCVP_PKT_TYPE_DATA;
@@ -837,66 +1014,199 @@ msk_packet(muxed_stream_t *ms, int str)
     pk->pk.data = &pk->data;
     pk->pk.sizes = &pk->size;
     pk->pk.planes = 1;
-    if(!msk->block.frame){
+    if(!mb->frame){
         pk->pk.flags |= TCVP_PKT_FLAG_PTS;
-        pk->pk.pts = (msk->clustertime + msk->block.time) *
+        pk->pk.pts = (msk->clustertime + mb->time) *
             msk->info.timecodescale * mt->timecodescale * 27 / 1000;
         tc2_print("MATROSKA", TC2_PRINT_DEBUG+3, "track %lli pts %lli\n",
-                  msk->block.track, pk->pk.pts / 27000);
+                  mb->track, pk->pk.pts / 27000);
     }
 
     if(mt->type == MATROSKA_TRACK_TYPE_AUDIO){
         uint64_t duration = 0;
-        if(msk->block.duration)
-            duration = msk->block.duration * msk->info.timecodescale *
+        if(mb->duration)
+            duration = mb->duration * msk->info.timecodescale *
                 mt->timecodescale;
         else
             duration = mt->defaultduration;
         pk->pk.samples = duration * 27 / (mt->audio.samplingfrequency * 1000);
     }
 
-    data_size = msk->block.fsizes[msk->block.frame];
-    pk->size = data_size + mt->compr.data_size;
-    pk->data = malloc(pk->size + 32);
-    if (!pk->data)
-        return NULL;
+    data_size = mb->fsizes[mb->frame];
 
-    if (mt->compr.data)
+    if(mt->compr.data){
+        pk->size = data_size + mt->compr.data_size;
+        pk->data = malloc(pk->size + MSK_PADDING);
+        if(!pk->data){
+            tcfree(pk);
+            return NULL;
+        }
         memcpy(pk->data, mt->compr.data, mt->compr.data_size);
-    msk->u->read(pk->data + mt->compr.data_size, 1, data_size, msk->u);
-    memset(pk->data + pk->size, 0, 32);
+        memcpy(pk->data + mt->compr.data_size, mb->data, data_size);
+        memset(pk->data + pk->size, 0, MSK_PADDING);
+    } else {
+        pk->size = data_size;
+        pk->data = mb->data;
+        pk->buf = tcref(msk->buf);
+    }
 
-    msk->block.frame++;
+    mb->data += data_size;
+    mb->frame++;
 
-    if(msk->block.frame == msk->block.frames)
-        msk_free_block(&msk->block);
+    if(mb->frame == mb->frames)
+        msk_free_block(mb);
 
     return (tcvp_packet_t *) pk;
 }
 
+/* Find the first cluster starting in [pos, end) that begins with a
+   timecode. */
+static int
+msk_find_cluster(matroska_t *msk, uint64_t pos, uint64_t end,
+                 matroska_cluster_t *mc)
+{
+    u_char buf[MSK_SCAN_CHUNK + 64];
+    int n = 0;
+
+    if(msk->u->seek(msk->u, pos, SEEK_SET))
+        return -1;
+
+    while(pos < end){
+        int r, i;
+
+        r = msk->u->read(buf + n, 1, MSK_SCAN_CHUNK + 64 - n, msk->u);
+        if(r <= 0)
+            break;
+        n += r;
+
+        for(i = 0; i < n - 64 && pos + i < end; i++){
+            uint64_t size, tid, tsize;
+            int s, e, t, ts;
+
+            if(buf[i] != 0x1f || buf[i+1] != 0x43 ||
+               buf[i+2] != 0xb6 || buf[i+3] != 0x75)
+                continue;
+
+            s = i + 4;
+            if((e = ebml_mem_vint(buf + s, n - s, &size)) < 0)
+                continue;
+            s += e;
+
+            if(buf[s] == 0xbf && buf[s+1] == 0x84)  /* CRC-32 */
+                s += 6;
+
+            if((t = ebml_mem_vint(buf + s, n - s, &tid)) != 1 ||
+               tid != MATROSKA_ID_TIMECODE)
+                continue;
+            if((ts = ebml_mem_vint(buf + s + 1, n - s - 1, &tsize)) < 0 ||
+               tsize < 1 || tsize > 8)
+                continue;
+
+            mc->pos = pos + i + 4 + e;
+            mc->time = ebml_mem_int(buf + s + 1 + ts, tsize);
+
+            return 0;
+        }
+
+        memmove(buf, buf + i, n - i);
+        pos += i;
+        n -= i;
+    }
+
+    return -1;
+}
+
+/* Last indexed cluster at or before time, narrowed down by bisecting
+   on cluster headers between it and the next one. */
+static matroska_cluster_t *
+msk_seek_cluster(matroska_t *msk, uint64_t time, matroska_cluster_t *mc)
+{
+    matroska_cluster_t c;
+    uint64_t end;
+    int lo = 0, hi = msk->nclusters;
+
+    if(!msk->nclusters)
+        return NULL;
+
+    while(lo < hi){
+        int m = (lo + hi) / 2;
+        if(msk->clusters[m].time <= time)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+
+    *mc = msk->clusters[lo? lo - 1: 0];
+    end = lo < msk->nclusters? msk->clusters[lo].pos: msk->u->size;
+
+    if(!lo || (msk->u->flags & URL_FLAG_STREAMED))
+        return mc;
+
+    while(end > mc->pos + MSK_SEEK_MIN){
+        uint64_t mid = mc->pos + (end - mc->pos) / 2;
+
+        if(msk_find_cluster(msk, mid, end, &c)){
+            end = mid;
+            continue;
+        }
+
+        msk_add_cluster(msk, c.pos, c.time);
+
+        if(c.time <= time)
+            *mc = c;
+        else
+            end = mid;
+    }
+
+    while(!msk_find_cluster(msk, mc->pos, end, &c)){
+        msk_add_cluster(msk, c.pos, c.time);
+        if(c.time > time)
+            break;
+        *mc = c;
+    }
+
+    return mc;
+}
+
 static uint64_t
 msk_seek(muxed_stream_t *ms, uint64_t time)
 {
     matroska_t *msk = ms->private;
     matroska_cuepoint_t *cp;
     matroska_cueposition_t *cpos = NULL;
+    matroska_cluster_t mc;
+    int lo = 0, hi = msk->ncues;
     int i;
 
     time /= msk->info.timecodescale * 27 / 1000;
 
     tc2_print("MATROSKA", TC2_PRINT_DEBUG, "seek %lli\n", time);
 
-    for(i = 0; i < msk->ncues; i++)
-        if(msk->cues[i].time >=  time)
-            break;
+    if(!msk->ncues){
+        if(!msk_seek_cluster(msk, time, &mc))
+            return -1LL;
 
-    if(i == msk->ncues)
-        return -1LL;
+        tc2_print("MATROSKA", TC2_PRINT_DEBUG,
+                  "seek to cluster %lli @ %lli, %i clusters indexed\n",
+                  mc.time, mc.pos, msk->nclusters);
 
-    if(msk->cues[i].time > time && i > 0)
-        i--;
+        msk->u->seek(msk->u, mc.pos, SEEK_SET);
+        msk_reset_buf(msk, mc.pos);
+        msk->clusterpos = 0;
+        msk_free_block(&msk->block);
 
-    cp = msk->cues + i;
+        return mc.time * msk->info.timecodescale * 27 / 1000;
+    }
+
+    while(lo < hi){
+        int m = (lo + hi) / 2;
+        if(msk->cues[m].time <= time)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+
+    cp = msk->cues + (lo? lo - 1: 0);
 
     for(i = 0; i < cp->npositions; i++){
         int tidx = msk->map[cp->positions[i].track];
@@ -911,6 +1221,7 @@ msk_seek(muxed_stream_t *ms, uint64_t time)
               cpos->track, cp->time, cpos->clusterpos, cpos->blocknum);
 
     msk->u->seek(msk->u, msk->segment_start + cpos->clusterpos, SEEK_SET);
+    msk_reset_buf(msk, msk->segment_start + cpos->clusterpos);
     msk_free_block(&msk->block);
 
     return cp->time * msk->info.timecodescale * 27 / 1000;
@@ -947,7 +1258,9 @@ msk_free(void *p)
 
     free(msk->tracks);
     free(msk->cues);
-    msk_free_block(&msk->block);
+    free(msk->clusters);
+    if(msk->buf)
+        tcfree(msk->buf);
     free(msk);
 
     free(ms->streams);
@@ -1061,6 +1374,16 @@ msk_open(char *name, url_t *u, tcconf_section_t *cs, tcvp_timer_t *tm)
         msk_read_header(msk);
     }
 
+    qsort(msk->cues, msk->ncues, sizeof(*msk->cues), msk_cue_cmp);
+
+    if(!msk->ncues){
+        uint64_t id, size;
+
+        u->seek(u, msk->cluster_start, SEEK_SET);
+        if(!ebml_element(u, &id, &size, NULL) && id == MATROSKA_ID_TIMECODE)
+            msk_add_cluster(msk, msk->cluster_start, ebml_get_int(u, size));
+    }
+
     tc2_print("MATROSKA", TC2_PRINT_DEBUG, "title %s\n", msk->info.title);
     tc2_print("MATROSKA", TC2_PRINT_DEBUG, "timecodescale %lli\n",
               msk->info.timecodescale);
@@ -1083,6 +1406,7 @@ msk_open(char *name, url_t *u, tcconf_section_t *cs, tcvp_timer_t *tm)
         tcattr_set(ms, "title", msk->info.title, NULL, NULL);
 
     u->seek(u, msk->cluster_start, SEEK_SET);
+    msk_reset_buf(msk, msk->cluster_start);
 
   out:
     free(eh.doctype);
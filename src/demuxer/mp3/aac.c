@@ -81,4 +81,4 @@ aac_header(u_char *head, mp3_frame_t *mf)
     return 0;
 }
 
-mp3_header_parser_t aac_parser = { aac_header, 8, "AAC" };
+mp3_header_parser_t aac_parser = { aac_header, 8, "AAC", 0xfff0, 0xfff0 };
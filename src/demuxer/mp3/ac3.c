@@ -131,4 +131,4 @@ ac3_header(u_char *head, mp3_frame_t *mf)
     return 0;
 }
 
-mp3_header_parser_t ac3_parser = { ac3_header, 8, "AC3" };
+mp3_header_parser_t ac3_parser = { ac3_header, 8, "AC3", 0x0b77, 0xffff };
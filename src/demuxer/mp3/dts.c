@@ -159,7 +159,7 @@ dts16s_header(u_char *head, mp3_frame_t *mf)
 static int
 dts14_header(u_char *head, mp3_frame_t *mf)
 {
-    u_char buf[12];
+    u_char buf[13];             /* dts_pack writes 98 bits */
 
     dts_pack(buf, head);
     if(dts16_header(buf, mf))
@@ -171,7 +171,7 @@ dts14_header(u_char *head, mp3_frame_t *mf)
 static int
 dts14s_header(u_char *head, mp3_frame_t *mf)
 {
-    u_char buf1[14], buf2[12];
+    u_char buf1[14], buf2[13];
     dts_swap(buf1, head, 14);
     dts_pack(buf2, buf1);
     if(dts16_header(buf2, mf))
@@ -180,7 +180,11 @@ dts14s_header(u_char *head, mp3_frame_t *mf)
     return 0;
 }
 
-mp3_header_parser_t dts16_parser  = { dts16_header, 12, "DTS" };
-mp3_header_parser_t dts16s_parser = { dts16s_header, 12, "DTS" };
-mp3_header_parser_t dts14_parser  = { dts14_header, 14, "DTS" };
-mp3_header_parser_t dts14s_parser = { dts14s_header, 14, "DTS" };
+mp3_header_parser_t dts16_parser  =
+    { dts16_header, 12, "DTS", 0x7ffe, 0xffff };
+mp3_header_parser_t dts16s_parser =
+    { dts16s_header, 12, "DTS", 0xfe7f, 0xffff };
+mp3_header_parser_t dts14_parser  =
+    { dts14_header, 14, "DTS", 0x1fff, 0xffff };
+mp3_header_parser_t dts14s_parser =
+    { dts14s_header, 14, "DTS", 0xff1f, 0xffff };
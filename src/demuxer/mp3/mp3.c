@@ -33,6 +33,15 @@
 
 #define MAX_FRAME_SIZE 16384
 #define MAX_HEADER_SIZE 14
+#define MP3_BUFSIZE 65536
+#define LAME_DECODER_DELAY 529
+
+/* Read buffer.  Packets point into data and count themselves in
+   packets, so the buffer is reused once all of them are freed. */
+typedef struct mp3_buffer {
+    int packets;
+    u_char data[];
+} mp3_buffer_t;
 
 typedef struct mp3_file {
     url_t* file;
@@ -46,12 +55,20 @@ typedef struct mp3_file {
     size_t bytes;
     uint64_t samples;
     int header_size;
+    mp3_buffer_t *bh;
     u_char *buf;
     int bufsize;
     int bhead, btail;
+    uint64_t bufpos;
     int (*parse_header)(u_char *, mp3_frame_t *);
+    mp3_header_parser_t *hp;
     int xtime;
     u_char *xing;
+    demux_index_t *index, *toc;
+    int iscan, itime;
+    uint64_t tsamples;
+    int delay, padding;
+    uint64_t skip;
     char *tag;
 } mp3_file_t;
 
@@ -87,6 +104,7 @@ all_headers(mp3_file_t *mf, u_char *head, mp3_frame_t *fr)
     for(i = 0; i < NUM_PARSERS; i++){
         if(!header_parsers[i]->parser(head, fr)){
             mf->parse_header = header_parsers[i]->parser;
+            mf->hp = header_parsers[i];
             mf->header_size = header_parsers[i]->header_size;
             mf->tag = header_parsers[i]->tag;
             return 0;
@@ -96,52 +114,149 @@ all_headers(mp3_file_t *mf, u_char *head, mp3_frame_t *fr)
     return -1;
 }
 
+static void
+new_buffer(mp3_file_t *mf)
+{
+    mf->bh = tcallocz(sizeof(*mf->bh) + mf->bufsize);
+    mf->buf = mf->bh->data;
+}
+
 static int
-mp3_getparams(muxed_stream_t *ms)
+buffer_busy(mp3_file_t *mf)
 {
-    mp3_file_t *mf = ms->private;
-    url_t *f = mf->file;
-    mp3_frame_t fr;
-    uint64_t maxscan, i;
-    off_t pos = f->tell(f);
-    u_char head[MAX_HEADER_SIZE];
-    int found = 0;
-    int resync;
-
-    if(mf->parse_header){
-        resync = 1;
-        maxscan = -1LL;
-    } else {
-        resync = 0;
-        maxscan = MAX_FRAME_SIZE;
+    return __sync_fetch_and_add(&mf->bh->packets, 0);
+}
+
+static int
+fill_buffer(mp3_file_t *mf)
+{
+    u_char *data = mf->buf + mf->bhead;
+    int size = mf->bufsize - mf->bhead;
+    uint64_t pos = mf->bufpos + mf->bhead;
+
+    size = min(size, mf->end - pos + mf->start);
+    size = mf->file->read(data, 1, size, mf->file);
+
+    if(size > 0)
+        mf->bhead += size;
+
+    return size;
+}
+
+/* Move the unread data to the front of the buffer and read more.  A
+   buffer that packets still point into is replaced instead. */
+static int
+mp3_refill(mp3_file_t *mf)
+{
+    int n = mf->bhead - mf->btail;
+
+    if(buffer_busy(mf)){
+        mp3_buffer_t *ob = mf->bh;
+        new_buffer(mf);
+        memcpy(mf->buf, ob->data + mf->btail, n);
+        tcfree(ob);
+    } else if(mf->btail){
+        memmove(mf->buf, mf->buf + mf->btail, n);
     }
 
-    if(f->read(head, 1, MAX_HEADER_SIZE, f) < MAX_HEADER_SIZE)
-        return -1;
+    mf->bufpos += mf->btail;
+    mf->bhead = n;
+    mf->btail = 0;
 
-    for(i = 0; i < maxscan; i++){
-        if(!all_headers(mf, head, &fr)){
-            off_t pos2 = f->tell(f);
-            u_char head2[MAX_HEADER_SIZE];
-            f->seek(f, pos + i + fr.size, SEEK_SET);
-            if(f->read(head2, 1, mf->header_size, f) < mf->header_size)
-                break;
-            if(!mf->parse_header(head2, &fr)){
-                f->seek(f, pos + i, SEEK_SET);
-                found = 1;
-                break;
+    return fill_buffer(mf);
+}
+
+static inline int
+sync_match(mp3_header_parser_t *hp, u_char *p)
+{
+    return ((p[0] << 8 | p[1]) & hp->sync_mask) == hp->sync;
+}
+
+static int
+sync_candidate(mp3_file_t *mf, u_char *p)
+{
+    int i;
+
+    if(mf->parse_header)
+        return sync_match(mf->hp, p);
+
+    for(i = 0; i < NUM_PARSERS; i++)
+        if(sync_match(header_parsers[i], p))
+            return 1;
+
+    return 0;
+}
+
+/* Find a frame header followed by another one, looking at most
+   maxscan bytes past btail.  Both headers are checked in the buffer,
+   which is refilled as needed.  On success btail is at the frame. */
+static int
+mp3_sync(mp3_file_t *mf, uint64_t maxscan, mp3_frame_t *fr)
+{
+    int resync = mf->parse_header != NULL;
+    int eof = 0;
+
+    for(;;){
+        u_char *b = mf->buf + mf->btail;
+        int n = mf->bhead - mf->btail;
+        int e = n - MAX_HEADER_SIZE + 1;
+        int i = 0;
+
+        if(e > 0 && e > maxscan)
+            e = maxscan;
+
+        while(i < e){
+            mp3_frame_t nf;
+            int next;
+
+            if(mf->parse_header){
+                u_char *p = memchr(b + i, mf->hp->sync >> 8, e - i);
+                if(!p){
+                    i = e;
+                    break;
+                }
+                i = p - b;
             }
-            f->seek(f, pos2, SEEK_SET);
+
+            if(!sync_candidate(mf, b + i) || all_headers(mf, b + i, fr)){
+                i++;
+                continue;
+            }
+
+            next = i + fr->size;
+            if(next + mf->header_size <= n &&
+               !mf->parse_header(b + next, &nf)){
+                mf->btail += i;
+                return 0;
+            }
+
             if(!resync)
                 mf->parse_header = NULL;
+
+            if(next + mf->header_size > n && !eof)
+                break;
+
+            i++;
         }
 
-        memmove(head, head + 1, MAX_HEADER_SIZE - 1);
-        if(f->read(head + MAX_HEADER_SIZE - 1, 1, 1, f) != 1)
+        mf->btail += i;
+        maxscan -= i;
+
+        if(!maxscan || eof)
             return -1;
+
+        if(mp3_refill(mf) <= 0)
+            eof = 1;
     }
+}
+
+static int
+mp3_getparams(muxed_stream_t *ms)
+{
+    mp3_file_t *mf = ms->private;
+    mp3_frame_t fr;
 
-    if(!found)
+    if(mp3_sync(mf, mf->parse_header? -1LL: MAX_FRAME_SIZE, &fr))
         return -1;
 
     if(!mf->stream.audio.bit_rate)
@@ -155,44 +270,117 @@ mp3_getparams(muxed_stream_t *ms)
     return 0;
 }
 
+/* Make sure size bytes past btail are buffered. */
+static int
+mp3_need(mp3_file_t *mf, int size)
+{
+    while(mf->bhead - mf->btail < size)
+        if(mp3_refill(mf) <= 0)
+            return -1;
+
+    return 0;
+}
+
+/* Point btail at byte pos of the data, reading from the file only
+   if pos is not buffered already. */
+static int
+mp3_reposition(mp3_file_t *mf, uint64_t pos)
+{
+    uint64_t bpos = mf->start + pos;
+
+    if(bpos >= mf->bufpos && bpos < mf->bufpos + mf->bhead){
+        mf->btail = bpos - mf->bufpos;
+        return 0;
+    }
+
+    if(mf->file->seek(mf->file, bpos, SEEK_SET))
+        return -1;
+
+    if(buffer_busy(mf)){
+        tcfree(mf->bh);
+        new_buffer(mf);
+    }
+
+    mf->bufpos = bpos;
+    mf->bhead = 0;
+    mf->btail = 0;
+
+    return 0;
+}
+
+/* Step from the frame at btail, starting at isample, to the frame
+   holding sample.  Returns the first sample of that frame. */
+static uint64_t
+mp3_skip(mp3_file_t *mf, uint64_t isample, uint64_t sample)
+{
+    mp3_frame_t fr;
+
+    while(!mp3_need(mf, mf->header_size) &&
+          !mf->parse_header(mf->buf + mf->btail, &fr) &&
+          isample + fr.samples <= sample &&
+          !mp3_need(mf, fr.size + mf->header_size)){
+        mf->btail += fr.size;
+        isample += fr.samples;
+    }
+
+    return isample;
+}
+
 static uint64_t
 mp3_seek(muxed_stream_t *ms, uint64_t time)
 {
     mp3_file_t *mf = ms->private;
-    uint64_t pos;
+    int rate = mf->stream.audio.sample_rate;
+    uint64_t pos, sample, isample;
 
-    if(!mf->stream.audio.bit_rate)
+    if(!mf->stream.audio.bit_rate || !rate)
         return -1LL;
 
+    sample = time * rate / 27000000;
+
+    if(mf->iscan)
+        demux_index_scan(mf->index);
+
+    if((mf->index && !demux_index_find(mf->index, sample, &isample, &pos)) ||
+       (mf->toc && !demux_index_find(mf->toc, sample, &isample, &pos))){
+        if(pos > mf->size || mp3_reposition(mf, pos) || mp3_getparams(ms))
+            return -1LL;
+
+        tc2_print(mf->tag, TC2_PRINT_DEBUG,
+                  "seek to sample %llu from frame at %llx, sample %llu\n",
+                  sample, mf->bufpos + mf->btail, isample);
+
+        mf->samples = mp3_skip(mf, isample, sample);
+
+        return mf->samples * 27000000LL / rate;
+    }
+
     if(mf->xing){
         int xi = 100 * time / ms->time;
+        if(xi > 99)
+            xi = 99;
         pos = mf->xing[xi] * mf->size / 256;
         time = ms->time * xi / 100;
     } else {
         pos = time * mf->stream.audio.bit_rate / (27 * 8000000);
     }
 
-    if(pos > mf->size)
+    if(pos > mf->size || mp3_reposition(mf, pos))
         return -1LL;
 
-    mf->file->seek(mf->file, mf->start + pos, SEEK_SET);
     if(!mp3_getparams(ms))
         if(mf->stream.audio.bit_rate && !mf->xtime)
             time = pos * 27 * 8000000LL / mf->stream.audio.bit_rate;
 
-    mf->samples = time / 27000000 * mf->stream.audio.sample_rate;
-    mf->bhead = 0;
-    mf->btail = 0;
-    tcfree(mf->buf);
-    mf->buf = tcalloc(mf->bufsize);
+    mf->samples = time * rate / 27000000;
 
-    return time;
+    return mf->samples * 27000000LL / rate;
 }
 
 typedef struct mp3_packet {
     tcvp_data_packet_t pk;
     u_char *data;
-    u_char *buf;
+    mp3_buffer_t *bh;
     int size;
 } mp3_packet_t;
 
@@ -200,24 +388,8 @@ static void
 mp3_free_pk(void *p)
 {
     mp3_packet_t *mp = p;
-    tcfree(mp->buf);
-}
-
-static int
-fill_buffer(mp3_file_t *mf)
-{
-    u_char *data = mf->buf + mf->bhead;
-    int size = mf->bufsize - mf->bhead;
-    uint64_t pos;
-
-    pos = mf->file->tell(mf->file);
-    size = min(size, mf->end - pos + mf->start);
-    size = mf->file->read(data, 1, size, mf->file);
-
-    if(size > 0)
-        mf->bhead += size;
-
-    return size;
+    __sync_fetch_and_sub(&mp->bh->packets, 1);
+    tcfree(mp->bh);
 }
 
 static mp3_packet_t *
@@ -227,7 +399,8 @@ make_packet(mp3_file_t *mf, int offset, mp3_frame_t *fr)
 
     mp = tcallocdz(sizeof(*mp), NULL, mp3_free_pk);
     mp->data = mf->buf + offset;
-    mp->buf = tcref(mf->buf);
+    mp->bh = tcref(mf->bh);
+    __sync_fetch_and_add(&mf->bh->packets, 1);
     mp->size = fr->size;
     mp->pk.stream = 0;
     mp->pk.data = &mp->data;
@@ -237,35 +410,81 @@ make_packet(mp3_file_t *mf, int offset, mp3_frame_t *fr)
     mp->pk.pts = mf->samples * 27000000LL / mf->stream.audio.sample_rate;
     mp->pk.samples = fr->samples;
 
+    if(mf->samples < mf->skip){
+        mp->pk.flags |= TCVP_PKT_FLAG_TRIM;
+        mp->pk.trim = min(mf->skip - mf->samples, fr->samples);
+    }
+
     return mp;
 }
 
+/* Exact duration from the number of samples in the frames, less
+   the gapless delay and padding. */
+static void
+mp3_length(muxed_stream_t *ms, uint64_t samples)
+{
+    mp3_file_t *mf = ms->private;
+    int rate = mf->stream.audio.sample_rate;
+
+    if(samples > mf->delay + mf->padding)
+        samples -= mf->delay + mf->padding;
+    if(!samples || !rate)
+        return;
+
+    ms->time = 27000000LL * samples / rate;
+    mf->stream.audio.samples = samples;
+    mf->stream.audio.bit_rate = mf->size * 8 * rate / samples;
+    mf->xtime = 1;
+}
+
 static tcvp_packet_t *
 mp3_packet(muxed_stream_t *ms, int str)
 {
     mp3_file_t *mf = ms->private;
     mp3_packet_t *mp = NULL;
     mp3_frame_t fr;
-    int size;
-    u_char *nb;
     int eof = 0;
 
     if(!mf->used)
         return NULL;
 
-    while(!mp){
-        if(mf->bhead < mf->bufsize){
-            if(fill_buffer(mf) <= 0)
-                eof = 1;
+    if(mf->iscan){
+        demux_index_scan(mf->index);
+        mf->iscan = 0;
+    }
+
+    if(mf->index && !mf->itime){
+        uint64_t samples;
+        if(!demux_index_samples(mf->index, &samples)){
+            mp3_length(ms, samples);
+            mf->itime = 1;
+            if(mf->qs)
+                tcvp_event_send(mf->qs, TCVP_STREAM_INFO);
         }
+    }
 
-        fr.size = 0;
-        while(mf->bhead - mf->btail >= mf->header_size){
-            if(!mf->parse_header(mf->buf + mf->btail, &fr)){
-                u_int br;
+    while(!mp){
+        int size = mf->bhead - mf->btail;
 
-                if(fr.size > mf->bhead - mf->btail)
-                    break;
+        if(size >= mf->header_size){
+            if(mf->parse_header(mf->buf + mf->btail, &fr)){
+                uint64_t pos1, pos2;
+                u_char *h = mf->buf + mf->btail;
+                pos1 = mf->bufpos + mf->btail;
+                tc2_print(mf->tag, TC2_PRINT_WARNING,
+                          "bad header %02x%02x%02x @ %llx\n",
+                          h[0], h[1], h[2], pos1);
+                if(mp3_getparams(ms) < 0)
+                    return NULL;
+                pos2 = mf->bufpos + mf->btail;
+                tc2_print(mf->tag, TC2_PRINT_WARNING,
+                          "sync at %llx, skipped %i bytes\n",
+                          pos2, pos2 - pos1);
+                continue;
+            }
+
+            if(fr.size <= size){
+                u_int br;
 
                 mp = make_packet(mf, mf->btail, &fr);
 
@@ -283,43 +502,17 @@ mp3_packet(muxed_stream_t *ms, int str)
                     tc2_print(mf->tag, TC2_PRINT_DEBUG+1,
                               "bitrate %i [%u] %lli s @%llx\n",
                               fr.bitrate, br, ms->time / 27000000,
-                              mf->file->tell(mf->file) -
-                              (mf->bhead - mf->btail));
+                              mf->bufpos + mf->btail);
                 }
                 mf->btail += fr.size;
                 break;
-            } else {
-                uint64_t pos1, pos2;
-                u_char *h = mf->buf + mf->btail;
-                pos1 = mf->file->tell(mf->file) - (mf->bhead - mf->btail);
-                tc2_print(mf->tag, TC2_PRINT_WARNING,
-                          "bad header %02x%02x%02x @ %llx\n",
-                          h[0], h[1], h[2], pos1);
-                mf->bhead = 0;
-                mf->btail = 0;
-                mf->file->seek(mf->file, pos1, SEEK_SET);
-                if(mp3_getparams(ms) < 0){
-                    eof = 1;
-                    break;
-                }
-                pos2 = mf->file->tell(mf->file);
-                tc2_print(mf->tag, TC2_PRINT_WARNING,
-                          "sync at %llx, skipped %i bytes\n",
-                          pos2, pos2 - pos1);
             }
         }
 
-        size = mf->bhead - mf->btail;
-        if(size < fr.size || size < mf->header_size){
-            if(eof && !mp)
-                return NULL;
-            nb = tcalloc(mf->bufsize);
-            memcpy(nb, mf->buf + mf->btail, mf->bhead - mf->btail);
-            tcfree(mf->buf);
-            mf->buf = nb;
-            mf->bhead = size;
-            mf->btail = 0;
-        }
+        if(eof)
+            return NULL;
+        if(mp3_refill(mf) <= 0)
+            eof = 1;
     }
 
     return (tcvp_packet_t *) mp;
@@ -334,35 +527,87 @@ mp3_free(void *p)
     eventq_delete(mf->qs);
     if(mf->file)
         mf->file->close(mf->file);
-    tcfree(mf->buf);
+    tcfree(mf->bh);
+    if(mf->index)
+        tcfree(mf->index);
+    if(mf->toc)
+        tcfree(mf->toc);
     free(mf->xing);
     free(mf);
 }
 
 #define XING_SIZE 512
 
+/* VBRI header, 32 bytes into the first frame.  The table gives the
+   byte size of each run of frames and is kept as a coarse index. */
+static int
+vbri_header(mp3_file_t *mf, u_char *v, mp3_frame_t *fr, int size)
+{
+    int entries, scale, esize, fpe;
+    uint64_t pos = 0;
+    int i, j;
+
+    if(size < 26)
+        return -1;
+
+    mf->tsamples = (uint64_t) htob_32(unaligned32(v + 14)) * fr->samples;
+    entries = htob_16(unaligned16(v + 18));
+    scale = htob_16(unaligned16(v + 20));
+    esize = htob_16(unaligned16(v + 22));
+    fpe = htob_16(unaligned16(v + 24));
+
+    if(esize < 1 || esize > 4 || 26 + entries * esize > size)
+        return 0;
+
+    mf->toc = demux_index_new(0);
+    demux_index_add(mf->toc, 0, 0);
+
+    v += 26;
+    for(i = 0; i < entries; i++){
+        uint32_t e = 0;
+        for(j = 0; j < esize; j++)
+            e = e << 8 | *v++;
+        pos += (uint64_t) e * scale;
+        demux_index_add(mf->toc, (uint64_t) (i + 1) * fpe * fr->samples, pos);
+    }
+
+    return 0;
+}
+
+/* Xing/Info, LAME or VBRI tag in the first frame.  Such a frame
+   carries no audio and is skipped. */
 static int
-xing_header(muxed_stream_t *ms)
+info_frame(muxed_stream_t *ms)
 {
     mp3_file_t *mf = ms->private;
-    u_char x[XING_SIZE], *xp;
+    u_char *x, *xp;
     int i, flags;
-    uint64_t fp = mf->file->tell(mf->file);
     mp3_frame_t fr;
     int size;
 
-    if(mf->file->read(x, 1, XING_SIZE, mf->file) < XING_SIZE)
+    if(mf->hp != &mpeg1_parser)
+        return -1;
+
+    if(mp3_need(mf, XING_SIZE))
         return -1;
 
-    mf->file->seek(mf->file, fp, SEEK_SET);
+    x = mf->buf + mf->btail;
 
-    if(mf->parse_header(x, &fr))
+    if(mf->parse_header(x, &fr) || mp3_need(mf, fr.size))
         return -1;
 
+    x = mf->buf + mf->btail;
+
+    if(fr.size > 40 && !memcmp(x + 36, "VBRI", 4)){
+        if(vbri_header(mf, x + 36, &fr, fr.size - 36))
+            return -1;
+        goto out;
+    }
+
     size = min(fr.size, XING_SIZE) - 4;
 
     for(i = 0; i < size; i++)
-        if(!memcmp(x + i, "Xing", 4))
+        if(!memcmp(x + i, "Xing", 4) || !memcmp(x + i, "Info", 4))
             break;
 
     if(i == size)
@@ -373,13 +618,7 @@ xing_header(muxed_stream_t *ms)
     xp += 4;
 
     if(flags & 0x1){
-        int frames = htob_32(unaligned32(xp));
-        uint64_t samples = 1152 * frames;
-        ms->time = 27000000LL * samples / mf->stream.audio.sample_rate;
-        mf->stream.audio.samples = samples;
-        mf->stream.audio.bit_rate =
-            mf->size * 8 * mf->stream.audio.sample_rate / samples;
-        mf->xtime = 1;
+        mf->tsamples = (uint64_t) htob_32(unaligned32(xp)) * fr.samples;
         xp += 4;
     }
 
@@ -389,8 +628,24 @@ xing_header(muxed_stream_t *ms)
     if(flags & 0x4){
         mf->xing = malloc(100);
         memcpy(mf->xing, xp, 100);
+        xp += 100;
+    }
+
+    if(flags & 0x8)
+        xp += 4;
+
+    if(xp + 24 <= x + fr.size && !memcmp(xp, "LAME", 4)){
+        mf->delay = xp[21] << 4 | xp[22] >> 4;
+        mf->padding = (xp[22] & 0xf) << 8 | xp[23];
+        if(tcvp_demux_mp3_conf_gapless)
+            mf->skip = mf->delay + LAME_DECODER_DELAY;
+        tc2_print(mf->tag, TC2_PRINT_DEBUG, "LAME delay %i, padding %i\n",
+                  mf->delay, mf->padding);
     }
 
+out:
+    mf->btail += fr.size;
+
     return 0;
 }
 
@@ -434,6 +689,10 @@ mp3_open(char *name, url_t *f, tcconf_section_t *cs, tcvp_timer_t *tm)
     tc2_print("MP3", TC2_PRINT_DEBUG, "data start %x\n", f->tell(f));
 
     mf->header_size = MAX_HEADER_SIZE;
+    mf->bufsize = MP3_BUFSIZE;
+    new_buffer(mf);
+    mf->bufpos = f->tell(f);
+    mf->end = ts > 0? f->size - ts: -1LL;
 
     if(mp3_getparams(ms)){
         tcfree(ms);
@@ -447,7 +706,9 @@ mp3_open(char *name, url_t *f, tcconf_section_t *cs, tcvp_timer_t *tm)
     ms->seek = mp3_seek;
     ms->used_streams = &mf->used;
 
-    mf->start = f->tell(f);
+    info_frame(ms);
+
+    mf->start = mf->bufpos + mf->btail;
     mf->size -= mf->start;
     if(ts > 0){
         mf->size -= ts;
@@ -456,12 +717,26 @@ mp3_open(char *name, url_t *f, tcconf_section_t *cs, tcvp_timer_t *tm)
         mf->end = -1LL;
     }
 
-    tc2_print(mf->tag, TC2_PRINT_DEBUG, "data start %x\n", f->tell(f));
+    tc2_print(mf->tag, TC2_PRINT_DEBUG, "data start %llx\n", mf->start);
+
+    if(mf->tsamples)
+        mp3_length(ms, mf->tsamples);
+
+    if(!(f->flags & URL_FLAG_STREAMED)){
+        int index = tcvp_demux_mp3_conf_index;
+        uint64_t samples;
 
-    xing_header(ms);
+        tcconf_getvalue(cs, "index", "%i", &index);
+
+        mf->index = mp3_index_open(name, mf->start, mf->size, mf->hp,
+                                   mf->stream.audio.sample_rate);
+        if(mf->index && !demux_index_samples(mf->index, &samples)){
+            mp3_length(ms, samples);
+            mf->itime = 1;
+        }
+        mf->iscan = mf->index && index;
+    }
 
-    mf->bufsize = MAX_FRAME_SIZE;
-    mf->buf = tcalloc(mf->bufsize);
     mf->qs = tcvp_event_get_sendq(cs, "status");
 
     return ms;
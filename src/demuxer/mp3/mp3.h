@@ -41,6 +41,7 @@ typedef struct mp3_header_parser {
     int (*parser)(u_char *, mp3_frame_t *);
     int header_size;
     char *tag;
+    int sync, sync_mask;        /* first two bytes of a header */
 } mp3_header_parser_t;
 
 #define min(a, b) ((a)<(b)?(a):(b))
@@ -53,4 +54,8 @@ extern mp3_header_parser_t dts16s_parser;
 extern mp3_header_parser_t dts14_parser;
 extern mp3_header_parser_t dts14s_parser;
 
+extern demux_index_t *mp3_index_open(char *name, uint64_t start,
+                                     uint64_t size, mp3_header_parser_t *hp,
+                                     int sample_rate);
+
 #endif
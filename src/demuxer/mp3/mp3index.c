@@ -0,0 +1,170 @@
+/**
+    Copyright (C) 2006  Michael Ahlberg, Måns Rullgård
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+**/
+
+/* Frame walker for MP3 and other elementary audio streams.
+
+   Table entries map the sample count at the start of a frame to its
+   offset from the first audio frame, as counted by the demuxer.  The
+   table lives in demux/index, which runs midx_walk on its own handle
+   and keeps a frame every half second; the walk resyncs on junk the
+   same way mp3_packet does.  Seeks start from the nearest entry and
+   step frame by frame from there.  Once the walk reaches the end the
+   total sample count is exact.
+
+   Tables are cached and loaded when the file is opened, so anything
+   opening the stream gets the exact duration without a walk.  The
+   walk itself only starts once the stream is read or seeked. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mp3_tc2.h>
+#include "mp3.h"
+
+#define IDX_CHUNK 262144
+#define IDX_MAGIC "TCVPMPI1"
+#define IDX_HEADER_SIZE 14
+
+struct midx_stream {
+    uint64_t start, end;
+    mp3_header_parser_t *hp;
+};
+
+/* Move *pos to the next header in buf that is followed by another
+   one, like mp3_sync.  Returns -1 if there is none, -2 if more data
+   is needed to continue from *pos. */
+static int
+midx_resync(mp3_header_parser_t *hp, u_char *buf, int *pos, int n, int eof)
+{
+    int hs = hp->header_size;
+    mp3_frame_t fr, nf;
+    int i;
+
+    for(i = *pos; i + IDX_HEADER_SIZE <= n; i++){
+        if(((buf[i] << 8 | buf[i+1]) & hp->sync_mask) != hp->sync)
+            continue;
+        if(hp->parser(buf + i, &fr))
+            continue;
+        if(i + fr.size + hs > n){
+            if(!eof){
+                *pos = i;
+                return -2;
+            }
+            continue;
+        }
+        if(!hp->parser(buf + i + fr.size, &nf)){
+            *pos = i;
+            return 0;
+        }
+    }
+
+    *pos = i;
+    return eof? -1: -2;
+}
+
+/* Walk frames from where the table left off, which is at a frame
+   unless resyncing.  f is the current offset within buf. */
+static void
+midx_walk(demux_index_t *idx, url_t *u, void *private)
+{
+    struct midx_stream *ms = private;
+    mp3_header_parser_t *hp = ms->hp;
+    uint64_t bpos, s;
+    int n = 0, f = 0;
+    int eof = 0, stop = 0, resync = 0;
+    u_char *buf;
+
+    demux_index_resume(idx, &bpos, &s);
+
+    if(u->seek(u, ms->start + bpos, SEEK_SET))
+        return;
+
+    buf = malloc(IDX_CHUNK);
+
+    while(!stop && !eof){
+        int r = IDX_CHUNK - n;
+        mp3_frame_t fr;
+
+        if(bpos + n + r > ms->end)
+            r = ms->end - bpos - n;
+        if(r > 0)
+            r = u->read(buf + n, 1, r, u);
+        if(r <= 0)
+            eof = 1;
+        else
+            n += r;
+
+        while(f + IDX_HEADER_SIZE <= n){
+            if(resync || hp->parser(buf + f, &fr)){
+                resync = 1;
+                if(midx_resync(hp, buf, &f, n, eof))
+                    break;
+                resync = 0;
+                continue;
+            }
+
+            if(f + fr.size > n)
+                break;
+
+            demux_index_add(idx, s, bpos + f);
+            s += fr.samples;
+            f += fr.size;
+        }
+
+        if(eof)
+            f = n;
+
+        memmove(buf, buf + f, n - f);
+        n -= f;
+        bpos += f;
+        f = 0;
+
+        stop = demux_index_progress(idx, bpos, s, eof);
+    }
+
+    free(buf);
+}
+
+/* Frame table of a file, loaded from the cache if there is one.
+   start is the offset of the first audio frame, size the number of
+   bytes of frames.  demux_index_scan finishes it. */
+extern demux_index_t *
+mp3_index_open(char *name, uint64_t start, uint64_t size,
+               mp3_header_parser_t *hp, int sample_rate)
+{
+    struct midx_stream *ms;
+    demux_index_t *idx;
+
+    ms = malloc(sizeof(*ms));
+    ms->start = start;
+    ms->end = size;
+    ms->hp = hp;
+
+    idx = demux_index_open(name, IDX_MAGIC, tcvp_demux_mp3_conf_index_dir,
+                           "mp3index", sample_rate / 2, midx_walk, ms);
+    if(!idx)
+        free(ms);
+
+    return idx;
+}
@@ -111,4 +111,4 @@ mp3_header(u_char *head, mp3_frame_t *mf)
     return 0;
 }
 
-mp3_header_parser_t mpeg1_parser = { mp3_header, 4, "MP3" };
+mp3_header_parser_t mpeg1_parser = { mp3_header, 4, "MP3", 0xffe0, 0xffe0 };
@@ -108,6 +108,21 @@ struct mpeg_stream_common {
 
 #define MPEGTS_SYNC 0x47
 
+#define MPEGTS_HDR_BATCH 16
+
+#define MPEGTS_HDR_SYNC     0x01
+#define MPEGTS_HDR_PRIORITY 0x20
+#define MPEGTS_HDR_START    0x40
+#define MPEGTS_HDR_TEI      0x80
+
+/* Header fields of a run of TS packets. */
+struct mpegts_headers {
+    uint16_t pid[MPEGTS_HDR_BATCH];
+    uint8_t flags[MPEGTS_HDR_BATCH];
+    uint8_t ctl[MPEGTS_HDR_BATCH];
+    int n;
+};
+
 #define PACK_HEADER              0xba
 #define SYSTEM_HEADER            0xbb
 
@@ -286,6 +301,15 @@ extern int write_mpeg_descriptor(stream_t *s, int tag, u_char *d, int size);
 extern int write_pes_header(u_char *p, int stream_id, int size,
                             int flags, ...);
 extern uint32_t mpeg_crc32(const u_char *data, int len);
+extern uint8_t *mpegts_find_sync(uint8_t *p, uint8_t *end);
+extern int mpegts_parse_headers(const uint8_t *p, int n,
+                                struct mpegts_headers *h);
+struct mpegts_index;
+
+extern struct mpegts_index *mpegts_index_new(char *name, uint64_t size,
+                                             const uint32_t *pids);
+extern int mpegts_index_find(struct mpegts_index *idx, unsigned pid,
+                             uint64_t pts, uint64_t *pos, uint64_t *epts);
 extern void mpeg_free(muxed_stream_t *);
 
 extern muxed_stream_t *mpegts_open(char *, url_t *, tcconf_section_t *,
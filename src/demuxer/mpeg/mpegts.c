@@ -22,9 +22,11 @@
     DEALINGS IN THE SOFTWARE.
 **/
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <tcstring.h>
 #include <tctypes.h>
 #include <tcalloc.h>
@@ -35,8 +37,26 @@
 
 #define TS_PACKET_BUF 7
 #define TS_PACKET_SIZE 188
+#define TS_BUF_SIZE (2 * TS_PACKET_SIZE * TS_PACKET_BUF)
 
 #define MAX_PACKET_SIZE 0x10000
+#define PES_PADDING 8
+
+/* PES buffer pool.  Buffers come in power of two size classes from
+   4k up to 2 * MAX_PACKET_SIZE.  Each packet holds a reference to the
+   pool, so buffers can be returned after the demuxer is closed. */
+#define POOL_MIN_SHIFT 12
+#define POOL_CLASSES   6
+#define POOL_MAX_FREE  32
+
+#define pool_size(c) (1 << (POOL_MIN_SHIFT + (c)))
+
+struct mpegts_pool {
+    pthread_mutex_t lock;
+    void *free[POOL_CLASSES];
+    int nfree[POOL_CLASSES];
+    unsigned long hits, misses;
+};
 
 struct mpegts_packet {
     int transport_error;
@@ -118,16 +138,25 @@ struct mpegts_pk {
     tcvp_data_packet_t pk;
     uint8_t *buf, *data;
     int size;
+    int bclass;
+    struct mpegts_pool *pool;
+    uint8_t **chunks;
+    int nchunks;
     struct mpegts_pk *next;
 };
 
 struct mpegts_stream {
     MPEG_COMMON;
+    muxed_stream_t *ms;
     url_t *stream;
     uint8_t *tsbuf, *tsp;
     int tsnbuf;
     int extra;
+    struct mpegts_headers hdr;
+    uint8_t *hbase;
     uint32_t *pidmap;
+    uint32_t pcrpids[(1 << 13) / 32];
+    uint64_t pid_skipped;
     int pcrpid;
     unsigned int pat_version;
     struct mpegts_program *programs;
@@ -138,6 +167,12 @@ struct mpegts_stream {
         int flags;
         uint64_t pts, dts;
         uint8_t *buf;
+        int bclass;
+        int maxsize;
+        int scatter;
+        uint8_t **sdata, **schunk;
+        int *ssize;
+        int nsl, slsize;
         int bpos;
         int hlen;
         int cc;
@@ -147,10 +182,151 @@ struct mpegts_stream {
     uint64_t start_time;
     int end;
     struct mpegts_pk *packets, *last_packet;
+    struct mpegts_pool *pool;
+    struct mpegts_index *index;
+    int scatter;
+    tcvp_stats_t stats;
 };
 
 #define getbit(v, b) ((v >> b) & 1)
 
+static int
+pool_class(int size)
+{
+    int c = 0;
+
+    while(c < POOL_CLASSES - 1 && pool_size(c) < size)
+        c++;
+
+    return c;
+}
+
+static uint8_t *
+pool_get(struct mpegts_pool *p, int c)
+{
+    uint8_t *buf = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    if(p->free[c]){
+        buf = p->free[c];
+        p->free[c] = *(void **) buf;
+        p->nfree[c]--;
+        p->hits++;
+    } else {
+        p->misses++;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if(!buf)
+        buf = malloc(pool_size(c));
+
+    return buf;
+}
+
+static void
+pool_put(struct mpegts_pool *p, uint8_t *buf, int c)
+{
+    pthread_mutex_lock(&p->lock);
+    if(p->nfree[c] < POOL_MAX_FREE){
+        *(void **) buf = p->free[c];
+        p->free[c] = buf;
+        p->nfree[c]++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    free(buf);
+}
+
+static void
+pool_free(void *p)
+{
+    struct mpegts_pool *pool = p;
+    int i;
+
+    tc2_print("MPEGTS", TC2_PRINT_DEBUG, "buffer pool: %lu hits, %lu misses\n",
+              pool->hits, pool->misses);
+
+    for(i = 0; i < POOL_CLASSES; i++){
+        while(pool->free[i]){
+            void *b = pool->free[i];
+            pool->free[i] = *(void **) b;
+            free(b);
+        }
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static struct mpegts_pool *
+pool_new(void)
+{
+    struct mpegts_pool *pool = tcallocdz(sizeof(*pool), NULL, pool_free);
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+/* Pick a buffer size for the next PES on a stream from the sizes seen
+   so far, with some headroom. */
+static void
+tsbuf_alloc(struct mpegts_stream *s, struct tsbuf *tb)
+{
+    tb->bclass = pool_class(tb->maxsize + tb->maxsize / 4 + PES_PADDING);
+    tb->buf = pool_get(s->pool, tb->bclass);
+}
+
+/* In scatter mode packets may reference the read buffer, so instead
+   of moving data around in it we start a new one. */
+static void
+tsbuf_unshare(struct mpegts_stream *s, uint8_t *from, int n)
+{
+    uint8_t *buf = tcalloc(TS_BUF_SIZE);
+
+    memcpy(buf, from, n);
+    s->tsp = buf + (s->tsp - from);
+    tcfree(s->tsbuf);
+    s->tsbuf = buf;
+}
+
+static void
+tsbuf_add_slice(struct mpegts_stream *s, struct tsbuf *tb,
+                uint8_t *data, int size)
+{
+    if(tb->nsl == tb->slsize){
+        tb->slsize = tb->slsize? tb->slsize * 2: 16;
+        tb->sdata = realloc(tb->sdata, tb->slsize * sizeof(*tb->sdata));
+        tb->schunk = realloc(tb->schunk, tb->slsize * sizeof(*tb->schunk));
+        tb->ssize = realloc(tb->ssize, tb->slsize * sizeof(*tb->ssize));
+    }
+
+    tb->sdata[tb->nsl] = data;
+    tb->ssize[tb->nsl] = size;
+    tb->schunk[tb->nsl] = tcref(s->tsbuf);
+    tb->nsl++;
+}
+
+static void
+tsbuf_reset(struct tsbuf *tb)
+{
+    while(tb->nsl)
+        tcfree(tb->schunk[--tb->nsl]);
+    tb->bpos = 0;
+    tb->flags = 0;
+    tb->hlen = 0;
+}
+
+static void
+tsbuf_grow(struct mpegts_stream *s, struct tsbuf *tb, int size)
+{
+    int c = pool_class(size);
+    uint8_t *buf = pool_get(s->pool, c);
+
+    memcpy(buf, tb->buf, tb->bpos);
+    pool_put(s->pool, tb->buf, tb->bclass);
+    tb->buf = buf;
+    tb->bclass = c;
+}
+
 static tcvp_packet_t *mpegts_packet(muxed_stream_t *ms, int str);
 
 static int
@@ -161,8 +337,14 @@ fill_buf(struct mpegts_stream *s)
     int nb = s->tsnbuf;
     int eof = 0;
 
-    memmove(s->tsbuf, s->tsp - bpos, n);
-    s->tsp = s->tsbuf + bpos;
+    s->hdr.n = 0;
+
+    if(s->scatter){
+        tsbuf_unshare(s, s->tsp - bpos, n);
+    } else {
+        memmove(s->tsbuf, s->tsp - bpos, n);
+        s->tsp = s->tsbuf + bpos;
+    }
 
     while(s->tsnbuf < TS_PACKET_BUF && !eof){
         int r = TS_PACKET_SIZE * TS_PACKET_BUF - n;
@@ -190,20 +372,20 @@ resync(struct mpegts_stream *s)
             return -1;
     }
 
+    if(s->scatter)
+        tsbuf_unshare(s, s->tsbuf, TS_BUF_SIZE);
+
+    s->hdr.n = 0;
+
     while(s->tsp[0] != MPEGTS_SYNC || s->tsp[188] != MPEGTS_SYNC){
         ptrdiff_t bpos = s->tsp - s->tsbuf;
         uint8_t *bufmax =
             s->tsp - bpos % 188 + (s->tsnbuf - 1) * TS_PACKET_SIZE + s->extra;
-        int sync = 0;
+        int sync;
         int nb;
 
-        while(s->tsp < bufmax){
-            if(s->tsp[0] == MPEGTS_SYNC && s->tsp[188] == MPEGTS_SYNC){
-                sync = 1;
-                break;
-            }
-            s->tsp++;
-        }
+        s->tsp = mpegts_find_sync(s->tsp, bufmax);
+        sync = s->tsp < bufmax;
 
         nb = bufmax - s->tsp + TS_PACKET_SIZE;
         memmove(s->tsbuf, s->tsp, nb);
@@ -245,6 +427,44 @@ skip_packet(struct mpegts_stream *s)
     s->tsnbuf--;
 }
 
+/* Whether packets on a PID need to be parsed at all.  PSI is always
+   wanted, ES only if the stream is in use.  PCR PIDs are kept so
+   their clock references are still seen. */
+static inline int
+ts_pid_wanted(struct mpegts_stream *s, unsigned int pid)
+{
+    uint32_t pm = s->pidmap[pid];
+
+    if(s->pcrpids[pid / 32] & (1U << (pid % 32)))
+        return 1;
+
+    switch(MPEGTS_PID_TYPE(pm)){
+    case MPEGTS_PID_TYPE_PSI:
+        return 1;
+    case MPEGTS_PID_TYPE_ES:
+        return s->ms->used_streams[MPEGTS_PID_INDEX(pm)];
+    }
+
+    return 0;
+}
+
+/* Index of the current packet in the decoded header batch, decoding
+   a new batch starting here if needed. */
+static int
+ts_header(struct mpegts_stream *s)
+{
+    ptrdiff_t off = s->tsp - s->hbase;
+
+    if(!s->hdr.n || off < 0 || off % TS_PACKET_SIZE ||
+       off / TS_PACKET_SIZE >= s->hdr.n){
+        s->hbase = s->tsp;
+        mpegts_parse_headers(s->tsp, s->tsnbuf, &s->hdr);
+        off = 0;
+    }
+
+    return off / TS_PACKET_SIZE;
+}
+
 static uint64_t
 get_pcr(uint8_t *p)
 {
@@ -264,7 +484,7 @@ get_pcr(uint8_t *p)
 static int
 mpegts_read_packet(struct mpegts_stream *s, struct mpegts_packet *mp)
 {
-    int error = 0, skip = 0;
+    int error = 0, skip = 0, filtered;
 
 #define do_error() do {                         \
     skip_packet(s);                             \
@@ -283,8 +503,10 @@ mpegts_read_packet(struct mpegts_stream *s, struct mpegts_packet *mp)
     do {
         uint8_t *pkstart;
         unsigned v;
+        int h;
 
         error = 0;
+        filtered = 0;
 
         if(!s->tsnbuf){
             if(fill_buf(s))
@@ -292,8 +514,9 @@ mpegts_read_packet(struct mpegts_stream *s, struct mpegts_packet *mp)
         }
 
         pkstart = s->tsp;
+        h = ts_header(s);
 
-        if(*s->tsp != MPEGTS_SYNC){
+        if(!(s->hdr.flags[h] & MPEGTS_HDR_SYNC)){
             tc2_print("MPEGTS", TC2_PRINT_WARNING,
                       "bad sync byte %02x @%ti, buf %i, %llx\n",
                       *s->tsp, s->tsp - s->tsbuf, s->tsnbuf,
@@ -305,19 +528,28 @@ mpegts_read_packet(struct mpegts_stream *s, struct mpegts_packet *mp)
             continue;
         }
 
-        s->tsp++;
-        v = *s->tsp++;
-        mp->transport_error = getbit(v, 7);
+        /* Unused PIDs are dropped on the batched header alone,
+           without looking at the adaptation field. */
+        if(s->ms->used_streams && !ts_pid_wanted(s, s->hdr.pid[h])){
+            skip_packet(s);
+            __sync_fetch_and_add(&s->pid_skipped, 1);
+            filtered = 1;
+            continue;
+        }
+
+        s->tsp += 4;
+        v = s->hdr.flags[h];
+        mp->transport_error = !!(v & MPEGTS_HDR_TEI);
         if(mp->transport_error){
             tc2_print("MPEGTS", TC2_PRINT_WARNING, "transport error\n");
             do_error();
         }
 
-        mp->unit_start = getbit(v, 6);
-        mp->priority = getbit(v, 5);
-        mp->pid = (v & 0x1f) << 8 | *s->tsp++;
+        mp->unit_start = !!(v & MPEGTS_HDR_START);
+        mp->priority = !!(v & MPEGTS_HDR_PRIORITY);
+        mp->pid = s->hdr.pid[h];
 
-        v = *s->tsp++;
+        v = s->hdr.ctl[h];
         mp->scrambling = (v >> 6) & 3;
         mp->adaptation = (v >> 4) & 3;
         mp->cont_counter = v & 0xf;
@@ -395,7 +627,7 @@ mpegts_read_packet(struct mpegts_stream *s, struct mpegts_packet *mp)
         s->tsp += mp->data_length;
         s->tsnbuf--;
       next:;
-    } while(error && skip < tcvp_demux_mpeg_conf_ts_max_skip);
+    } while(filtered || (error && skip < tcvp_demux_mpeg_conf_ts_max_skip));
 
     return error;
 #undef do_error
@@ -406,17 +638,93 @@ static void
 mpegts_free_pk(void *p)
 {
     struct mpegts_pk *mp = p;
-    free(mp->buf);
+    pool_put(mp->pool, mp->buf, mp->bclass);
+    tcfree(mp->pool);
+}
+
+static void
+mpegts_free_spk(void *p)
+{
+    struct mpegts_pk *mp = p;
+    int i;
+
+    for(i = 0; i < mp->nchunks; i++)
+        tcfree(mp->chunks[i]);
+    free(mp->chunks);
+    free(mp->pk.data);
+    free(mp->pk.sizes);
 }
 
 #define absdiff(a,b) ((a)>(b)?(a)-(b):(b)-(a))
 
+static void
+mpegts_reset(muxed_stream_t *ms)
+{
+    struct mpegts_stream *s = ms->private;
+    int i;
+
+    for(i = 0; i < ms->n_streams; i++){
+        tsbuf_reset(s->streams + i);
+        s->streams[i].start = 0;
+        s->streams[i].cc = -1;
+    }
+}
+
+/* Seek straight to an indexed entry on the first used video stream,
+   or the first used stream if there is no video. */
+static int
+mpegts_index_seek(muxed_stream_t *ms, uint64_t time, uint64_t *st)
+{
+    struct mpegts_stream *s = ms->private;
+    uint64_t pos, pts;
+    int i, sx = -1;
+    unsigned pid;
+
+    for(i = 0; i < ms->n_streams; i++){
+        if(!ms->used_streams[i])
+            continue;
+        if(sx < 0 || ms->streams[i].stream_type == STREAM_TYPE_VIDEO)
+            sx = i;
+        if(ms->streams[i].stream_type == STREAM_TYPE_VIDEO)
+            break;
+    }
+
+    if(sx < 0)
+        return -1;
+
+    for(pid = 0; pid < (1 << 13); pid++)
+        if(s->pidmap[pid] == MPEGTS_PID_MAP(MPEGTS_PID_TYPE_ES, sx))
+            break;
+
+    if(mpegts_index_find(s->index, pid, time / 300, &pos, &pts))
+        return -1;
+
+    if(s->stream->seek(s->stream, pos, SEEK_SET))
+        return -1;
+
+    s->tsp = s->tsbuf;
+    s->tsnbuf = 0;
+    s->extra = 0;
+    s->hdr.n = 0;
+    mpegts_reset(ms);
+
+    tc2_print("MPEGTS", TC2_PRINT_DEBUG, "index seek: PID %x @%llu\n",
+              pid, (unsigned long long) pos);
+
+    *st = pts * 300;
+    return 0;
+}
+
 static uint64_t
 mpegts_seek(muxed_stream_t *ms, uint64_t time)
 {
     struct mpegts_stream *s = ms->private;
     int64_t p, st;
-    int i, sm = SEEK_SET, c = 0;
+    int sm = SEEK_SET, c = 0;
+    uint64_t ist;
+
+    if(s->index && !mpegts_index_seek(ms, time, &ist))
+        return ist;
 
     p = time / 27000 * s->rate;
 
@@ -427,12 +735,7 @@ mpegts_seek(muxed_stream_t *ms, uint64_t time)
         if(s->stream->seek(s->stream, p, sm))
             return -1;
 
-        for(i = 0; i < ms->n_streams; i++){
-            s->streams[i].flags = 0;
-            s->streams[i].bpos = 0;
-            s->streams[i].start = 0;
-            s->streams[i].cc = -1;
-        }
+        mpegts_reset(ms);
 
         st = 0;
 
@@ -484,6 +787,25 @@ mpegts_free_programs(struct mpegts_stream *s)
     s->pat_version = MPEGTS_PSI_NO_VERSION;
 }
 
+static char *
+mpegts_stats(void *p)
+{
+    struct mpegts_stream *s = p;
+    unsigned long hits, misses;
+    char *st = malloc(128);
+
+    pthread_mutex_lock(&s->pool->lock);
+    hits = s->pool->hits;
+    misses = s->pool->misses;
+    pthread_mutex_unlock(&s->pool->lock);
+
+    snprintf(st, 128, "PES buffers: %lu hits, %lu misses, "
+             "%llu packets skipped on unused PIDs", hits, misses,
+             (unsigned long long) __sync_fetch_and_add(&s->pid_skipped, 0));
+
+    return st;
+}
+
 static void
 mpegts_free(void *p)
 {
@@ -491,12 +813,23 @@ mpegts_free(void *p)
     struct mpegts_stream *s = ms->private;
     int i;
 
+    tc2_print("MPEGTS", TC2_PRINT_DEBUG, "skipped %llu packets on unused PIDs\n",
+              (unsigned long long) s->pid_skipped);
+
+    if(s->index)
+        tcfree(s->index);
     if(s->stream)
         s->stream->close(s->stream);
     free(s->pidmap);
     if(s->streams){
-        for(i = 0; i < ms->n_streams; i++)
-            free(s->streams[i].buf);
+        for(i = 0; i < ms->n_streams; i++){
+            struct tsbuf *tb = s->streams + i;
+            tsbuf_reset(tb);
+            free(tb->sdata);
+            free(tb->schunk);
+            free(tb->ssize);
+            pool_put(s->pool, tb->buf, tb->bclass);
+        }
         free(s->streams);
     }
 
@@ -509,8 +842,9 @@ mpegts_free(void *p)
     }
 
     free(s->mpeg4_es);
-    free(s->tsbuf);
+    tcfree(s->tsbuf);
     free(s->psi);
+    tcfree(s->pool);
     free(s);
     mpeg_free(ms);
 }
@@ -866,17 +1200,54 @@ out:
     return err;
 }
 
+/* Hand the slices collected for a PES over to a scatter packet. */
+static struct mpegts_pk *
+mpegts_mkspacket(struct mpegts_stream *s, struct tsbuf *tb)
+{
+    struct mpegts_pk *pk;
+
+    pk = tcallocdz(sizeof(*pk), NULL, mpegts_free_spk);
+    pk->pk.data = tb->sdata;
+    pk->pk.sizes = tb->ssize;
+    pk->pk.planes = tb->nsl;
+    pk->chunks = tb->schunk;
+    pk->nchunks = tb->nsl;
+
+    pk->pk.data[0] += tb->hlen;
+    pk->pk.sizes[0] -= tb->hlen;
+    pk->pk.flags |= TCVP_PKT_FLAG_SCATTER;
+
+    tb->sdata = tb->schunk = NULL;
+    tb->ssize = NULL;
+    tb->nsl = tb->slsize = 0;
+
+    return pk;
+}
+
 static struct mpegts_pk *
 mpegts_mkpacket(struct mpegts_stream *s, int sx)
 {
     struct tsbuf *tb = s->streams + sx;
     struct mpegts_pk *pk;
 
+    if(tb->scatter){
+        pk = mpegts_mkspacket(s, tb);
+        pk->pk.stream = sx;
+        pk->pk.flags |= tb->flags;
+        if(tb->flags & TCVP_PKT_FLAG_PTS)
+            pk->pk.pts = tb->pts * 300;
+        if(tb->flags & TCVP_PKT_FLAG_DTS)
+            pk->pk.dts = tb->dts * 300;
+        goto queue;
+    }
+
     pk = tcallocdz(sizeof(*pk), NULL, mpegts_free_pk);
     pk->pk.stream = sx;
     pk->pk.data = &pk->data;
     pk->data = tb->buf + tb->hlen;
     pk->buf = tb->buf;
+    pk->bclass = tb->bclass;
+    pk->pool = tcref(s->pool);
     pk->pk.sizes = &pk->size;
     pk->size = tb->bpos - tb->hlen;
     pk->pk.planes = 1;
@@ -886,10 +1257,15 @@ mpegts_mkpacket(struct mpegts_stream *s, int sx)
     if(tb->flags & TCVP_PKT_FLAG_DTS)
         pk->pk.dts = tb->dts * 300;
 
-    memset(pk->data + pk->size, 0, 8);
+    memset(pk->data + pk->size, 0, PES_PADDING);
 
-    tb->buf = malloc(2 * MAX_PACKET_SIZE);
+    if(tb->bpos > tb->maxsize)
+        tb->maxsize = tb->bpos;
+    else
+        tb->maxsize -= (tb->maxsize - tb->bpos) / 16;
+    tsbuf_alloc(s, tb);
 
+queue:
     if (s->last_packet) {
         s->last_packet->next = pk;
         s->last_packet = pk;
@@ -932,19 +1308,31 @@ mpegts_do_es(muxed_stream_t *ms, struct mpegts_packet *mp)
     if((mp->unit_start && tb->bpos) || tb->bpos > MAX_PACKET_SIZE){
         if(tb->start)
             mpegts_mkpacket(s, sx);
-        tb->bpos = 0;
-        tb->flags = 0;
-        tb->hlen = 0;
+        tsbuf_reset(tb);
     }
 
-    memcpy(tb->buf + tb->bpos, mp->data, mp->data_length);
+    /* A PES is only sliced if its header is complete in the first
+       TS packet, otherwise it is copied as usual. */
+    if(mp->unit_start)
+        tb->scatter = s->scatter && mp->data_length >= 9 &&
+            (mp->data[6] & 0xc0) == 0x80 &&
+            mp->data_length >= 9 + mp->data[8];
+
+    if(tb->scatter){
+        tsbuf_add_slice(s, tb, mp->data, mp->data_length);
+    } else {
+        if(tb->bpos + mp->data_length + PES_PADDING > pool_size(tb->bclass))
+            tsbuf_grow(s, tb, tb->bpos + mp->data_length + PES_PADDING);
+        memcpy(tb->buf + tb->bpos, mp->data, mp->data_length);
+    }
     tb->bpos += mp->data_length;
 
     if(mp->unit_start){
         struct mpegpes_packet pes;
-        if(mpegpes_header(&pes, tb->buf, 0) < 0)
+        uint8_t *ph = tb->scatter? mp->data: tb->buf;
+        if(mpegpes_header(&pes, ph, 0) < 0)
             return -1;
-        tb->hlen = pes.data - tb->buf;
+        tb->hlen = pes.data - ph;
         if(pes.flags & PES_FLAG_PTS){
             tb->flags |= TCVP_PKT_FLAG_PTS;
             tb->pts = pes.pts;
@@ -1056,6 +1444,9 @@ mpegts_add_streams(muxed_stream_t *ms, struct mpegts_program *pg)
     tc2_print("MPEGTS", TC2_PRINT_DEBUG, "adding program %d [%x]\n",
               pg->program_number, pg->program_number);
 
+    if(pg->pmt_version != MPEGTS_PSI_NO_VERSION && pg->pcr_pid != 0x1fff)
+        s->pcrpids[pg->pcr_pid / 32] |= 1U << (pg->pcr_pid % 32);
+
     mpeg_parse_descriptors(ms, NULL, NULL, pg->descriptors,
                            pg->program_info_length);
 
@@ -1110,6 +1501,7 @@ mpegts_open(char *name, url_t *u, tcconf_section_t *cs, tcvp_timer_t *tm)
     unsigned int numpat = 0;
     unsigned int numpmt;
     unsigned int ns;
+    int index;
     int i;
 
     ms = tcallocdz(sizeof(*ms), NULL, mpegts_free);
@@ -1117,12 +1509,17 @@ mpegts_open(char *name, url_t *u, tcconf_section_t *cs, tcvp_timer_t *tm)
     ms->seek = mpegts_seek;
 
     s = calloc(1, sizeof(*s));
+    s->ms = ms;
     s->stream = tcref(u);
-    s->tsbuf = malloc(2 * TS_PACKET_SIZE * TS_PACKET_BUF);
+    s->tsbuf = tcalloc(TS_BUF_SIZE);
     s->tsp = s->tsbuf;
     s->pidmap = calloc((1 << 13), sizeof(*s->pidmap));
     s->pidmap[0] = MPEGTS_PID_PSI_NO_INDEX;
     s->pat_version = MPEGTS_PSI_NO_VERSION;
+    s->pool = pool_new();
+    s->stats.get = mpegts_stats;
+    s->stats.private = s;
+    tcattr_set(ms, "tcvp/stats", &s->stats, NULL, NULL);
 
     ms->private = s;
 
@@ -1148,11 +1545,25 @@ mpegts_open(char *name, url_t *u, tcconf_section_t *cs, tcvp_timer_t *tm)
 
     s->streams = calloc(ms->n_streams, sizeof(*s->streams));
     for(i = 0; i < ms->n_streams; i++){
-        s->streams[i].buf = malloc(2 * MAX_PACKET_SIZE);
+        tsbuf_alloc(s, s->streams + i);
         s->streams[i].cc = -1;
     }
 
     s->start_time = -1LL;
+    s->scatter = tcvp_demux_mpeg_conf_ts_scatter;
+    tcconf_getvalue(cs, "ts_scatter", "%i", &s->scatter);
+
+    index = tcvp_demux_mpeg_conf_ts_index;
+    tcconf_getvalue(cs, "ts_index", "%i", &index);
+    if(index && !(u->flags & URL_FLAG_STREAMED) && ms->n_streams){
+        uint32_t pids[(1 << 13) / 32] = { 0 };
+
+        for(i = 0; i < (1 << 13); i++)
+            if(MPEGTS_PID_TYPE(s->pidmap[i]) == MPEGTS_PID_TYPE_ES)
+                pids[i / 32] |= 1U << (i % 32);
+
+        s->index = mpegts_index_new(name, u->size, pids);
+    }
 
     return ms;
 
@@ -197,8 +197,37 @@ init_pmt(struct mpegts_mux *tsm, int pid, int pcr_pid)
 }
 
 static int
-write_ts_packet(struct mpegts_mux *tsm, int str, u_char *data, size_t size,
-                int ustart, uint64_t pts, uint64_t dts)
+pk_size(tcvp_data_packet_t *pk)
+{
+    int np = pk->flags & TCVP_PKT_FLAG_SCATTER? pk->planes: 1;
+    int size = 0, i;
+
+    for(i = 0; i < np; i++)
+        size += pk->sizes[i];
+
+    return size;
+}
+
+/* Copy size bytes from the start of a packet, consuming them. */
+static void
+pk_read(tcvp_data_packet_t *pk, u_char *out, int size)
+{
+    int np = pk->flags & TCVP_PKT_FLAG_SCATTER? pk->planes: 1;
+    int i;
+
+    for(i = 0; i < np && size; i++){
+        int s = min(size, pk->sizes[i]);
+        memcpy(out, pk->data[i], s);
+        pk->data[i] += s;
+        pk->sizes[i] -= s;
+        out += s;
+        size -= s;
+    }
+}
+
+static int
+write_ts_packet(struct mpegts_mux *tsm, int str, tcvp_data_packet_t *pk,
+                size_t size, int ustart, uint64_t pts, uint64_t dts)
 {
     struct mpegts_output_stream *os = tsm->streams + str;
     int cc = (os->ccount++ & 0xf) | 0x10;
@@ -260,7 +289,7 @@ write_ts_packet(struct mpegts_mux *tsm, int str, u_char *data, size_t size,
 
     memcpy(out, pesh, peshl);
     out += peshl;
-    memcpy(out, data, dsize);
+    pk_read(pk, out, dsize);
 
     return dsize;
 }
@@ -361,7 +390,7 @@ mpegts_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
 
         if(os->sts != -1){
             tclist_push(os->packets, pk);
-            os->rbytes += pk->sizes[0];
+            os->rbytes += pk_size(pk);
             tc2_print("MPEGTS", TC2_PRINT_DEBUG+8, "[%i] input rbytes=%i\n",
                       pk->stream, os->rbytes);
         } else {
@@ -376,7 +405,6 @@ mpegts_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
           tsm->streams[nst].sts < tsm->streams[nst].tailtime){
         struct mpegts_output_stream *os = tsm->streams + nst;
         uint64_t ppts = -1, pdts = -1;
-        uint8_t *data;
         int size, psize;
 
         pk = tclist_shift(os->packets);
@@ -414,8 +442,7 @@ mpegts_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
             pk->flags &= ~TCVP_PKT_FLAG_PTS;
         }
 
-        data = pk->data[0];
-        size = pk->sizes[0];
+        size = pk_size(pk);
 
         if(tsm->pcr - tsm->last_psi > tsm->psi_interval ||
            tsm->last_psi == -1){
@@ -440,10 +467,9 @@ mpegts_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
             post_packet(tsm);
         }
 
-        psize = write_ts_packet(tsm, pk->stream, data, size, os->unit_start,
+        psize = write_ts_packet(tsm, pk->stream, pk, size, os->unit_start,
                                 ppts, pdts);
         os->unit_start = 0;
-        data += psize;
         size -= psize;
         if(os->dts != -1){
 /*          os->sts += 27000000LL * 8 * psize / os->bitrate; */
@@ -472,8 +498,6 @@ mpegts_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
                 os->pid = 0;
             }
         } else {
-            pk->data[0] = data;
-            pk->sizes[0] = size;
             tclist_unshift(os->packets, pk);
         }
 
@@ -690,6 +714,7 @@ mpegts_new(tcvp_pipe_t *p, stream_t *s, tcconf_section_t *cs, tcvp_timer_t *t,
 
     p->format.stream_type = STREAM_TYPE_MULTIPLEX;
     p->format.common.codec = "mpeg-ts";
+    p->flags |= TCVP_PIPE_FLAG_SCATTER;
     p->private = tsm;
 
     free(url);
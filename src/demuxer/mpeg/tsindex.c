@@ -0,0 +1,477 @@
+/**
+    Copyright (C) 2005  Michael Ahlberg, Måns Rullgård
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+**/
+
+/* Background seek index for transport streams.
+
+   A thread opens its own handle on the file and walks it from start
+   to end, recording the position and PTS of PES starts on the
+   elementary stream PIDs.  Random access points are always recorded;
+   on PIDs that never flag them an entry is kept every half second.
+   PTS values are unwrapped past the 33-bit limit and each PID keeps
+   its entries sorted by PTS.  The index is cached through
+   demux/index, so a file is only scanned once.  An interrupted scan
+   resumes where it stopped. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <tcstring.h>
+#include <tctypes.h>
+#include <tcalloc.h>
+#include <tcvp_types.h>
+#include <mpeg_tc2.h>
+#include "mpeg.h"
+
+#define TS_PACKET_SIZE 188
+#define IDX_CHUNK (512 * TS_PACKET_SIZE)
+#define IDX_KEY_BYTES 4096
+#define IDX_INTERVAL 45000      /* 90kHz ticks between non-RAP entries */
+#define IDX_MAGIC "TCVPTSI2"
+
+#define PTS_WRAP (1ULL << 33)
+#define PTS_HALF (1ULL << 32)
+
+#define IDX_FLAG_RAP 1
+
+struct tsidx_entry {
+    uint64_t pos;
+    uint64_t pts;
+    uint16_t pid;
+    uint16_t flags;
+};
+
+struct tsidx_pid {
+    unsigned pid;
+    int rap;
+    struct tsidx_entry *e;
+    int n, a;
+};
+
+struct mpegts_index {
+    pthread_mutex_t lock;
+    pthread_t th;
+    int running;
+    volatile int stop;
+    char *name;
+    char *cache;
+    uint64_t size;
+    uint64_t done;
+    int complete;
+    int dirty;
+    uint32_t pids[(1 << 13) / 32];
+    struct tsidx_pid *streams;
+    int nstreams;
+};
+
+struct tsidx_scan {
+    uint64_t last[1 << 13];
+    uint64_t prev[1 << 13];
+    uint8_t state[1 << 13];
+};
+
+#define SCAN_SEEN 1
+#define SCAN_RAP  2
+
+/* Unwrap a 33-bit PTS to the value nearest ref. */
+static uint64_t
+pts_unwrap(uint64_t pts, uint64_t ref)
+{
+    pts |= ref & ~(PTS_WRAP - 1);
+
+    if(pts + PTS_HALF < ref)
+        pts += PTS_WRAP;
+    else if(pts > ref + PTS_HALF && pts >= PTS_WRAP)
+        pts -= PTS_WRAP;
+
+    return pts;
+}
+
+/* Call with idx->lock held. */
+static struct tsidx_pid *
+tsidx_stream(struct mpegts_index *idx, unsigned pid, int create)
+{
+    int i;
+
+    for(i = 0; i < idx->nstreams; i++)
+        if(idx->streams[i].pid == pid)
+            return idx->streams + i;
+
+    if(!create)
+        return NULL;
+
+    idx->streams = realloc(idx->streams,
+                           (idx->nstreams + 1) * sizeof(*idx->streams));
+    memset(idx->streams + idx->nstreams, 0, sizeof(*idx->streams));
+    idx->streams[idx->nstreams].pid = pid;
+
+    return idx->streams + idx->nstreams++;
+}
+
+/* Call with idx->lock held.  Entries arrive almost in PTS order, so
+   the insertion point is found from the end. */
+static void
+tsidx_insert(struct mpegts_index *idx, struct tsidx_entry *te)
+{
+    struct tsidx_pid *ip = tsidx_stream(idx, te->pid, 1);
+    int i;
+
+    if(ip->n == ip->a){
+        ip->a = ip->a? 2 * ip->a: 256;
+        ip->e = realloc(ip->e, ip->a * sizeof(*ip->e));
+    }
+
+    for(i = ip->n; i > 0 && ip->e[i-1].pts > te->pts; i--)
+        ;
+    memmove(ip->e + i + 1, ip->e + i, (ip->n - i) * sizeof(*ip->e));
+    ip->e[i] = *te;
+    ip->n++;
+    if(te->flags & IDX_FLAG_RAP)
+        ip->rap = 1;
+}
+
+static void
+tsidx_add(struct mpegts_index *idx, uint64_t pos, uint64_t pts,
+          unsigned pid, int flags)
+{
+    struct tsidx_entry te = {
+        .pos = pos,
+        .pts = pts,
+        .pid = pid,
+        .flags = flags
+    };
+
+    pthread_mutex_lock(&idx->lock);
+    tsidx_insert(idx, &te);
+    idx->dirty = 1;
+    pthread_mutex_unlock(&idx->lock);
+}
+
+static void
+tsidx_packet(struct mpegts_index *idx, struct tsidx_scan *sc,
+             uint8_t *p, uint64_t pos)
+{
+    struct mpegpes_packet pes;
+    unsigned pid = (p[1] & 0x1f) << 8 | p[2];
+    int afc = (p[3] >> 4) & 3;
+    uint8_t *d = p + 4;
+    int rap = 0, len;
+    uint64_t pts;
+
+    if((p[1] & 0xc0) != 0x40 || !(afc & 1))
+        return;
+    if(!(idx->pids[pid / 32] & (1U << (pid % 32))))
+        return;
+
+    if(afc & 2){
+        if(d[0] > 183)
+            return;
+        if(d[0] > 0)
+            rap = d[1] & 0x40;
+        d += d[0] + 1;
+    }
+
+    len = p + TS_PACKET_SIZE - d;
+    if(len < 9 || (d[6] & 0xc0) != 0x80 || len < 9 + d[8])
+        return;
+    if(mpegpes_header(&pes, d, 0) < 0 || !(pes.flags & PES_FLAG_PTS))
+        return;
+
+    pts = pes.pts;
+    if(sc->state[pid] & SCAN_SEEN)
+        pts = pts_unwrap(pts, sc->prev[pid]);
+    sc->prev[pid] = pts;
+
+    if(rap){
+        sc->state[pid] |= SCAN_RAP;
+    } else if(sc->state[pid] & SCAN_RAP){
+        return;
+    } else if(sc->state[pid] & SCAN_SEEN){
+        int64_t dt = pts - sc->last[pid];
+        if(dt >= 0 && dt < IDX_INTERVAL)
+            return;
+    }
+
+    sc->state[pid] |= SCAN_SEEN;
+    sc->last[pid] = pts;
+
+    tsidx_add(idx, pos, pts, pid, rap? IDX_FLAG_RAP: 0);
+}
+
+static void
+tsidx_load(struct mpegts_index *idx)
+{
+    demux_index_header_t hdr;
+    struct tsidx_entry *e;
+    int i;
+
+    memcpy(hdr.magic, IDX_MAGIC, 8);
+    hdr.size = idx->size;
+
+    if(!(e = demux_index_load(idx->cache, &hdr, sizeof(*e))))
+        return;
+
+    pthread_mutex_lock(&idx->lock);
+    for(i = 0; i < hdr.n; i++)
+        tsidx_insert(idx, e + i);
+    idx->done = hdr.done;
+    idx->complete = hdr.complete;
+    pthread_mutex_unlock(&idx->lock);
+
+    tc2_print("MPEGTS", TC2_PRINT_DEBUG,
+              "loaded %i index entries, %llu bytes indexed\n",
+              hdr.n, (unsigned long long) idx->done);
+
+    free(e);
+}
+
+static void
+tsidx_save(struct mpegts_index *idx)
+{
+    demux_index_header_t hdr;
+    struct tsidx_entry *e;
+    int i, n = 0;
+
+    pthread_mutex_lock(&idx->lock);
+    for(i = 0; i < idx->nstreams; i++)
+        n += idx->streams[i].n;
+
+    e = malloc(n * sizeof(*e) + 1);
+    for(i = 0, n = 0; i < idx->nstreams; i++){
+        memcpy(e + n, idx->streams[i].e,
+               idx->streams[i].n * sizeof(*e));
+        n += idx->streams[i].n;
+    }
+
+    memcpy(hdr.magic, IDX_MAGIC, 8);
+    hdr.size = idx->size;
+    hdr.done = idx->done;
+    hdr.samples = 0;
+    hdr.complete = idx->complete;
+    hdr.n = n;
+    idx->dirty = 0;
+    pthread_mutex_unlock(&idx->lock);
+
+    demux_index_save(idx->cache, &hdr, e, sizeof(*e));
+    free(e);
+}
+
+static void
+tsidx_scan(struct mpegts_index *idx, url_t *u, uint8_t *buf)
+{
+    struct tsidx_scan *sc = calloc(1, sizeof(*sc));
+    uint64_t bpos = idx->done;
+    int left = 0, i;
+
+    if(bpos && u->seek(u, bpos, SEEK_SET))
+        goto out;
+
+    /* pick up unwrapping where a cached scan stopped */
+    pthread_mutex_lock(&idx->lock);
+    for(i = 0; i < idx->nstreams; i++){
+        struct tsidx_pid *ip = idx->streams + i;
+        struct tsidx_entry *le = ip->e + ip->n - 1;
+
+        if(!ip->n)
+            continue;
+        if(ip->rap)
+            sc->state[ip->pid] |= SCAN_RAP;
+        sc->state[ip->pid] |= SCAN_SEEN;
+        sc->last[ip->pid] = le->pts;
+        sc->prev[ip->pid] = le->pts;
+    }
+    pthread_mutex_unlock(&idx->lock);
+
+    while(!idx->stop){
+        uint8_t *p = buf, *end;
+        int n;
+
+        n = u->read(buf + left, 1, IDX_CHUNK - left, u);
+        if(n <= 0){
+            pthread_mutex_lock(&idx->lock);
+            idx->complete = 1;
+            pthread_mutex_unlock(&idx->lock);
+            break;
+        }
+
+        n += left;
+        end = buf + n;
+
+        while(end - p >= TS_PACKET_SIZE){
+            if(p[0] != MPEGTS_SYNC){
+                if(end - p < 2 * TS_PACKET_SIZE)
+                    break;
+                p = mpegts_find_sync(p, end - TS_PACKET_SIZE);
+                continue;
+            }
+            tsidx_packet(idx, sc, p, bpos + (p - buf));
+            p += TS_PACKET_SIZE;
+        }
+
+        left = end - p;
+        memmove(buf, p, left);
+        bpos += p - buf;
+
+        pthread_mutex_lock(&idx->lock);
+        idx->done = bpos;
+        pthread_mutex_unlock(&idx->lock);
+
+        if(tcvp_demux_mpeg_conf_ts_index_delay > 0)
+            usleep(tcvp_demux_mpeg_conf_ts_index_delay * 1000);
+    }
+
+    tc2_print("MPEGTS", TC2_PRINT_DEBUG, "%s: %llu bytes indexed%s\n",
+              idx->name, (unsigned long long) bpos,
+              idx->complete? "": " (partial)");
+
+out:
+    free(sc);
+}
+
+static void *
+tsidx_run(void *p)
+{
+    struct mpegts_index *idx = p;
+    uint8_t *buf;
+    url_t *u;
+    int n;
+
+    if(!(u = url_open(idx->name, "r")))
+        return NULL;
+
+    buf = malloc(IDX_CHUNK);
+
+    n = u->read(buf, 1, IDX_KEY_BYTES, u);
+    if(n <= 0)
+        goto out;
+
+    idx->cache = demux_index_cache(idx->name, idx->size, buf, n,
+                                   tcvp_demux_mpeg_conf_ts_index_dir,
+                                   "tsindex");
+    if(idx->cache)
+        tsidx_load(idx);
+
+    if(!idx->complete && !u->seek(u, 0, SEEK_SET))
+        tsidx_scan(idx, u, buf);
+
+    if(idx->cache && idx->dirty)
+        tsidx_save(idx);
+
+out:
+    free(buf);
+    u->close(u);
+    return NULL;
+}
+
+static void
+tsidx_free(void *p)
+{
+    struct mpegts_index *idx = p;
+    int i;
+
+    if(idx->running){
+        idx->stop = 1;
+        pthread_join(idx->th, NULL);
+    }
+
+    pthread_mutex_destroy(&idx->lock);
+    for(i = 0; i < idx->nstreams; i++)
+        free(idx->streams[i].e);
+    free(idx->streams);
+    free(idx->cache);
+    free(idx->name);
+}
+
+/* Start indexing the elementary stream PIDs marked in the pids bitmap. */
+extern struct mpegts_index *
+mpegts_index_new(char *name, uint64_t size, const uint32_t *pids)
+{
+    struct mpegts_index *idx;
+
+    idx = tcallocdz(sizeof(*idx), NULL, tsidx_free);
+    pthread_mutex_init(&idx->lock, NULL);
+    idx->name = strdup(name);
+    idx->size = size;
+    memcpy(idx->pids, pids, sizeof(idx->pids));
+
+    if(pthread_create(&idx->th, NULL, tsidx_run, idx)){
+        tcfree(idx);
+        return NULL;
+    }
+
+    idx->running = 1;
+
+    return idx;
+}
+
+/* Find the last indexed entry on pid with a PTS not after pts,
+   preferring random access points.  A pts more than half the PTS
+   range before the first entry is taken to be past a wrap.  Fails
+   unless the index reaches past pts. */
+extern int
+mpegts_index_find(struct mpegts_index *idx, unsigned pid, uint64_t pts,
+                  uint64_t *pos, uint64_t *epts)
+{
+    struct tsidx_pid *ip;
+    int lo = 0, hi, i, ok = 0;
+
+    pthread_mutex_lock(&idx->lock);
+
+    if(!(ip = tsidx_stream(idx, pid, 0)) || !ip->n)
+        goto out;
+
+    if(pts + PTS_HALF < ip->e[0].pts)
+        pts += PTS_WRAP;
+
+    hi = ip->n;
+    while(lo < hi){
+        int m = (lo + hi) / 2;
+        if(ip->e[m].pts <= pts)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+
+    if(!lo || (lo == ip->n && !idx->complete))
+        goto out;
+
+    /* only entries before the first random access point lack the
+       flag, so this stops at once on PIDs that have them */
+    i = lo - 1;
+    if(ip->rap){
+        while(i > 0 && !(ip->e[i].flags & IDX_FLAG_RAP))
+            i--;
+        if(!(ip->e[i].flags & IDX_FLAG_RAP))
+            i = lo - 1;
+    }
+
+    *pos = ip->e[i].pos;
+    *epts = ip->e[i].pts & (PTS_WRAP - 1);
+    ok = 1;
+
+out:
+    pthread_mutex_unlock(&idx->lock);
+    return ok? 0: -1;
+}
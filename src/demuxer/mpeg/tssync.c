@@ -0,0 +1,148 @@
+/**
+    Copyright (C) 2005  Michael Ahlberg, Måns Rullgård
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+**/
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "mpeg.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define TS_PACKET_SIZE 188
+
+/* Find the first position p in [p, end) where both p[0] and p[188]
+   are sync bytes.  The caller guarantees that end[187] is readable. */
+
+static const uint8_t *
+sync_scan_c(const uint8_t *p, const uint8_t *end)
+{
+    for(; p < end; p++)
+        if(p[0] == MPEGTS_SYNC && p[TS_PACKET_SIZE] == MPEGTS_SYNC)
+            break;
+    return p;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static const uint8_t *
+sync_scan_sse2(const uint8_t *p, const uint8_t *end)
+{
+    const __m128i sync = _mm_set1_epi8(MPEGTS_SYNC);
+
+    while(end - p >= 16){
+        __m128i a = _mm_loadu_si128((const __m128i *) p);
+        __m128i b = _mm_loadu_si128((const __m128i *) (p + TS_PACKET_SIZE));
+        int m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, sync),
+                                                _mm_cmpeq_epi8(b, sync)));
+        if(m)
+            return p + __builtin_ctz(m);
+        p += 16;
+    }
+
+    return sync_scan_c(p, end);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *
+sync_scan_avx2(const uint8_t *p, const uint8_t *end)
+{
+    const __m256i sync = _mm256_set1_epi8(MPEGTS_SYNC);
+
+    while(end - p >= 32){
+        __m256i a = _mm256_loadu_si256((const __m256i *) p);
+        __m256i b =
+            _mm256_loadu_si256((const __m256i *) (p + TS_PACKET_SIZE));
+        u_int m = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, sync),
+                             _mm256_cmpeq_epi8(b, sync)));
+        if(m)
+            return p + __builtin_ctz(m);
+        p += 32;
+    }
+
+    return sync_scan_c(p, end);
+}
+#endif
+
+static const uint8_t *sync_scan_init(const uint8_t *, const uint8_t *);
+
+static const uint8_t *(*sync_scan)(const uint8_t *, const uint8_t *) =
+    sync_scan_init;
+
+static const uint8_t *
+sync_scan_init(const uint8_t *p, const uint8_t *end)
+{
+    sync_scan = sync_scan_c;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        sync_scan = sync_scan_avx2;
+    else if(__builtin_cpu_supports("sse2"))
+        sync_scan = sync_scan_sse2;
+#endif
+
+    return sync_scan(p, end);
+}
+
+extern uint8_t *
+mpegts_find_sync(uint8_t *p, uint8_t *end)
+{
+    return (uint8_t *) sync_scan(p, end);
+}
+
+/* Decode the fixed four byte header of n consecutive packets.  The
+   fields are 188 bytes apart, so this is a plain unrolled loop;
+   keeping the results together lets the demuxer check sync and PIDs
+   for a whole read without touching the payloads. */
+extern int
+mpegts_parse_headers(const uint8_t *p, int n, struct mpegts_headers *h)
+{
+    int i;
+
+    if(n > MPEGTS_HDR_BATCH)
+        n = MPEGTS_HDR_BATCH;
+
+    for(i = 0; i + 1 < n; i += 2){
+        const uint8_t *q = p + TS_PACKET_SIZE;
+        h->flags[i] = (p[1] & 0xe0) | (p[0] == MPEGTS_SYNC);
+        h->flags[i+1] = (q[1] & 0xe0) | (q[0] == MPEGTS_SYNC);
+        h->pid[i] = (p[1] & 0x1f) << 8 | p[2];
+        h->pid[i+1] = (q[1] & 0x1f) << 8 | q[2];
+        h->ctl[i] = p[3];
+        h->ctl[i+1] = q[3];
+        p += 2 * TS_PACKET_SIZE;
+    }
+
+    if(i < n){
+        h->flags[i] = (p[1] & 0xe0) | (p[0] == MPEGTS_SYNC);
+        h->pid[i] = (p[1] & 0x1f) << 8 | p[2];
+        h->ctl[i] = p[3];
+    }
+
+    h->n = n;
+    return n;
+}
@@ -202,14 +202,19 @@ extern muxed_stream_t *
 s_open(char *name, tcconf_section_t *cs, tcvp_timer_t *t)
 {
     char *m;
-    url_t *u;
+    url_t *u, *ru = NULL;
     demux_open_t sopen;
-    muxed_stream_t *ms;
+    muxed_stream_t *ms = NULL;
 
     if(!(u = url_open(name, "r")))
         return NULL;
 
-    m = s_magic(u, name);
+    if(tcvp_demux_stream_conf_readahead && !(u->flags & URL_FLAG_STREAMED))
+        ru = url_readahead_new(name, tcref(u));
+    if(!ru)
+        ru = tcref(u);
+
+    m = s_magic(ru, name);
 
     tc2_print("STREAM", TC2_PRINT_DEBUG, "mime type %s\n", m);
 
@@ -219,14 +224,14 @@ s_open(char *name, tcconf_section_t *cs, tcvp_timer_t *t)
     }
 
     if(!m)
-        return NULL;
-
-    if(!(sopen = tc2_get_symbol(m, "open")))
-        return NULL;
+        goto out;
 
+    sopen = tc2_get_symbol(m, "open");
     free(m);
+    if(!sopen)
+        goto out;
 
-    ms = sopen(name, u, cs, t);
+    ms = sopen(name, ru, cs, t);
     if(ms){
         char *a, *p;
 
@@ -255,6 +260,8 @@ s_open(char *name, tcconf_section_t *cs, tcvp_timer_t *t)
             tcattr_set(ms, "performer", strdup(a), NULL, free);
     }
 
+  out:
+    tcfree(ru);
     tcfree(u);
 
     return ms;
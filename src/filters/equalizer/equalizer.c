@@ -24,6 +24,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <tcstring.h>
 #include <tctypes.h>
@@ -34,34 +35,47 @@
 #include <equalizer_tc2.h>
 #include <tcendian.h>
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 #define EQ_BANDS 10
+#define EQ_VBANDS 12            /* bands rounded up to whole vectors */
 #define EQ_CHANNELS 16
 #define EQ_IN_FACTOR 1
+#define EQ_BLOCK 256            /* frames converted at a time */
+
+#ifndef min
+#define min(a, b) ((a) < (b)? (a): (b))
+#endif
 
-#define ENDIAN_CONVERT (1<<0)
-#define S16            (1<<1)
-#define U16            (1<<2)
-#define S8             (1<<3)
-#define U8             (1<<4)
+typedef void (*eq_decode_t)(float *, const void *, int);
+typedef void (*eq_encode_t)(void *, const float *, int);
 
 typedef struct equalizer {
     int eq_on;
 
-    int flags;
+    int ssize;
+    eq_decode_t decode;
+    eq_encode_t encode;
 
     char *frequency[EQ_BANDS];
-    float alpha[EQ_BANDS];
-    float beta[EQ_BANDS];
-    float gamma[EQ_BANDS];
+    float alpha[EQ_VBANDS];
+    float beta[EQ_VBANDS];
+    float gamma[EQ_VBANDS];
 
-    float amp[EQ_BANDS];
+    float amp[EQ_VBANDS];
     float preamp;
 
     float ampdb[EQ_BANDS];
     float preampdb;
 
+    /* x[n-1], x[n-2] and y[n-1], y[n-2] of each band */
     float x[EQ_CHANNELS][2];
-    float y[EQ_CHANNELS][EQ_BANDS][2];
+    float y[EQ_CHANNELS][2][EQ_VBANDS];
+
+    float buf[EQ_BLOCK * EQ_CHANNELS];
 } equalizer_t;
 
 
@@ -111,88 +125,271 @@ static const eq_config_t eq_config_48000 =
 
 
 
+/* Sample decoding to and from float, full scale +-1.0.  Unsigned
+   formats are offset binary. */
+
+#define eq_codec(name, type, scale, rd, wr)                             \
+static void                                                             \
+dec_##name(float *d, const void *src, int n)                            \
+{                                                                       \
+    const type *s = src;                                                \
+    int i;                                                              \
+                                                                        \
+    for(i = 0; i < n; i++)                                              \
+        d[i] = (float) rd(s[i]) * (1.0f / scale);                       \
+}                                                                       \
+                                                                        \
+static void                                                             \
+enc_##name(void *dst, const float *s, int n)                            \
+{                                                                       \
+    type *d = dst;                                                      \
+    int i;                                                              \
+                                                                        \
+    for(i = 0; i < n; i++){                                             \
+        float v = s[i] * scale;                                         \
+        v = v < -scale? -scale: v > scale - 1? scale - 1: v;            \
+        d[i] = wr(lrintf(v));                                           \
+    }                                                                   \
+}
+
+#define rd_s8(x)   ((int8_t) (x))
+#define wr_s8(x)   ((int8_t) (x))
+#define rd_u8(x)   ((int) (x) - 0x80)
+#define wr_u8(x)   ((uint8_t) ((x) + 0x80))
+#define rd_s16(x)  ((int16_t) (x))
+#define wr_s16(x)  ((int16_t) (x))
+#define rd_u16(x)  ((int) (x) - 0x8000)
+#define wr_u16(x)  ((uint16_t) ((x) + 0x8000))
+#define rd_s16s(x) ((int16_t) bswap_16(x))
+#define wr_s16s(x) bswap_16((uint16_t) (x))
+#define rd_u16s(x) ((int) bswap_16(x) - 0x8000)
+#define wr_u16s(x) bswap_16((uint16_t) ((x) + 0x8000))
+
+eq_codec(s8, int8_t, 128.0f, rd_s8, wr_s8)
+eq_codec(u8, uint8_t, 128.0f, rd_u8, wr_u8)
+eq_codec(s16, int16_t, 32768.0f, rd_s16, wr_s16)
+eq_codec(u16, uint16_t, 32768.0f, rd_u16, wr_u16)
+eq_codec(s16s, uint16_t, 32768.0f, rd_s16s, wr_s16s)
+eq_codec(u16s, uint16_t, 32768.0f, rd_u16s, wr_u16s)
+
+/* 32 bit: the clamp is done in double since 2^31 - 1 isn't a float */
+static void
+dec_s32(float *d, const void *src, int n)
+{
+    const int32_t *s = src;
+    int i;
+
+    for(i = 0; i < n; i++)
+        d[i] = (float) s[i] * (1.0f / 2147483648.0f);
+}
+
+static void
+enc_s32(void *dst, const float *s, int n)
+{
+    int32_t *d = dst;
+    int i;
+
+    for(i = 0; i < n; i++){
+        double v = (double) s[i] * 2147483648.0;
+        v = v < -2147483648.0? -2147483648.0: v > 2147483647.0? 2147483647.0: v;
+        d[i] = lrint(v);
+    }
+}
+
+static void
+dec_s32s(float *d, const void *src, int n)
+{
+    const uint32_t *s = src;
+    int i;
+
+    for(i = 0; i < n; i++)
+        d[i] = (float) (int32_t) bswap_32(s[i]) * (1.0f / 2147483648.0f);
+}
+
+static void
+enc_s32s(void *dst, const float *s, int n)
+{
+    uint32_t *d = dst;
+    int i;
+
+    enc_s32(dst, s, n);
+    for(i = 0; i < n; i++)
+        d[i] = bswap_32(d[i]);
+}
+
+static void
+dec_f32(float *d, const void *src, int n)
+{
+    memcpy(d, src, n * sizeof(*d));
+}
+
+static void
+enc_f32(void *dst, const float *s, int n)
+{
+    memcpy(dst, s, n * sizeof(*s));
+}
+
+static void
+dec_f32s(float *d, const void *src, int n)
+{
+    const uint32_t *s = src;
+    uint32_t *u = (uint32_t *) d;
+    int i;
+
+    for(i = 0; i < n; i++)
+        u[i] = bswap_32(s[i]);
+}
+
+static void
+enc_f32s(void *dst, const float *s, int n)
+{
+    dec_f32s(dst, s, n);
+}
+
+static const struct {
+    char *name;
+    int size;
+    eq_decode_t decode, sdecode;
+    eq_encode_t encode, sencode;
+} eq_formats[] = {
+    { "s8",  1, dec_s8,  dec_s8,   enc_s8,  enc_s8 },
+    { "u8",  1, dec_u8,  dec_u8,   enc_u8,  enc_u8 },
+    { "s16", 2, dec_s16, dec_s16s, enc_s16, enc_s16s },
+    { "u16", 2, dec_u16, dec_u16s, enc_u16, enc_u16s },
+    { "s32", 4, dec_s32, dec_s32s, enc_s32, enc_s32s },
+    { "f32", 4, dec_f32, dec_f32s, enc_f32, enc_f32s },
+    { NULL }
+};
+
+/* Run the bands of one channel over n samples spaced 'stride' apart.
+   The C version is the reference for the vector ones. */
+static void
+eq_channel_c(equalizer_t *eq, float *buf, int n, int stride, int ch)
+{
+    float *y0 = eq->y[ch][0], *y1 = eq->y[ch][1];
+    float x1 = eq->x[ch][0], x2 = eq->x[ch][1];
+    int i, j;
+
+    for(i = 0; i < n; i++, buf += stride){
+        float x = *buf;
+        float o = 0.0;
+
+        for(j = 0; j < EQ_BANDS; j++){
+            float y =
+                eq->alpha[j] * (x - x2) -
+                eq->beta[j]  * y1[j] +
+                eq->gamma[j] * y0[j];
+
+            y1[j] = y0[j];
+            y0[j] = y;
+
+            o += y * eq->amp[j];
+        }
+
+        x2 = x1;
+        x1 = x;
+        *buf = eq->preamp * (EQ_IN_FACTOR * x + o);
+    }
+
+    eq->x[ch][0] = x1;
+    eq->x[ch][1] = x2;
+}
+
+#ifdef HAVE_X86_SIMD
+/* All bands at once; the filter state stays in registers for the
+   whole block. */
+__attribute__((target("sse2")))
+static void
+eq_channel_sse2(equalizer_t *eq, float *buf, int n, int stride, int ch)
+{
+    __m128 a0 = _mm_loadu_ps(eq->alpha), a1 = _mm_loadu_ps(eq->alpha + 4),
+        a2 = _mm_loadu_ps(eq->alpha + 8);
+    __m128 b0 = _mm_loadu_ps(eq->beta), b1 = _mm_loadu_ps(eq->beta + 4),
+        b2 = _mm_loadu_ps(eq->beta + 8);
+    __m128 g0 = _mm_loadu_ps(eq->gamma), g1 = _mm_loadu_ps(eq->gamma + 4),
+        g2 = _mm_loadu_ps(eq->gamma + 8);
+    __m128 m0 = _mm_loadu_ps(eq->amp), m1 = _mm_loadu_ps(eq->amp + 4),
+        m2 = _mm_loadu_ps(eq->amp + 8);
+    __m128 p0 = _mm_loadu_ps(eq->y[ch][0]), p1 = _mm_loadu_ps(eq->y[ch][0] + 4),
+        p2 = _mm_loadu_ps(eq->y[ch][0] + 8);
+    __m128 q0 = _mm_loadu_ps(eq->y[ch][1]), q1 = _mm_loadu_ps(eq->y[ch][1] + 4),
+        q2 = _mm_loadu_ps(eq->y[ch][1] + 8);
+    float x1 = eq->x[ch][0], x2 = eq->x[ch][1];
+    int i;
+
+    for(i = 0; i < n; i++, buf += stride){
+        float x = *buf;
+        __m128 d = _mm_set1_ps(x - x2);
+        __m128 y0, y1, y2, o;
+
+        y0 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(a0, d), _mm_mul_ps(b0, q0)),
+                        _mm_mul_ps(g0, p0));
+        y1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(a1, d), _mm_mul_ps(b1, q1)),
+                        _mm_mul_ps(g1, p1));
+        y2 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(a2, d), _mm_mul_ps(b2, q2)),
+                        _mm_mul_ps(g2, p2));
+        q0 = p0; q1 = p1; q2 = p2;
+        p0 = y0; p1 = y1; p2 = y2;
+
+        o = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y0, m0), _mm_mul_ps(y1, m1)),
+                       _mm_mul_ps(y2, m2));
+        o = _mm_add_ps(o, _mm_movehl_ps(o, o));
+        o = _mm_add_ss(o, _mm_shuffle_ps(o, o, 1));
+
+        x2 = x1;
+        x1 = x;
+        *buf = eq->preamp * (EQ_IN_FACTOR * x + _mm_cvtss_f32(o));
+    }
+
+    _mm_storeu_ps(eq->y[ch][0], p0);
+    _mm_storeu_ps(eq->y[ch][0] + 4, p1);
+    _mm_storeu_ps(eq->y[ch][0] + 8, p2);
+    _mm_storeu_ps(eq->y[ch][1], q0);
+    _mm_storeu_ps(eq->y[ch][1] + 4, q1);
+    _mm_storeu_ps(eq->y[ch][1] + 8, q2);
+    eq->x[ch][0] = x1;
+    eq->x[ch][1] = x2;
+}
+#endif
+
+static void eq_channel_init(equalizer_t *, float *, int, int, int);
+
+static void (*eq_channel)(equalizer_t *, float *, int, int, int) =
+    eq_channel_init;
+
+static void
+eq_channel_init(equalizer_t *eq, float *buf, int n, int stride, int ch)
+{
+    eq_channel = eq_channel_c;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2"))
+        eq_channel = eq_channel_sse2;
+#endif
+    eq_channel(eq, buf, n, stride, ch);
+}
+
 extern int
 eq_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
 {
     equalizer_t *eq = p->private;
 
-    if(pk->data && eq->eq_on && eq->flags != 0){
+    if(pk->data && eq->eq_on && eq->decode){
         int nch = p->format.audio.channels;
-        int samples = pk->sizes[0]/2;
-        int ch, i, j;
-
-        int16_t *ptrs16 = (int16_t*) pk->data[0];
-        uint16_t *ptru16 = (uint16_t*) pk->data[0];
-        int8_t *ptrs8 = (int8_t*) pk->data[0];
-        uint8_t *ptru8 = (uint8_t*) pk->data[0];
-
-
-        for(i = 0; i < samples; i+=nch) {
-            for(ch = 0; ch < nch; ch++) {
-                int16_t x = 0;
-                float o = 0.0;
-                if(eq->flags & S16) {
-                    if(eq->flags & ENDIAN_CONVERT) {
-                        x = bswap_16(ptrs16[ch]);
-                    } else {
-                        x = ptrs16[ch];
-                    }
-                } else if(eq->flags & U16) {
-                    if(eq->flags & ENDIAN_CONVERT) {
-                        x = bswap_16(ptru16[ch]) - 0x8000;
-                    } else {
-                        x = ptru16[ch] - 0x8000;
-                    }
-                } else if(eq->flags & S8) {
-                    x = ptrs8[ch];
-                } else if(eq->flags & U8) {
-                    x = ptru8[ch] - 0x80;
-                }
-
-
-                for(j = 0; j < EQ_BANDS; j++) {
-                    float y =
-                        eq->alpha[j] * (x - eq->x[ch][1]) -
-                        eq->beta[j]  * eq->y[ch][j][1] +
-                        eq->gamma[j] * eq->y[ch][j][0];
-
-                    eq->y[ch][j][1] = eq->y[ch][j][0];
-                    eq->y[ch][j][0] = y;
-
-                    o += y * eq->amp[j];
-                }
-                eq->x[ch][1] = eq->x[ch][0];
-                eq->x[ch][0] = x;
-                if(eq->flags & S16) {
-                    int16_t v = (int16_t) (eq->preamp * (EQ_IN_FACTOR * x + o));
-                    if(eq->flags & ENDIAN_CONVERT) {
-                        ptrs16[ch] = bswap_16(v);
-                    } else {
-                        ptrs16[ch] = v;
-                    }
-                } else if(eq->flags & U16) {
-                    uint16_t v = (uint16_t) (eq->preamp * (EQ_IN_FACTOR * x + o));
-                    if(eq->flags & ENDIAN_CONVERT) {
-                        ptru16[ch] = bswap_16(v + 0x8000);
-                    } else {
-                        ptru16[ch] = v + 0x8000;
-                    }
-                } else if(eq->flags & S8) {
-                    ptrs8[ch] = (int8_t) (eq->preamp * (EQ_IN_FACTOR * x + o));
-                } else if(eq->flags & U8) {
-                    ptru8[ch] = (uint8_t) (eq->preamp * (EQ_IN_FACTOR * x + o))+ 0x80;
-                }
-            }
+        int frames = pk->sizes[0] / (eq->ssize * nch);
+        u_char *data = pk->data[0];
+        int ch;
 
-            if(eq->flags & S16) {
-                ptrs16 += nch;
-            } else if(eq->flags & U16) {
-                ptru16 += nch;
-            } else if(eq->flags & S8) {
-                ptrs8 += nch;
-            } else if(eq->flags & U8) {
-                ptru8 += nch;
-            }
+        while(frames > 0){
+            int n = min(frames, EQ_BLOCK);
+
+            eq->decode(eq->buf, data, n * nch);
+            for(ch = 0; ch < nch; ch++)
+                eq_channel(eq, eq->buf + ch, n, nch, ch);
+            eq->encode(data, eq->buf, n * nch);
+
+            data += n * nch * eq->ssize;
+            frames -= n;
         }
     }
 
@@ -206,6 +403,7 @@ eq_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
     int i;
     eq_config_t eqc;
     equalizer_t *eq = p->private;
+    char *fmt;
 
     if(p->format.audio.channels > EQ_CHANNELS) {
         tc2_print("EQUALIZER", TC2_PRINT_ERROR, "The equalizer support a maximum of %d channels\n", EQ_CHANNELS);
@@ -221,24 +419,28 @@ eq_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
         return PROBE_OK;
     }
 
-    if(strncmp(p->format.audio.codec, "audio/pcm-s16", 13) == 0) {
-        eq->flags = S16;
-    } else if(strncmp(p->format.audio.codec, "audio/pcm-u16", 13) == 0) {
-        eq->flags = U16;
-        tc2_print("EQUALIZER", TC2_PRINT_INFO, "Unsigned audio is untested\n");
-    } else if(strncmp(p->format.audio.codec, "audio/pcm-s8", 12) == 0) {
-        eq->flags = S8;
-    } else if(strncmp(p->format.audio.codec, "audio/pcm-u8", 12) == 0) {
-        eq->flags = U8;
-        tc2_print("EQUALIZER", TC2_PRINT_INFO, "Unsigned audio is untested\n");
-    } else {
+    fmt = strstr(p->format.audio.codec, "pcm-");
+    for(i = 0; fmt && eq_formats[i].name; i++) {
+        int l = strlen(eq_formats[i].name);
+        if(strncmp(fmt + 4, eq_formats[i].name, l) == 0 &&
+           (fmt[4 + l] == 0 || (eq_formats[i].size > 1 &&
+                                (!strcmp(fmt + 4 + l, "le") ||
+                                 !strcmp(fmt + 4 + l, "be")))))
+            break;
+    }
+
+    if(!fmt || !eq_formats[i].name) {
         tc2_print("EQUALIZER", TC2_PRINT_ERROR, "Audio format \"%s\" is not supported\n", p->format.audio.codec);
         return PROBE_OK;
     }
 
-    if(strcmp(&p->format.audio.codec[strlen(p->format.audio.codec)-2],
-              TCVP_ENDIAN) != 0) {
-        eq->flags |= ENDIAN_CONVERT;
+    eq->ssize = eq_formats[i].size;
+    if(eq->ssize > 1 && strcmp(fmt + strlen(fmt) - 2, TCVP_ENDIAN) != 0) {
+        eq->decode = eq_formats[i].sdecode;
+        eq->encode = eq_formats[i].sencode;
+    } else {
+        eq->decode = eq_formats[i].decode;
+        eq->encode = eq_formats[i].encode;
     }
 
     for(i = 0; i < EQ_BANDS; i++) {
@@ -362,16 +564,9 @@ extern int
 eq_flush(tcvp_pipe_t *p, int drop)
 {
     equalizer_t *eq = p->private;
-    int ch, j;
-
-    for(ch = 0; ch < EQ_CHANNELS; ch++) {
-        eq->x[ch][0] = 0.0;
-        eq->x[ch][1] = 0.0;
-        for(j = 0; j < EQ_BANDS; j++) {
-            eq->y[ch][j][0] = 0.0;
-            eq->y[ch][j][1] = 0.0;
-        }
-    }
+
+    memset(eq->x, 0, sizeof(eq->x));
+    memset(eq->y, 0, sizeof(eq->y));
 
     return 0;
 }
@@ -23,12 +23,18 @@
 **/
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <tcalloc.h>
 #include <tclist.h>
 #include <tcvp_types.h>
 #include <overlay_tc2.h>
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 typedef struct ovl {
     tcvp_data_packet_t *current;
     tclist_t *next;
@@ -40,6 +46,107 @@ typedef struct ovl {
     pthread_cond_t cond;
 } ovl_t;
 
+/* Overlays arrive as premultiplied "overlay/yuva420" images with a
+   table of visible column spans per row pair, so blending is
+   dst = src + dst * (255 - a) / 255 over those spans only. */
+
+static void
+blend_row_c(u_char *dst, const u_char *src, const u_char *alpha, int n)
+{
+    int i;
+
+    for(i = 0; i < n; i++){
+        int a = 255 - alpha[i];
+        int v = src[i] + ((dst[i] * (a + (a >> 7)) + 128) >> 8);
+        dst[i] = v > 255? 255: v;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void
+blend_row_sse2(u_char *dst, const u_char *src, const u_char *alpha, int n)
+{
+    __m128i z = _mm_setzero_si128();
+    __m128i ff = _mm_set1_epi16(255);
+    __m128i r = _mm_set1_epi16(128);
+    int i;
+
+    for(i = 0; i + 16 <= n; i += 16){
+        __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i a = _mm_loadu_si128((const __m128i *) (alpha + i));
+        __m128i al = _mm_sub_epi16(ff, _mm_unpacklo_epi8(a, z));
+        __m128i ah = _mm_sub_epi16(ff, _mm_unpackhi_epi8(a, z));
+        __m128i dl = _mm_unpacklo_epi8(d, z);
+        __m128i dh = _mm_unpackhi_epi8(d, z);
+
+        al = _mm_add_epi16(al, _mm_srli_epi16(al, 7));
+        ah = _mm_add_epi16(ah, _mm_srli_epi16(ah, 7));
+        dl = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(dl, al), r), 8);
+        dh = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(dh, ah), r), 8);
+        d = _mm_adds_epu8(_mm_packus_epi16(dl, dh), s);
+        _mm_storeu_si128((__m128i *) (dst + i), d);
+    }
+
+    blend_row_c(dst + i, src + i, alpha + i, n - i);
+}
+#endif
+
+static void blend_row_init(u_char *, const u_char *, const u_char *, int);
+
+static void (*blend_row)(u_char *, const u_char *, const u_char *, int) =
+    blend_row_init;
+
+static void
+blend_row_init(u_char *dst, const u_char *src, const u_char *alpha, int n)
+{
+    blend_row = blend_row_c;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2"))
+        blend_row = blend_row_sse2;
+#endif
+    blend_row(dst, src, alpha, n);
+}
+
+static void
+ovl_blend(tcvp_data_packet_t *vp, tcvp_data_packet_t *opk, int vw, int vh)
+{
+    const uint16_t *span = (const uint16_t *) opk->data[5];
+    int y, r0 = 0, r1 = opk->h / 2;
+
+    if(opk->y < 0)
+        r0 = -opk->y / 2;
+    if(opk->y + opk->h > vh)
+        r1 = (vh - opk->y) / 2;
+
+    for(y = r0; y < r1; y++){
+        int x0 = span[2 * y], x1 = span[2 * y + 1];
+        int dx = opk->x, dy = opk->y + 2 * y;
+        int i;
+
+        if(dx + x0 < 0)
+            x0 = -dx;
+        if(dx + x1 > vw)
+            x1 = (vw - dx) & ~1;
+        if(x0 >= x1)
+            continue;
+
+        for(i = 0; i < 2; i++)
+            blend_row(vp->data[0] + (dy + i) * vp->sizes[0] + dx + x0,
+                      opk->data[0] + (2 * y + i) * opk->sizes[0] + x0,
+                      opk->data[1] + (2 * y + i) * opk->sizes[1] + x0,
+                      x1 - x0);
+
+        for(i = 1; i < 3; i++)
+            blend_row(vp->data[i] + dy / 2 * vp->sizes[i] + (dx + x0) / 2,
+                      opk->data[i+1] + y * opk->sizes[i+1] + x0 / 2,
+                      opk->data[4] + y * opk->sizes[4] + x0 / 2,
+                      (x1 - x0) / 2);
+    }
+}
+
 extern int
 ovl_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
 {
@@ -84,33 +191,8 @@ ovl_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
                 lock = 1;
 
                 if(opk){
-                    uint32_t *ovp = (uint32_t *) opk->data[0];
-                    int x, y;
-
-                    for(y = 0; y < opk->h; y++){
-                        u_char *yp =
-                            vp->data[0] + vp->sizes[0] * (opk->y + y) + opk->x;
-                        u_char *u = vp->data[1] +
-                            vp->sizes[1] * (opk->y + y) / 2 + opk->x / 2;
-                        u_char *v = vp->data[2] +
-                            vp->sizes[2] * (opk->y + y) / 2 + opk->x / 2;
-                        for(x = 0; x < opk->w; x++){
-                            int alpha = *ovp >> 24;
-                            if(alpha){
-                                *yp = (*ovp >> 16) & 0xff;
-                                if(!(y & 1)){
-                                    *u = (*ovp >> 8) & 0xff;
-                                    *v = *ovp & 0xff;
-                                }
-                            }
-                            ovp++;
-                            yp++;
-                            if(x & 1){
-                                u++;
-                                v++;
-                            }
-                        }
-                    }
+                    ovl_blend(vp, opk, p->format.video.width,
+                              p->format.video.height);
                     tcfree(opk);
                 }
 
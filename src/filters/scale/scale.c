@@ -23,33 +23,239 @@
 **/
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <tcstring.h>
 #include <tcmath.h>
 #include <tcalloc.h>
 #include <tcvp_types.h>
 #include <libswscale/swscale.h>
 #include <scale_tc2.h>
 
-typedef struct scale {
+/* The picture is cut into horizontal bands scaled in parallel, each
+   by its own context.  A band is scaled together with a margin of
+   rows from its neighbours, into a scratch buffer, and only its own
+   rows are kept.  Band edges are placed where source and destination
+   rows line up exactly, so each band's filter phases match those of
+   the whole picture and no seams show. */
+
+typedef struct scale_format {
+    char *codec;
+    enum PixelFormat fmt;
+    int planes;
+    int bpp;                    /* bytes per pixel in plane 0 */
+    int xs, ys;                 /* chroma subsampling shifts */
+} scale_format_t;
+
+static scale_format_t scale_formats[] = {
+    { "video/raw-i420",    PIX_FMT_YUV420P, 3, 1, 1, 1 },
+    { "video/raw-yv12",    PIX_FMT_YUV420P, 3, 1, 1, 1 },
+    { "video/raw-yuv422p", PIX_FMT_YUV422P, 3, 1, 1, 0 },
+    { "video/raw-yvu9",    PIX_FMT_YUV410P, 3, 1, 2, 2 },
+    { "video/raw-yuy2",    PIX_FMT_YUYV422, 1, 2, 0, 0 },
+    { "video/raw-uyvy",    PIX_FMT_UYVY422, 1, 2, 0, 0 },
+    { "video/raw-rgb565",  PIX_FMT_RGB565,  1, 2, 0, 0 },
+    { "video/raw-rgb555",  PIX_FMT_RGB555,  1, 2, 0, 0 },
+    { "video/raw-gray8",   PIX_FMT_GRAY8,   1, 1, 0, 0 },
+    { NULL }
+};
+
+static struct {
+    char *name;
+    int flags;
+} scale_algorithms[] = {
+    { "fast_bilinear", SWS_FAST_BILINEAR },
+    { "bilinear",      SWS_BILINEAR },
+    { "bicubic",       SWS_BICUBIC },
+    { "point",         SWS_POINT },
+    { "area",          SWS_AREA },
+    { "gauss",         SWS_GAUSS },
+    { "lanczos",       SWS_LANCZOS },
+    { "spline",        SWS_SPLINE },
+    { NULL }
+};
+
+typedef struct scale scale_t;
+
+typedef struct scale_band {
+    scale_t *s;
     struct SwsContext *sws;
+    int sy, sh;                 /* source rows */
+    int dy, dh;                 /* destination rows kept */
+    int skip;                   /* margin rows above dy in scratch */
+    u_char *buf;                /* scratch, NULL if scaling in place */
+    u_char *data[4];
+    int strides[4];
+    pthread_t th;
+} scale_band_t;
+
+typedef struct scale_frame {
+    struct scale_frame *next;
+    u_char *data[4];
+} scale_frame_t;
+
+struct scale {
     int w, h;
     int keepaspect;
     int sh;
-} scale_t;
+    int threads;
+    int flags;
+    scale_format_t *fmt;
+    int strides[4];
+    int psize[4];
+    int fsize;
+
+    scale_band_t *bands;
+    int nbands;
+    int started;                /* band threads running */
+    u_char **src;               /* current job */
+    int *sstrides;
+    u_char **dst;
+    int job, pending, run;
+    pthread_mutex_t lock;
+    pthread_cond_t cond, done;
+
+    scale_frame_t *free_frames;
+    int nfree;
+    pthread_mutex_t flock;
+};
 
 typedef struct scale_packet {
     tcvp_data_packet_t pk;
-    u_char *data[4];
+    scale_t *s;
+    scale_frame_t *frame;
     int sizes[4];
 } scale_packet_t;
 
-void
+#define SCALE_ALIGN 32
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+static int
+gcd(int a, int b)
+{
+    while(b){
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static scale_frame_t *
+scale_get_frame(scale_t *s)
+{
+    scale_frame_t *f;
+    int i;
+
+    pthread_mutex_lock(&s->flock);
+    if((f = s->free_frames)){
+        s->free_frames = f->next;
+        s->nfree--;
+    }
+    pthread_mutex_unlock(&s->flock);
+
+    if(!f){
+        if(!(f = malloc(sizeof(*f))))
+            return NULL;
+        if(posix_memalign((void **) &f->data[0], SCALE_ALIGN, s->fsize)){
+            free(f);
+            return NULL;
+        }
+        for(i = 1; i < s->fmt->planes; i++)
+            f->data[i] = f->data[i-1] + s->psize[i-1];
+        for(; i < 4; i++)
+            f->data[i] = NULL;
+    }
+
+    return f;
+}
+
+static void
+scale_put_frame(scale_t *s, scale_frame_t *f)
+{
+    pthread_mutex_lock(&s->flock);
+    if(s->nfree < tcvp_filter_scale_conf_bufpool){
+        f->next = s->free_frames;
+        s->free_frames = f;
+        s->nfree++;
+        f = NULL;
+    }
+    pthread_mutex_unlock(&s->flock);
+
+    if(f){
+        free(f->data[0]);
+        free(f);
+    }
+}
+
+static void
 scale_free_pk(void *p)
 {
     scale_packet_t *sp = p;
+    scale_put_frame(sp->s, sp->frame);
+    tcfree(sp->s);
+}
+
+static void
+scale_band(scale_band_t *b)
+{
+    scale_t *s = b->s;
+    scale_format_t *fmt = s->fmt;
+    const u_char *src[4] = { NULL };
     int i;
 
-    for(i = 0; i < 3; i++)
-        free(sp->data[i]);
+    for(i = 0; i < fmt->planes; i++){
+        int y = i? b->sy >> fmt->ys: b->sy;
+        src[i] = s->src[i] + y * s->sstrides[i];
+    }
+
+    if(!b->buf){
+        sws_scale(b->sws, src, s->sstrides, 0, b->sh, s->dst, s->strides);
+        return;
+    }
+
+    sws_scale(b->sws, src, s->sstrides, 0, b->sh, b->data, b->strides);
+
+    for(i = 0; i < fmt->planes; i++){
+        int ys = i? fmt->ys: 0;
+        int y0 = b->dy >> ys;
+        int y1 = (b->dy + b->dh + (1 << ys) - 1) >> ys;
+        int skip = b->skip >> ys;
+        int y;
+
+        for(y = y0; y < y1; y++)
+            memcpy(s->dst[i] + y * s->strides[i],
+                   b->data[i] + (y - y0 + skip) * b->strides[i],
+                   s->strides[i]);
+    }
+}
+
+static void *
+scale_run(void *p)
+{
+    scale_band_t *b = p;
+    scale_t *s = b->s;
+    int job = 0;
+
+    pthread_mutex_lock(&s->lock);
+    while(s->run){
+        if(s->job == job){
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        job = s->job;
+        pthread_mutex_unlock(&s->lock);
+
+        scale_band(b);
+
+        pthread_mutex_lock(&s->lock);
+        if(!--s->pending)
+            pthread_cond_signal(&s->done);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return NULL;
 }
 
 extern int
@@ -60,23 +266,48 @@ scale_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
 
     if(pk->data){
         scale_packet_t *op;
+        scale_frame_t *f;
+
+        if(!(f = scale_get_frame(s))){
+            tc2_print("SCALE", TC2_PRINT_ERROR, "out of memory\n");
+            tcfree(pk);
+            return -1;
+        }
 
         op = tcallocdz(sizeof(*op), NULL, scale_free_pk);
+        op->s = tcref(s);
+        op->frame = f;
         op->pk.stream = pk->stream;
-        op->pk.data = op->data;
+        op->pk.data = op->frame->data;
         op->pk.sizes = op->sizes;
-        op->pk.planes = 3;
-        op->pk.flags = pk->flags;
+        op->pk.planes = s->fmt->planes;
+        op->pk.flags = pk->flags & ~TCVP_PKT_FLAG_DIRECT;
         op->pk.pts = pk->pts;
         op->pk.dts = pk->dts;
 
-        for(i = 0; i < 3; i++){
-            int d = i? 2: 1;
-            op->data[i] = malloc(s->w * s->h / (d * d));
-            op->sizes[i] = s->w / d;
+        for(i = 0; i < s->fmt->planes; i++)
+            op->sizes[i] = s->strides[i];
+
+        s->src = pk->data;
+        s->sstrides = pk->sizes;
+        s->dst = op->frame->data;
+
+        if(s->nbands > 1){
+            pthread_mutex_lock(&s->lock);
+            s->pending = s->nbands - 1;
+            s->job++;
+            pthread_cond_broadcast(&s->cond);
+            pthread_mutex_unlock(&s->lock);
         }
 
-        sws_scale(s->sws, pk->data, pk->sizes, 0, s->sh, op->data, op->sizes);
+        scale_band(s->bands);
+
+        if(s->nbands > 1){
+            pthread_mutex_lock(&s->lock);
+            while(s->pending)
+                pthread_cond_wait(&s->done, &s->lock);
+            pthread_mutex_unlock(&s->lock);
+        }
 
         tcfree(pk);
         pk = &op->pk;
@@ -87,18 +318,119 @@ scale_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
     return 0;
 }
 
+/* Split the destination into bands starting on rows that map exactly
+   onto source rows, with margins wide enough for the filters. */
+static int
+scale_setup(scale_t *s, int sw, int sh)
+{
+    scale_format_t *fmt = s->fmt;
+    int g = gcd(sh, s->h);
+    int du = (s->h / g) << fmt->ys, su = (sh / g) << fmt->ys;
+    int ratio = (sh + s->h - 1) / s->h;
+    int margin = ((4 + 4 * ratio) << fmt->ys) + su - 1;
+    int nb, bh, i, j;
+
+    margin = margin / su * du;
+
+    nb = s->threads;
+    if(nb > s->h / du / 2)
+        nb = s->h / du / 2;
+    if(nb < 1)
+        nb = 1;
+
+    bh = (s->h / nb + du - 1) / du * du;
+    nb = (s->h + bh - 1) / bh;
+
+    s->bands = calloc(nb, sizeof(*s->bands));
+    s->nbands = nb;
+
+    for(i = 0; i < nb; i++){
+        scale_band_t *b = s->bands + i;
+        int y0, y1, psize[4], size = 0;
+
+        b->s = s;
+        b->dy = i * bh;
+        b->dh = i < nb - 1? bh: s->h - b->dy;
+        b->skip = nb > 1 && b->dy > margin? margin: b->dy;
+
+        y0 = b->dy - b->skip;
+        y1 = b->dy + b->dh + margin;
+        if(y1 > s->h || nb == 1)
+            y1 = s->h;
+
+        b->sy = y0 / du * su;
+        b->sh = (y1 < s->h? y1 / du * su: sh) - b->sy;
+
+        b->sws = sws_getContext(sw, b->sh, fmt->fmt, s->w, y1 - y0, fmt->fmt,
+                                s->flags, NULL, NULL, NULL);
+        if(!b->sws)
+            return -1;
+
+        if(nb == 1)
+            break;
+
+        for(j = 0; j < fmt->planes; j++){
+            int ys = j? fmt->ys: 0;
+            b->strides[j] = s->strides[j];
+            psize[j] = s->strides[j] * ((y1 - y0 + (1 << ys) - 1) >> ys);
+            size += psize[j];
+        }
+
+        if(posix_memalign((void **) &b->buf, SCALE_ALIGN, size)){
+            b->buf = NULL;
+            return -1;
+        }
+        b->data[0] = b->buf;
+        for(j = 1; j < fmt->planes; j++)
+            b->data[j] = b->data[j-1] + psize[j-1];
+    }
+
+    tc2_print("SCALE", TC2_PRINT_DEBUG, "%ix%i -> %ix%i in %i bands\n",
+              sw, sh, s->w, s->h, nb);
+
+    s->run = 1;
+    for(i = 1; i < nb; i++){
+        if(pthread_create(&s->bands[i].th, NULL, scale_run, s->bands + i))
+            return -1;
+        s->started++;
+    }
+
+    return 0;
+}
+
 extern int
 scale_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
 {
     scale_t *sc = p->private;
     video_stream_t *vs = &p->format.video;
+    int i;
 
     if(!p->next)
         return PROBE_FAIL;
 
-    sc->sws = sws_getContext(vs->width, vs->height, PIX_FMT_YUV420P,
-                             sc->w, sc->h, PIX_FMT_YUV420P,
-                             SWS_BILINEAR, NULL, NULL, NULL);
+    for(i = 0; scale_formats[i].codec; i++)
+        if(!strcmp(vs->codec, scale_formats[i].codec))
+            break;
+
+    if(!scale_formats[i].codec){
+        tc2_print("SCALE", TC2_PRINT_ERROR, "unsupported format %s\n",
+                  vs->codec);
+        return PROBE_FAIL;
+    }
+
+    sc->fmt = scale_formats + i;
+    sc->fsize = 0;
+    for(i = 0; i < sc->fmt->planes; i++){
+        int xs = i? sc->fmt->xs: 0, ys = i? sc->fmt->ys: 0;
+        int w = (sc->w + (1 << xs) - 1) >> xs;
+        sc->strides[i] = ALIGN(w * sc->fmt->bpp, SCALE_ALIGN);
+        sc->psize[i] = sc->strides[i] * ((sc->h + (1 << ys) - 1) >> ys);
+        sc->fsize += sc->psize[i];
+    }
+
+    if(scale_setup(sc, vs->width, vs->height))
+        return PROBE_FAIL;
+
     sc->sh = vs->height;
     vs->width = sc->w;
     vs->height = sc->h;
@@ -116,9 +448,37 @@ static void
 scale_free(void *p)
 {
     scale_t *s = p;
+    int i;
 
-    if(s->sws)
-        sws_freeContext(s->sws);
+    if(s->started){
+        pthread_mutex_lock(&s->lock);
+        s->run = 0;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    /* only the bands after the first have threads, and after a failed
+       setup only some of them */
+    for(i = 0; i < s->nbands; i++){
+        if(i > 0 && i <= s->started)
+            pthread_join(s->bands[i].th, NULL);
+        if(s->bands[i].sws)
+            sws_freeContext(s->bands[i].sws);
+        free(s->bands[i].buf);
+    }
+    free(s->bands);
+
+    while(s->free_frames){
+        scale_frame_t *f = s->free_frames;
+        s->free_frames = f->next;
+        free(f->data[0]);
+        free(f);
+    }
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    pthread_cond_destroy(&s->done);
+    pthread_mutex_destroy(&s->flock);
 }
 
 extern int
@@ -126,7 +486,9 @@ scale_new(tcvp_pipe_t *p, stream_t *st, tcconf_section_t *cs, tcvp_timer_t *t,
           muxed_stream_t *ms)
 {
     scale_t *s;
-    int w, h;
+    char *alg = NULL;
+    int w = 0, h = 0;
+    int i;
 
     tcconf_getvalue(cs, "width", "%i", &w);
     tcconf_getvalue(cs, "height", "%i", &h);
@@ -137,8 +499,33 @@ scale_new(tcvp_pipe_t *p, stream_t *st, tcconf_section_t *cs, tcvp_timer_t *t,
     s = tcallocdz(sizeof(*s), NULL, scale_free);
     s->w = w;
     s->h = h;
+    s->flags = SWS_BILINEAR;
+    s->threads = tcvp_filter_scale_conf_threads;
 
     tcconf_getvalue(cs, "keepaspect", "%i", &s->keepaspect);
+    tcconf_getvalue(cs, "threads", "%i", &s->threads);
+    tcconf_getvalue(cs, "algorithm", "%s", &alg);
+
+    if(s->threads < 1)
+        s->threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(alg){
+        for(i = 0; scale_algorithms[i].name; i++){
+            if(!strcmp(alg, scale_algorithms[i].name)){
+                s->flags = scale_algorithms[i].flags;
+                break;
+            }
+        }
+        if(!scale_algorithms[i].name)
+            tc2_print("SCALE", TC2_PRINT_WARNING,
+                      "unknown algorithm %s\n", alg);
+        free(alg);
+    }
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    pthread_cond_init(&s->done, NULL);
+    pthread_mutex_init(&s->flock, NULL);
 
     p->private = s;
 
@@ -23,10 +23,19 @@
 **/
 
 #include <stdlib.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <tcalloc.h>
 #include <threads_tc2.h>
 
+/* Decoder lanes are independent pipelines fed with runs of
+   consecutive packets.  A lane is not tied to a thread: whenever it
+   has packets queued it is placed on the deque of one of the pool
+   workers, and idle workers steal lanes from each other.  The pool is
+   shared by every instance of the filter, so all streams of all
+   players compete for the same set of CPUs.  Output is put back in
+   order by packet sequence number. */
+
 typedef struct threads threads_t;
 
 typedef struct thr_packet {
@@ -34,32 +43,41 @@ typedef struct thr_packet {
     int seq;
 } thr_packet_t;
 
+#define LANE_IDLE    0
+#define LANE_QUEUED  1
+#define LANE_RUNNING 2
+#define LANE_PARKED  3
+
 typedef struct thread {
     tcvp_pipe_t *pipe, *end;
     thr_packet_t *pkq;
     int head, tail, nq;
-    tcvp_data_packet_t *pk;
     int seq;
+    int state;
+    int worker;
     pthread_mutex_t lock;
     pthread_cond_t cond;
-    pthread_t thr;
-    struct thread *next;
     tcvp_player_t *sh;
     threads_t *th;
     int run;
-    int free;
 } thread_t;
 
+typedef struct thr_out {
+    tcvp_data_packet_t **pk;
+    int n, size;
+    int done;
+} thr_out_t;
+
 struct threads {
     thread_t *cur;
-    thread_t *free;
-    pthread_mutex_t lock, olock;
+    pthread_mutex_t olock;
     pthread_cond_t cond, ocond;
     thread_t *threads;
     int nthreads;
-    thr_packet_t *outq;
+    thr_out_t *outq;
     int tail;
-    int iseq, oseq;
+    int iseq, oseq, dropseq;
+    int nparked;
     int qsize, osize;
     int pkc, npk;
     tcvp_pipe_t *pipe;
@@ -67,120 +85,397 @@ struct threads {
     pthread_t oth;
 };
 
-static int
-wait_packet(thread_t *t)
+typedef struct thr_deque {
+    thread_t **lanes;
+    int size, top, n;
+    pthread_mutex_t lock;
+} thr_deque_t;
+
+typedef struct thr_worker {
+    pthread_t thr;
+    thr_deque_t dq;
+} thr_worker_t;
+
+static struct thr_pool {
+    thr_worker_t *workers;
+    int nworkers;
+    int refs;
+    int pending;
+    int idle;
+    int run;
+    u_int next;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+static __thread int thr_self = -1;
+
+/* Number of packets a lane may process before yielding its worker. */
+#define LANE_BATCH 8
+
+static void
+dq_grow(thr_deque_t *dq)
 {
-    pthread_mutex_lock(&t->lock);
+    thread_t **l = calloc(dq->size * 2, sizeof(*l));
+    int i;
 
-    tc2_print("THREADS", TC2_PRINT_DEBUG+3, "[%i] waiting for packets\n",
-              t - t->th->threads);
-    while(!t->nq && t->run)
-        pthread_cond_wait(&t->cond, &t->lock);
-    if(!t->run)
-        goto end;
-
-    t->pk = t->pkq[t->tail].pk;
-    t->seq = t->pkq[t->tail].seq;
-    t->pkq[t->tail].pk = NULL;
-    if(++t->tail == t->th->qsize)
-        t->tail = 0;
-    t->nq--;
-
-    pthread_cond_broadcast(&t->cond);
-end:
-    pthread_mutex_unlock(&t->lock);
-    return t->run;
+    for(i = 0; i < dq->n; i++)
+        l[i] = dq->lanes[(dq->top + i) % dq->size];
+
+    free(dq->lanes);
+    dq->lanes = l;
+    dq->top = 0;
+    dq->size *= 2;
 }
 
-static void *
-th_run(void *p)
+/* Newly runnable lanes go to the bottom, where the owner takes work
+   from.  Lanes that used up their batch go to the top, behind
+   everything else and first in line for thieves. */
+static void
+dq_push(thr_deque_t *dq, thread_t *t, int top)
 {
-    thread_t *t = p;
-    threads_t *th = t->th;
+    pthread_mutex_lock(&dq->lock);
+    if(dq->n == dq->size)
+        dq_grow(dq);
+    if(top){
+        dq->top = (dq->top + dq->size - 1) % dq->size;
+        dq->lanes[dq->top] = t;
+    } else {
+        dq->lanes[(dq->top + dq->n) % dq->size] = t;
+    }
+    dq->n++;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static thread_t *
+dq_pop(thr_deque_t *dq, int top)
+{
+    thread_t *t = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if(dq->n){
+        dq->n--;
+        if(top){
+            t = dq->lanes[dq->top];
+            dq->top = (dq->top + 1) % dq->size;
+        } else {
+            t = dq->lanes[(dq->top + dq->n) % dq->size];
+        }
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    return t;
+}
+
+/* Call with t->lock held. */
+static void
+lane_submit(thread_t *t, int yield)
+{
+    int w = thr_self >= 0? thr_self: t->worker;
+
+    t->state = LANE_QUEUED;
+    dq_push(&pool.workers[w].dq, t, yield);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.pending++;
+    if(pool.idle)
+        pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static thread_t *
+pool_get(int self)
+{
+    thread_t *t;
+    int i;
 
-    tc2_print("THREADS", TC2_PRINT_DEBUG, "[%i] starting\n", t - th->threads);
+    if((t = dq_pop(&pool.workers[self].dq, 0)))
+        return t;
 
-    while(wait_packet(t)){
-        tc2_print("THREADS", TC2_PRINT_DEBUG+1, "[%i] processing packet %i\n",
-                  t - th->threads, t->seq);
-        t->pipe->input(t->pipe, (tcvp_packet_t *) t->pk);
+    for(i = 1; i < pool.nworkers; i++){
+        int v = (self + i) % pool.nworkers;
+        if((t = dq_pop(&pool.workers[v].dq, 1))){
+            tc2_print("THREADS", TC2_PRINT_DEBUG+3,
+                      "worker %i stole lane from %i\n", self, v);
+            return t;
+        }
     }
 
-    tc2_print("THREADS", TC2_PRINT_DEBUG, "[%i] done\n", t - th->threads);
     return NULL;
 }
 
-static int
-th_input(tcvp_pipe_t *p, tcvp_packet_t *tpk)
+static void
+thr_put(threads_t *th, int seq, tcvp_data_packet_t *pk)
 {
-    tcvp_data_packet_t *pk = (tcvp_data_packet_t *) tpk;
-    thread_t *t = p->private;
-    threads_t *th = t->th;
+    thr_out_t *o;
     int oqp;
 
     pthread_mutex_lock(&th->olock);
-    while(t->seq - th->oseq >= th->osize && t->run)
-        pthread_cond_wait(&th->cond, &th->olock);
-    if(!t->run)
-        goto end;
-
-    oqp = th->tail + t->seq - th->oseq;
+    if(seq < th->oseq)          /* late output, e.g. from a flush */
+        seq = th->oseq;
+    oqp = th->tail + seq - th->oseq;
     if(oqp >= th->osize)
         oqp -= th->osize;
+    o = th->outq + oqp;
+
+    if(pk){
+        if(o->n == o->size){
+            o->size = o->size? o->size * 2: 2;
+            o->pk = realloc(o->pk, o->size * sizeof(*o->pk));
+        }
+        o->pk[o->n++] = pk;
+    } else {
+        o->done = 1;
+        pthread_cond_broadcast(&th->ocond);
+    }
+    pthread_mutex_unlock(&th->olock);
+}
 
-    if(th->outq[oqp].pk)
-        tc2_print("THREADS", TC2_PRINT_WARNING,
-                  "[%i] BUG: outq[%i] used, oseq=%i seq=%i\n", t - th->threads,
-                  oqp, th->oseq, t->seq);
+/* Run up to LANE_BATCH packets through a lane.  A lane whose next
+   packet would not fit in the output window parks until the output
+   thread catches up instead of blocking the worker. */
+static void
+lane_run(thread_t *t)
+{
+    threads_t *th = t->th;
+    int n;
 
-    tc2_print("THREADS", TC2_PRINT_DEBUG+3, "[%i] enqueuing packet %i @ %i\n",
-              t - th->threads, t->seq, oqp);
-    th->outq[oqp].pk = pk;
-    th->outq[oqp].seq = t->seq;
+    for(n = 0; n < LANE_BATCH; n++){
+        tcvp_data_packet_t *pk;
+        int seq, drop;
 
-    pthread_cond_broadcast(&th->ocond);
-end:
-    pthread_mutex_unlock(&th->olock);
+        pthread_mutex_lock(&t->lock);
+        if(!t->run || !t->nq){
+            t->state = LANE_IDLE;
+            pthread_cond_broadcast(&t->cond);
+            pthread_mutex_unlock(&t->lock);
+            return;
+        }
+
+        seq = t->pkq[t->tail].seq;
+
+        pthread_mutex_lock(&th->olock);
+        if(seq - th->oseq >= th->osize){
+            t->state = LANE_PARKED;
+            th->nparked++;
+            pthread_mutex_unlock(&th->olock);
+            pthread_mutex_unlock(&t->lock);
+            return;
+        }
+        drop = seq < th->dropseq;
+        pthread_mutex_unlock(&th->olock);
+
+        pk = t->pkq[t->tail].pk;
+        t->pkq[t->tail].pk = NULL;
+        if(++t->tail == th->qsize)
+            t->tail = 0;
+        t->nq--;
+        t->seq = seq;
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+
+        if(drop){
+            tcfree(pk);
+        } else {
+            tc2_print("THREADS", TC2_PRINT_DEBUG+1,
+                      "[%i] processing packet %i\n", t - th->threads, seq);
+            t->pipe->input(t->pipe, (tcvp_packet_t *) pk);
+        }
+
+        thr_put(th, seq, NULL);
+    }
+
+    pthread_mutex_lock(&t->lock);
+    if(t->run && t->nq){
+        lane_submit(t, 1);
+    } else {
+        t->state = LANE_IDLE;
+        pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void *
+pool_run(void *p)
+{
+    int self = (thr_worker_t *) p - pool.workers;
+
+    tc2_print("THREADS", TC2_PRINT_DEBUG, "worker %i starting\n", self);
+    thr_self = self;
+
+    for(;;){
+        thread_t *t;
+
+        pthread_mutex_lock(&pool.lock);
+        while(!pool.pending && pool.run){
+            pool.idle++;
+            pthread_cond_wait(&pool.cond, &pool.lock);
+            pool.idle--;
+        }
+        if(!pool.run){
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        pool.pending--;
+        pthread_mutex_unlock(&pool.lock);
+
+        /* Lanes are pushed before pending is raised and claimed before
+           they are popped, so a lane is in some deque.  A scan can
+           still miss it while another lane moves between deques. */
+        while(!(t = pool_get(self)))
+            ;
+
+        pthread_mutex_lock(&t->lock);
+        t->state = LANE_RUNNING;
+        t->worker = self;
+        pthread_mutex_unlock(&t->lock);
+
+        lane_run(t);
+    }
+
+    tc2_print("THREADS", TC2_PRINT_DEBUG, "worker %i done\n", self);
+    return NULL;
+}
+
+static int
+pool_ref(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool.lock);
+    if(!pool.refs++){
+        pool.nworkers = tcvp_filter_threads_conf_pool_threads;
+        if(pool.nworkers < 1)
+            pool.nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+        if(pool.nworkers < 1)
+            pool.nworkers = 1;
+
+        tc2_print("THREADS", TC2_PRINT_DEBUG,
+                  "starting %i worker threads\n", pool.nworkers);
+
+        pool.workers = calloc(pool.nworkers, sizeof(*pool.workers));
+        pool.run = 1;
+        for(i = 0; i < pool.nworkers; i++){
+            thr_deque_t *dq = &pool.workers[i].dq;
+            dq->size = 16;
+            dq->lanes = calloc(dq->size, sizeof(*dq->lanes));
+            pthread_mutex_init(&dq->lock, NULL);
+        }
+        for(i = 0; i < pool.nworkers; i++)
+            pthread_create(&pool.workers[i].thr, NULL, pool_run,
+                           pool.workers + i);
+    }
+    pthread_mutex_unlock(&pool.lock);
 
     return 0;
 }
 
+static void
+pool_unref(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool.lock);
+    if(--pool.refs){
+        pthread_mutex_unlock(&pool.lock);
+        return;
+    }
+    pool.run = 0;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for(i = 0; i < pool.nworkers; i++){
+        pthread_join(pool.workers[i].thr, NULL);
+        pthread_mutex_destroy(&pool.workers[i].dq.lock);
+        free(pool.workers[i].dq.lanes);
+    }
+
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.nworkers = 0;
+    pool.pending = 0;
+}
+
+static int
+th_input(tcvp_pipe_t *p, tcvp_packet_t *tpk)
+{
+    thread_t *t = p->private;
+
+    tc2_print("THREADS", TC2_PRINT_DEBUG+3, "[%i] output for packet %i\n",
+              t - t->th->threads, t->seq);
+    thr_put(t->th, t->seq, (tcvp_data_packet_t *) tpk);
+
+    return 0;
+}
+
+static void
+thr_unpark(threads_t *th)
+{
+    int i;
+
+    for(i = 0; i < th->nthreads; i++){
+        thread_t *t = th->threads + i;
+        pthread_mutex_lock(&t->lock);
+        if(t->state == LANE_PARKED){
+            pthread_mutex_lock(&th->olock);
+            th->nparked--;
+            pthread_mutex_unlock(&th->olock);
+            lane_submit(t, 0);
+        }
+        pthread_mutex_unlock(&t->lock);
+    }
+}
+
 static void *
 thr_output(void *p)
 {
     threads_t *th = p;
 
     pthread_mutex_lock(&th->olock);
-    while(!th->outq[th->npk / 2].pk && th->run)
+    while(!th->outq[th->npk / 2].done && th->run)
         pthread_cond_wait(&th->ocond, &th->olock);
     pthread_mutex_unlock(&th->olock);
     if(!th->run)
         return NULL;
 
     while(th->run){
-        tcvp_data_packet_t *opk;
-        int pkn;
+        tcvp_data_packet_t **opk;
+        thr_out_t *o;
+        int i, n, parked;
 
         pthread_mutex_lock(&th->olock);
-        while(!th->outq[th->tail].pk && th->run)
+        while(!th->outq[th->tail].done && th->run)
             pthread_cond_wait(&th->ocond, &th->olock);
         if(!th->run){
             pthread_mutex_unlock(&th->olock);
             break;
         }
 
-        opk = th->outq[th->tail].pk;
-        pkn = th->outq[th->tail].seq;
+        o = th->outq + th->tail;
+        opk = o->pk;
+        n = o->n;
+        o->pk = NULL;
+        o->n = o->size = 0;
+        o->done = 0;
 
-        th->outq[th->tail].pk = NULL;
         if(++th->tail == th->osize)
             th->tail = 0;
-        th->oseq = pkn + 1;
-        pthread_cond_broadcast(&th->ocond);
+        th->oseq++;
+        parked = th->nparked;
+        pthread_cond_broadcast(&th->cond);
         pthread_mutex_unlock(&th->olock);
 
-        tc2_print("THREADS", TC2_PRINT_DEBUG+2, "sending packet %i\n", pkn);
-        th->pipe->next->input(th->pipe->next, (tcvp_packet_t *) opk);
+        if(parked)
+            thr_unpark(th);
+
+        tc2_print("THREADS", TC2_PRINT_DEBUG+2, "sending packet %i\n",
+                  th->oseq - 1);
+        for(i = 0; i < n; i++)
+            th->pipe->next->input(th->pipe->next, (tcvp_packet_t *) opk[i]);
+        free(opk);
     }
 
     return NULL;
@@ -213,7 +508,6 @@ thr_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
 
     if(!th->cur || (th->cur->nq && th->pkc > th->npk)){
         u_int i, mq = -1, tn = 0;
-        pthread_mutex_lock(&th->lock);
 
         for(i = 0; i < th->nthreads; i++){
             if(th->threads[i].nq < mq){
@@ -226,23 +520,26 @@ thr_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
         if(th->cur != t){
             th->pkc = 0;
             pk->flags |= TCVP_PKT_FLAG_DISCONT;
-            tc2_print("THREADS", TC2_PRINT_DEBUG, "switching to thread %i\n",
+            tc2_print("THREADS", TC2_PRINT_DEBUG, "switching to lane %i\n",
                       t - th->threads);
         }
 
         th->cur = t;
-
-        pthread_mutex_unlock(&th->lock);
     } else {
         t = th->cur;
     }
 
     pthread_mutex_lock(&t->lock);
-    while(t->nq == th->qsize)
+    while(t->nq == th->qsize && t->run)
         pthread_cond_wait(&t->cond, &t->lock);
+    if(!t->run){
+        pthread_mutex_unlock(&t->lock);
+        tcfree(pk);
+        return 0;
+    }
 
     tc2_print("THREADS", TC2_PRINT_DEBUG+4,
-              "enqueuing packet %i for thread %i\n",
+              "enqueuing packet %i for lane %i\n",
               th->iseq, t - th->threads);
     t->pkq[t->head].pk = pk;
     t->pkq[t->head].seq = th->iseq++;
@@ -251,14 +548,15 @@ thr_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
     t->nq++;
     if(!pk->data)
         ws = th->iseq;
-    pthread_cond_broadcast(&t->cond);
+    if(t->state == LANE_IDLE)
+        lane_submit(t, 0);
     pthread_mutex_unlock(&t->lock);
 
     if(ws){
-        pthread_mutex_lock(&th->lock);
-        while(th->oseq < ws)
-            pthread_cond_wait(&th->cond, &th->lock);
-        pthread_mutex_unlock(&th->lock);
+        pthread_mutex_lock(&th->olock);
+        while(th->oseq < ws && th->run)
+            pthread_cond_wait(&th->cond, &th->olock);
+        pthread_mutex_unlock(&th->olock);
     }
 
     return 0;
@@ -274,7 +572,6 @@ thr_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
         thread_t *t = th->threads + i;
         ps = t->pipe->probe(t->pipe, tcref(pk), s);
         t->run = 1;
-        pthread_create(&t->thr, NULL, th_run, t);
     }
 
     if(ps == PROBE_OK){
@@ -291,6 +588,12 @@ thr_flush(tcvp_pipe_t *p, int drop)
     threads_t *th = p->private;
     int i;
 
+    if(drop){
+        pthread_mutex_lock(&th->olock);
+        th->dropseq = th->iseq;
+        pthread_mutex_unlock(&th->olock);
+    }
+
     for(i = 0; i < th->nthreads; i++)
         th->threads[i].pipe->flush(th->threads[i].pipe, drop);
 
@@ -305,34 +608,59 @@ thr_free(void *p)
 
     for(i = 0; i < th->nthreads; i++){
         thread_t *t = th->threads + i;
-        tc2_print("THREADS", TC2_PRINT_DEBUG, "stopping thread %i\n", i);
+        tc2_print("THREADS", TC2_PRINT_DEBUG, "stopping lane %i\n", i);
         pthread_mutex_lock(&t->lock);
         t->run = 0;
+        if(t->state == LANE_PARKED){
+            pthread_mutex_lock(&th->olock);
+            th->nparked--;
+            pthread_mutex_unlock(&th->olock);
+            t->state = LANE_IDLE;
+        }
+        while(t->state != LANE_IDLE)
+            pthread_cond_wait(&t->cond, &t->lock);
         pthread_cond_broadcast(&t->cond);
         pthread_mutex_unlock(&t->lock);
-        pthread_join(t->thr, NULL);
-        player_close_pipe(t->pipe);
-        tcfree(t->sh);
-        pthread_mutex_destroy(&t->lock);
-        pthread_cond_destroy(&t->cond);
-        free(t->pkq);
     }
 
     if(th->oth){
         pthread_mutex_lock(&th->olock);
         th->run = 0;
         pthread_cond_broadcast(&th->ocond);
+        pthread_cond_broadcast(&th->cond);
         pthread_mutex_unlock(&th->olock);
         pthread_join(th->oth, NULL);
     }
 
+    for(i = 0; i < th->nthreads; i++){
+        thread_t *t = th->threads + i;
+        for(; t->nq; t->nq--){
+            tcfree(t->pkq[t->tail].pk);
+            if(++t->tail == th->qsize)
+                t->tail = 0;
+        }
+        player_close_pipe(t->pipe);
+        tcfree(t->sh);
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->cond);
+        free(t->pkq);
+    }
+
+    for(i = 0; i < th->osize; i++){
+        int j;
+        for(j = 0; j < th->outq[i].n; j++)
+            tcfree(th->outq[i].pk[j]);
+        free(th->outq[i].pk);
+    }
+
     free(th->outq);
     free(th->threads);
-    pthread_mutex_destroy(&th->lock);
     pthread_mutex_destroy(&th->olock);
     pthread_cond_destroy(&th->cond);
     pthread_cond_destroy(&th->ocond);
 
+    pool_unref();
+
     tc2_request(TC2_DEL_DEPENDENCY, 0, "stream");
 }
 
@@ -342,6 +670,7 @@ thr_new(tcvp_pipe_t *p, stream_t *s, tcconf_section_t *cs, tcvp_timer_t *t,
 {
     threads_t *th;
     int osize = 0;
+    u_int worker;
     int i;
 
     th = tcallocdz(sizeof(*th), NULL, thr_free);
@@ -352,7 +681,7 @@ thr_new(tcvp_pipe_t *p, stream_t *s, tcconf_section_t *cs, tcvp_timer_t *t,
     th->qsize = th->nthreads * th->npk;
     tcconf_getvalue(cs, "inqueue", "%i", &th->qsize);
     th->osize = th->nthreads * th->qsize;
-    tcconf_getvalue(cs, "buffer", "%i", osize);
+    tcconf_getvalue(cs, "buffer", "%i", &osize);
     if(osize > th->osize)
         th->osize = osize;
 
@@ -362,7 +691,12 @@ thr_new(tcvp_pipe_t *p, stream_t *s, tcconf_section_t *cs, tcvp_timer_t *t,
         return -1;
     }
 
-    pthread_mutex_init(&th->lock, NULL);
+    pool_ref();
+    pthread_mutex_lock(&pool.lock);
+    worker = pool.next;
+    pool.next += th->nthreads;
+    pthread_mutex_unlock(&pool.lock);
+
     pthread_mutex_init(&th->olock, NULL);
     pthread_cond_init(&th->cond, NULL);
     pthread_cond_init(&th->ocond, NULL);
@@ -381,6 +715,7 @@ thr_new(tcvp_pipe_t *p, stream_t *s, tcconf_section_t *cs, tcvp_timer_t *t,
         th->threads[i].end->flush = th_flush;
         th->threads[i].end->private = th->threads + i;
         th->threads[i].th = th;
+        th->threads[i].worker = (worker + i) % pool.nworkers;
         th->threads[i].pkq = calloc(th->qsize, sizeof(*th->threads[i].pkq));
 
         te = th->threads[i].pipe;
@@ -0,0 +1,794 @@
+/**
+    Copyright (C) 2006  Michael Ahlberg, Måns Rullgård
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+**/
+
+/* Read-ahead wrapper for local files.
+
+   Only regular files that are not streamed are wrapped; anything
+   else is left to its own URL.  Files on network, FUSE and optical
+   filesystems, where a page fault can stall the demuxer for as long
+   as the server or drive takes, get a ring of large blocks kept in
+   flight ahead of the read position, read with io_uring when
+   available or as preads from a few worker threads.  Files on local
+   disks are mapped into memory and read with memcpy, with the kernel
+   told to read ahead, unless mapping is off or fails.  A seek outside the window cancels what is
+   outstanding.  The file size is rechecked as reading goes on, so a
+   file that grows can be read to its new end and one that shrinks
+   does not fault the mapping.  ra_map() lets a demuxer look at the
+   data in place instead of copying it out. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include <tcalloc.h>
+#include <readahead_tc2.h>
+
+#define RA_ALIGN 4096
+#define RA_CHUNK 65536
+#define RA_MAX_THREADS 8
+
+#define BLK_FREE   0
+#define BLK_QUEUED 1
+#define BLK_BUSY   2
+#define BLK_DONE   3
+
+typedef struct ra_block {
+    uint8_t *data;
+    uint64_t pos;
+    size_t len;
+    int eof;
+    int state;
+    int stale;
+} ra_block_t;
+
+typedef struct readahead {
+    url_t *url;
+    url_t *u;
+    uint64_t pos;
+    size_t bsize;
+
+    int fd;
+    int mmap;
+    uint8_t *map;
+    uint64_t msize;
+    uint64_t advised;
+
+    ra_block_t *blk;
+    int nblk;
+    uint64_t wend;
+    int weof;
+
+    pthread_t th[RA_MAX_THREADS];
+    int nth;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond, done;
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+    int uring;
+#endif
+} readahead_t;
+
+#ifndef min
+#define min(a, b) ((a)<(b)? (a): (b))
+#endif
+
+/* Read one block at pos.  May run on several threads at once.  The
+   block is filled in chunks, and each chunk is made available to the
+   reader as soon as it arrives. */
+static ssize_t
+ra_pread(readahead_t *ra, ra_block_t *b, uint64_t pos)
+{
+    size_t n = 0;
+    ssize_t r;
+
+    while(n < ra->bsize){
+        r = pread(ra->fd, b->data + n, min(RA_CHUNK, ra->bsize - n), pos + n);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r <= 0)
+            break;
+        n += r;
+
+        pthread_mutex_lock(&ra->lock);
+        if(!b->stale)
+            b->len = n;
+        pthread_cond_broadcast(&ra->done);
+        pthread_mutex_unlock(&ra->lock);
+    }
+
+    return n;
+}
+
+/* Called with the lock held. */
+static void
+ra_complete(readahead_t *ra, ra_block_t *b, ssize_t len)
+{
+    if(b->stale){
+        b->stale = 0;
+        b->state = BLK_FREE;
+    } else {
+        b->len = len > 0? len: 0;
+        b->eof = b->len < ra->bsize;
+        b->state = BLK_DONE;
+    }
+    pthread_cond_broadcast(&ra->done);
+}
+
+static void *
+ra_run(void *p)
+{
+    readahead_t *ra = p;
+
+    pthread_mutex_lock(&ra->lock);
+    for(;;){
+        ra_block_t *b = NULL;
+        uint64_t pos;
+        ssize_t len;
+        int i;
+
+        while(!ra->stop){
+            for(i = 0; i < ra->nblk; i++)
+                if(ra->blk[i].state == BLK_QUEUED &&
+                   (!b || ra->blk[i].pos < b->pos))
+                    b = ra->blk + i;
+            if(b)
+                break;
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        }
+        if(ra->stop)
+            break;
+
+        b->state = BLK_BUSY;
+        pos = b->pos;
+        pthread_mutex_unlock(&ra->lock);
+
+        len = ra_pread(ra, b, pos);
+
+        pthread_mutex_lock(&ra->lock);
+        ra_complete(ra, b, len);
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+
+#ifdef HAVE_LIBURING
+static void
+ra_reap(readahead_t *ra, int wait)
+{
+    struct io_uring_cqe *cqe;
+
+    while(!(wait? io_uring_wait_cqe(&ra->ring, &cqe):
+            io_uring_peek_cqe(&ra->ring, &cqe))){
+        ra_block_t *b = io_uring_cqe_get_data(cqe);
+        if(b)
+            ra_complete(ra, b, cqe->res);
+        io_uring_cqe_seen(&ra->ring, cqe);
+        wait = 0;
+    }
+}
+#endif
+
+/* Start reading block b.  Called with the lock held. */
+static void
+ra_issue(readahead_t *ra, ra_block_t *b)
+{
+#ifdef HAVE_LIBURING
+    if(ra->uring){
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&ra->ring);
+        if(sqe){
+            io_uring_prep_read(sqe, ra->fd, b->data, ra->bsize, b->pos);
+            io_uring_sqe_set_data(sqe, b);
+            b->state = BLK_BUSY;
+            io_uring_submit(&ra->ring);
+            return;
+        }
+    }
+#endif
+
+    b->state = BLK_QUEUED;
+    pthread_cond_signal(&ra->cond);
+}
+
+/* Queue reads for free blocks up to the window size. */
+static void
+ra_fill(readahead_t *ra)
+{
+    int i;
+
+    for(i = 0; i < ra->nblk && !ra->weof; i++){
+        ra_block_t *b = ra->blk + i;
+        if(b->state != BLK_FREE)
+            continue;
+        if(ra->wend >= ra->u->size){
+            ra->weof = 1;
+            break;
+        }
+        b->pos = ra->wend;
+        b->len = 0;
+        b->eof = 0;
+        ra->wend += ra->bsize;
+        ra_issue(ra, b);
+    }
+}
+
+/* Drop everything in flight and restart the window at pos.  Reads
+   already running complete into stale blocks and are thrown away. */
+static void
+ra_cancel(readahead_t *ra, uint64_t pos)
+{
+    int i;
+
+    for(i = 0; i < ra->nblk; i++){
+        ra_block_t *b = ra->blk + i;
+        switch(b->state){
+        case BLK_QUEUED:
+        case BLK_DONE:
+            b->state = BLK_FREE;
+            break;
+        case BLK_BUSY:
+            b->stale = 1;
+#ifdef HAVE_LIBURING
+            if(ra->uring){
+                struct io_uring_sqe *sqe = io_uring_get_sqe(&ra->ring);
+                if(sqe){
+                    io_uring_prep_cancel(sqe, b, 0);
+                    io_uring_sqe_set_data(sqe, NULL);
+                    io_uring_submit(&ra->ring);
+                }
+            }
+#endif
+            break;
+        }
+    }
+
+    ra->wend = pos;
+    ra->weof = 0;
+}
+
+static ra_block_t *
+ra_find(readahead_t *ra)
+{
+    int i;
+
+    for(i = 0; i < ra->nblk; i++){
+        ra_block_t *b = ra->blk + i;
+        if(b->state != BLK_FREE && !b->stale &&
+           ra->pos >= b->pos && ra->pos < b->pos + ra->bsize)
+            return b;
+    }
+
+    return NULL;
+}
+
+/* Find the block holding the read position and return how many
+   bytes from there are ready, releasing blocks already read past and
+   topping up the window.  This waits only until some data at the
+   read position has arrived, not for the whole block.  0 means end
+   of file. */
+static size_t
+ra_block(readahead_t *ra, ra_block_t **bp)
+{
+    ra_block_t *b;
+    size_t avail;
+    int i;
+
+    pthread_mutex_lock(&ra->lock);
+
+    for(i = 0; i < ra->nblk; i++){
+        b = ra->blk + i;
+        if(b->state == BLK_DONE && b->pos + ra->bsize <= ra->pos)
+            b->state = BLK_FREE;
+    }
+
+    if(!ra_find(ra))
+        ra_cancel(ra, ra->pos);
+
+    for(;;){
+#ifdef HAVE_LIBURING
+        if(ra->uring)
+            ra_reap(ra, 0);
+#endif
+        ra_fill(ra);
+        b = ra_find(ra);
+        avail = 0;
+        if(b && b->pos + b->len > ra->pos)
+            avail = b->pos + b->len - ra->pos;
+        if(avail || (b? b->state == BLK_DONE: ra->weof))
+            break;
+#ifdef HAVE_LIBURING
+        if(ra->uring){
+            ra_reap(ra, 1);
+            continue;
+        }
+#endif
+        pthread_cond_wait(&ra->done, &ra->lock);
+    }
+
+    pthread_mutex_unlock(&ra->lock);
+
+    *bp = b;
+    return avail;
+}
+
+static int
+ra_mmap(readahead_t *ra, uint64_t size)
+{
+    void *m;
+
+    if(ra->map)
+        munmap(ra->map, ra->msize);
+    ra->map = NULL;
+    ra->msize = 0;
+
+    if(!size)
+        return 0;
+
+    if((off_t) (size_t) size != size)
+        return -1;
+
+    m = mmap(NULL, size, PROT_READ, MAP_SHARED, ra->fd, 0);
+    if(m == MAP_FAILED)
+        return -1;
+
+    ra->map = m;
+    ra->msize = size;
+    madvise(ra->map, size, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+/* Pick up a change in file size.  A mapping is redone so that it
+   never reaches past the end of the file, and read-ahead blocks are
+   dropped since the last of them may have been cut short.  Returns
+   nonzero if the size changed. */
+static int
+ra_resize(readahead_t *ra)
+{
+    struct stat st;
+
+    if(fstat(ra->fd, &st) || st.st_size == ra->u->size)
+        return 0;
+
+    tc2_print("READAHEAD", TC2_PRINT_DEBUG, "size changed %llu -> %llu\n",
+              (unsigned long long) ra->u->size,
+              (unsigned long long) st.st_size);
+
+    ra->u->size = st.st_size;
+    ra->advised = 0;
+
+    if(ra->mmap){
+        if(ra_mmap(ra, st.st_size)){
+            tc2_print("READAHEAD", TC2_PRINT_WARNING, "remap failed\n");
+            ra->u->size = 0;
+        }
+    } else {
+        pthread_mutex_lock(&ra->lock);
+        ra_cancel(ra, ra->pos);
+        pthread_mutex_unlock(&ra->lock);
+    }
+
+    return 1;
+}
+
+/* Advise the kernel of the next couple of blocks.  The file size is
+   checked each time, before the mapping is touched further. */
+static void
+ra_advise(readahead_t *ra)
+{
+    uint64_t end;
+    uint64_t start;
+
+    if(ra->pos + ra->bsize / 2 < ra->advised &&
+       ra->pos + 2 * ra->bsize >= ra->advised)
+        return;
+
+    ra_resize(ra);
+
+    start = ra->pos & ~(uint64_t) (RA_ALIGN - 1);
+    end = min(ra->pos + 2 * ra->bsize, ra->msize);
+    if(end > start)
+        madvise(ra->map + start, end - start, MADV_WILLNEED);
+    ra->advised = end;
+}
+
+static int
+ra_read(void *buf, size_t size, size_t count, url_t *u)
+{
+    readahead_t *ra = u->private;
+    size_t bytes = size * count;
+    size_t rbytes = 0;
+
+    if(ra->mmap){
+        if(ra->pos + bytes > ra->msize)
+            ra_resize(ra);
+        ra_advise(ra);
+        if(ra->pos >= ra->msize)
+            return 0;
+        rbytes = min(bytes, ra->msize - ra->pos);
+        memcpy(buf, ra->map + ra->pos, rbytes);
+        ra->pos += rbytes;
+        return rbytes / size;
+    }
+
+    if(ra->pos + bytes > u->size)
+        ra_resize(ra);
+
+    while(bytes){
+        ra_block_t *b;
+        size_t n = ra_block(ra, &b);
+
+        if(!n)
+            break;
+
+        n = min(bytes, n);
+        memcpy(buf, b->data + (ra->pos - b->pos), n);
+        buf += n;
+        ra->pos += n;
+        rbytes += n;
+        bytes -= n;
+    }
+
+    return rbytes / size;
+}
+
+static int
+ra_seek(url_t *u, int64_t offset, int how)
+{
+    readahead_t *ra = u->private;
+    int64_t pos;
+
+    switch(how){
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = ra->pos + offset;
+        break;
+    case SEEK_END:
+        pos = u->size + offset;
+        break;
+    default:
+        return -1;
+    }
+
+    if(pos > u->size)
+        ra_resize(ra);
+
+    if(pos < 0 || pos > u->size)
+        return -1;
+
+    ra->pos = pos;
+
+    return 0;
+}
+
+static uint64_t
+ra_tell(url_t *u)
+{
+    readahead_t *ra = u->private;
+    return ra->pos;
+}
+
+static void
+ra_stop(readahead_t *ra)
+{
+    int i;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    for(i = 0; i < ra->nth; i++)
+        pthread_join(ra->th[i], NULL);
+    ra->nth = 0;
+
+#ifdef HAVE_LIBURING
+    if(ra->uring){
+        int busy;
+
+        pthread_mutex_lock(&ra->lock);
+        ra_cancel(ra, 0);
+        do {
+            for(i = 0, busy = 0; i < ra->nblk; i++)
+                busy |= ra->blk[i].state == BLK_BUSY;
+            if(busy)
+                ra_reap(ra, 1);
+        } while(busy);
+        pthread_mutex_unlock(&ra->lock);
+
+        io_uring_queue_exit(&ra->ring);
+        ra->uring = 0;
+    }
+#endif
+}
+
+static int
+ra_close(url_t *u)
+{
+    readahead_t *ra = u->private;
+    int r;
+
+    ra_stop(ra);
+    r = ra->url->close(ra->url);
+    ra->url = NULL;
+    tcfree(u);
+    return r;
+}
+
+static void
+ra_free(void *p)
+{
+    url_t *u = p;
+    readahead_t *ra = u->private;
+    int i;
+
+    ra_stop(ra);
+    if(ra->map)
+        munmap(ra->map, ra->msize);
+    if(ra->fd >= 0)
+        close(ra->fd);
+    for(i = 0; i < ra->nblk; i++)
+        free(ra->blk[i].data);
+    free(ra->blk);
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->cond);
+    pthread_cond_destroy(&ra->done);
+    if(ra->url)
+        tcfree(ra->url);
+    free(ra);
+}
+
+static char *
+ra_local_path(char *name)
+{
+    if(!strncmp(name, "file:", 5)){
+        name += 5;
+        if(!strncmp(name, "//", 2))
+            name += 2;
+        return name;
+    }
+
+    if(strstr(name, "://"))
+        return NULL;
+
+    return name;
+}
+
+static int
+ra_open_local(readahead_t *ra, char *name, uint64_t size)
+{
+    char *path = ra_local_path(name);
+    struct stat st;
+
+    if(!path || (ra->fd = open(path, O_RDONLY)) < 0)
+        return -1;
+
+    if(fstat(ra->fd, &st) || !S_ISREG(st.st_mode) || st.st_size != size){
+        close(ra->fd);
+        ra->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+#ifdef __linux__
+static const unsigned long slow_fs[] = {
+    0x6969,                     /* nfs */
+    0x517b,                     /* smbfs */
+    0xff534d42,                 /* cifs */
+    0xfe534d42,                 /* smb2 */
+    0x564c,                     /* ncpfs */
+    0x65735546,                 /* fuse */
+    0x01021997,                 /* 9p */
+    0x00c36400,                 /* ceph */
+    0x5346414f,                 /* afs */
+    0x73757245,                 /* coda */
+    0x9660,                     /* iso9660 */
+    0x15013346,                 /* udf */
+};
+#endif
+
+/* Whether page faults on the file may block for long, in which case
+   it is read through the block ring rather than mapped. */
+static int
+ra_slow(int fd)
+{
+#ifdef __linux__
+    struct statfs sf;
+    int i;
+
+    if(fstatfs(fd, &sf))
+        return 1;
+
+    for(i = 0; i < sizeof(slow_fs) / sizeof(slow_fs[0]); i++)
+        if((unsigned long) sf.f_type == slow_fs[i])
+            return 1;
+#endif
+
+    return 0;
+}
+
+static int
+ra_start(readahead_t *ra)
+{
+    int nth, i;
+
+    ra->nblk = tcvp_input_readahead_conf_depth;
+    if(ra->nblk < 2)
+        ra->nblk = 2;
+
+    ra->blk = calloc(ra->nblk, sizeof(*ra->blk));
+    for(i = 0; i < ra->nblk; i++)
+        if(posix_memalign((void **) &ra->blk[i].data, RA_ALIGN, ra->bsize))
+            return -1;
+
+    ra->wend = ra->pos;
+
+#ifdef HAVE_LIBURING
+    if(tcvp_input_readahead_conf_uring &&
+       !io_uring_queue_init(2 * ra->nblk, &ra->ring, 0)){
+        ra->uring = 1;
+        return 0;
+    }
+#endif
+
+    nth = tcvp_input_readahead_conf_threads;
+    if(nth < 1)
+        nth = 1;
+    if(nth > RA_MAX_THREADS)
+        nth = RA_MAX_THREADS;
+
+    for(i = 0; i < nth; i++){
+        if(pthread_create(ra->th + i, NULL, ra_run, ra))
+            break;
+        ra->nth++;
+    }
+
+    return ra->nth? 0: -1;
+}
+
+/* Return a pointer to the next size bytes and advance past them, or
+   NULL if they are not available in memory.  The pointer is valid
+   until the next operation on the URL.  Nothing is consumed when
+   NULL is returned, so the caller can fall back to read(). */
+extern const void *
+ra_map(url_t *u, size_t size)
+{
+    readahead_t *ra;
+    const uint8_t *p;
+    ra_block_t *b;
+
+    if(u->read != ra_read)
+        return NULL;
+
+    ra = u->private;
+
+    if(ra->mmap){
+        if(ra->pos + size > ra->msize)
+            ra_resize(ra);
+        ra_advise(ra);
+        if(ra->pos + size > ra->msize)
+            return NULL;
+        p = ra->map + ra->pos;
+        ra->pos += size;
+        return p;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    b = ra_find(ra);
+    if(b && ra->pos + size > b->pos + b->len)
+        b = NULL;
+    pthread_mutex_unlock(&ra->lock);
+
+    if(!b)
+        return NULL;
+
+    p = b->data + (ra->pos - b->pos);
+    ra->pos += size;
+
+    return p;
+}
+
+/* Wrap a local regular file.  Anything else is declined with NULL,
+   and the caller keeps using its own URL. */
+extern url_t *
+ra_new(char *name, url_t *u)
+{
+    url_t *rau;
+    readahead_t *ra;
+    tcattr_t *attr;
+    int i, n;
+
+    if(!u->read || !u->size || (u->flags & URL_FLAG_STREAMED)){
+        tcfree(u);
+        return NULL;
+    }
+
+    ra = calloc(1, sizeof(*ra));
+    ra->url = u;
+    ra->fd = -1;
+    ra->bsize = (tcvp_input_readahead_conf_block_size + RA_ALIGN - 1) &
+        ~(RA_ALIGN - 1);
+    if(!ra->bsize)
+        ra->bsize = RA_ALIGN;
+    ra->pos = u->tell? u->tell(u): 0;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    pthread_cond_init(&ra->done, NULL);
+
+    rau = tcallocdz(sizeof(*rau), NULL, ra_free);
+    rau->size = u->size;
+    rau->flags = u->flags;
+    rau->read = ra_read;
+    rau->seek = ra_seek;
+    rau->tell = ra_tell;
+    rau->close = ra_close;
+    rau->private = ra;
+    ra->u = rau;
+
+    if(ra_open_local(ra, name, u->size)){
+        tcfree(rau);
+        return NULL;
+    }
+
+    if(tcvp_input_readahead_conf_mmap && !ra_slow(ra->fd) &&
+       !ra_mmap(ra, u->size))
+        ra->mmap = 1;
+
+    if(!ra->mmap && ra_start(ra)){
+        tcfree(rau);
+        return NULL;
+    }
+
+    /* demuxers look for things like "dvd" on the URL they are given */
+    attr = calloc(64, sizeof(*attr));
+    n = tcattr_getall(u, 64, attr);
+    for(i = 0; i < n; i++)
+        tcattr_set(rau, attr[i].name, attr[i].value, NULL, NULL);
+    free(attr);
+
+    tc2_print("READAHEAD", TC2_PRINT_DEBUG, "%s: %s\n", name,
+              ra->mmap? "mapped":
+#ifdef HAVE_LIBURING
+              ra->uring? "io_uring":
+#endif
+              "pread");
+
+    return rau;
+}
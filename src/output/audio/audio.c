@@ -51,7 +51,7 @@ typedef struct audio_out {
     u_char *buf, *head, *tail;
     int bufsize;
     int bbytes;
-    sndconv_t conv;
+    sndconv_t *conv;
     pthread_mutex_t mx;
     pthread_cond_t cd;
     pthread_t pth;
@@ -60,6 +60,7 @@ typedef struct audio_out {
         u_char *bp;
     } *ptsq;
     int pqh, pqt, pqc;
+    avsync_t sync;
     tcconf_section_t *conf;
     char outfmt[64];
 } audio_out_t;
@@ -111,6 +112,7 @@ audio_free(void *p)
 
     if(ao->buf)
         free(ao->buf);
+    tcfree(ao->conv);
     free(ao->ptsq);
     tcfree(ao->conf);
 }
@@ -127,6 +129,10 @@ audio_flush(tcvp_pipe_t *p, int drop)
         ao->bbytes = 0;
         ao->pqh = ao->pqt = 0;
         ao->pqc = 0;
+        if(tcvp_output_audio_conf_sync && ao->sync.samples){
+            avsync_reset(&ao->sync);
+            ao->timer->modulate(ao->timer, 0);
+        }
     } else {
         while(ao->bbytes)
             pthread_cond_wait(&ao->cd, &ao->mx);
@@ -147,7 +153,7 @@ audio_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
 {
     audio_out_t *ao = p->private;
     size_t count;
-    u_char *data;
+    int pos = 0;
     int pts;
 
     if(!pk->data){
@@ -155,11 +161,10 @@ audio_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
         return 0;
     }
 
-    count = pk->sizes[0];
-    data = pk->data[0];
+    count = pk->sizes[0] / ao->ibpf;
     pts = pk->flags & TCVP_PKT_FLAG_PTS;
 
-    while(count >= ao->ibpf){
+    while(count > 0){
         int bs;
 
         pthread_mutex_lock(&ao->mx);
@@ -177,11 +182,11 @@ audio_input(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
             pts = 0;
         }
 
-        bs = min(count / ao->ibpf, (ao->bufsize - ao->bbytes) / ao->obpf);
+        bs = min(count, (ao->bufsize - ao->bbytes) / ao->obpf);
         bs = min(bs, (ao->bufsize - (ao->head - ao->buf)) / ao->obpf);
-        ao->conv(ao->head, data, bs, ao->channels);
-        data += bs * ao->ibpf;
-        count -= bs * ao->ibpf;
+        ao->conv->conv(ao->conv, ao->head, pk->data, pos, bs);
+        pos += bs;
+        count -= bs;
         ao->bbytes += bs * ao->obpf;
         ao->head += bs * ao->obpf;
         if(ao->head - ao->buf == ao->bufsize)
@@ -227,14 +232,23 @@ audio_play(void *p)
                 if(pt <= pp && pp <= ao->tail){
                     int bc = ao->tail - pp;
                     uint64_t d, t, tm;
-                    int64_t dt;
+                    int64_t dt, adt;
                     int df = ao->driver->delay(ao->driver);
                     d = (uint64_t) (df - bc / ao->obpf) * 27000000 / ao->rate;
                     t = ao->ptsq[ao->pqt].pts - d;
                     tm = ao->timer->read(ao->timer);
-                    dt = tm > t? tm - t: t - tm;
-                    if(dt > tcvp_output_audio_conf_pts_threshold){
+                    dt = t - tm;
+                    adt = dt < 0? -dt: dt;
+                    if(tcvp_output_audio_conf_sync &&
+                       adt <= tcvp_output_audio_conf_sync_reset){
+                        ao->timer->modulate(ao->timer,
+                                            avsync_update(&ao->sync, tm, dt));
+                    } else if(adt > tcvp_output_audio_conf_pts_threshold){
                         ao->timer->reset(ao->timer, t);
+                        if(tcvp_output_audio_conf_sync){
+                            avsync_reset(&ao->sync);
+                            ao->timer->modulate(ao->timer, 0);
+                        }
 /*                      fprintf(stderr, "AUDIO: df = %i, pts = %llu, t = %llu, dt = %5lli\n", df, ao->ptsq[ao->pqt].pts / 27, t / 27, (int64_t)(t - tm) / 27); */
                     }
                     while(ao->ptsq[ao->pqt].bp < ao->tail && ao->pqc){
@@ -277,22 +291,6 @@ audio_buffer(tcvp_pipe_t *p, float r)
 }
 #endif
 
-static int
-get_ssize(char *s)
-{
-    s++;
-
-    if(!strncmp(s, "16", 2)){
-        return 2;
-    } else if(!strncmp(s, "32", 2)){
-        return 4;
-    } else if(!strncmp(s, "8", 1)){
-        return 1;
-    } else {
-        return 0;
-    }
-}
-
 extern int
 audio_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
 {
@@ -300,10 +298,10 @@ audio_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
     audio_driver_t *ad = NULL;
     audio_stream_t *as = &p->format.audio;
     char **formats;
-    sndconv_t conv = NULL;
-    int issize, ossize;
+    sndconv_t *conv = NULL;
+    int channels[2] = { s->audio.channels, 2 };
     char *sf;
-    int i, j;
+    int i, j, k;
 
     tcfree(pk);
 
@@ -328,13 +326,19 @@ audio_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
         if(!(adn = tc2_get_symbol(buf, "new")))
             continue;
 
-        for(j = 0; formats[j] && !ad; j++){
-            snprintf(ao->outfmt, sizeof(ao->outfmt),
-                     "audio/pcm-%s", formats[j]);
-            if((ad = adn(as, ao->conf, ao->timer))){
-                if(!(conv = audio_conv(sf, ad->format))){
-                    tcfree(ad);
-                    ad = NULL;
+        /* Fall back to a stereo downmix if the driver refuses all
+           formats at the stream's channel count. */
+        for(k = 0; k < (channels[0] > 2? 2: 1) && !ad; k++){
+            for(j = 0; formats[j] && !ad; j++){
+                snprintf(ao->outfmt, sizeof(ao->outfmt),
+                         "audio/pcm-%s", formats[j]);
+                as->channels = channels[k];
+                if((ad = adn(as, ao->conf, ao->timer))){
+                    if(!(conv = audio_conv(sf, s->audio.channels,
+                                           ad->format, as->channels))){
+                        tcfree(ad);
+                        ad = NULL;
+                    }
                 }
             }
         }
@@ -347,15 +351,13 @@ audio_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
         return PROBE_FAIL;
     }
 
-    if(!(issize = get_ssize(sf)))
-        goto err;
-
-    if(!(ossize = get_ssize(ad->format)))
-        goto err;
+    if(as->channels != s->audio.channels)
+        tc2_print("AUDIO", TC2_PRINT_VERBOSE, "mixing %i channels to %i\n",
+                  s->audio.channels, as->channels);
 
     ao->driver = ad;
-    ao->ibpf = as->channels * issize;
-    ao->obpf = as->channels * ossize;
+    ao->ibpf = conv->ibpf;
+    ao->obpf = conv->obpf;
     ao->channels = as->channels;
     ao->rate = as->sample_rate;
     ao->bufsize = ao->obpf * output_audio_conf_buffer_size;
@@ -365,10 +367,6 @@ audio_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
     pthread_create(&ao->pth, NULL, audio_play, ao);
 
     return PROBE_OK;
-err:
-    tc2_print("AUDIO", TC2_PRINT_ERROR, "unsupported format %s\n", ad->format);
-    tcfree(ad);
-    return PROBE_FAIL;
 }
 
 extern int
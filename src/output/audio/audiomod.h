@@ -25,9 +25,35 @@
 #ifndef _AUDIOMOD_H
 #define _AUDIOMOD_H
 
-typedef void (*sndconv_t)(void *dst, void *src, int samples, int channels);
+#include <sys/types.h>
+#include <stdint.h>
 
-extern sndconv_t audio_conv(char *in, char *out);
+typedef struct sndconv sndconv_t;
+struct sndconv {
+    void (*conv)(sndconv_t *, void *dst, u_char **src, int offset,
+                 int samples);
+    int ibpf;                   /* input bytes per frame (and plane) */
+    int obpf;                   /* output bytes per frame */
+    void *private;
+};
+
+extern sndconv_t *audio_conv(char *in, int ichannels, char *out,
+                             int ochannels);
 extern char **audio_all_conv(char *in);
 
+typedef struct avsync {
+    int samples;
+    double offset;              /* smoothed audio - timer, ticks */
+    uint64_t ltime;             /* timer at last sample */
+    uint64_t dtime;             /* start of drift interval */
+    double doffset;             /* offset at start of drift interval */
+    double modsum;              /* modulation applied over interval */
+    double drift;
+    int drifts;
+    double mod;
+} avsync_t;
+
+extern void avsync_reset(avsync_t *as);
+extern double avsync_update(avsync_t *as, uint64_t tm, int64_t dt);
+
 #endif
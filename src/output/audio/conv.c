@@ -25,93 +25,964 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <tctypes.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <tcalloc.h>
 #include <tcendian.h>
 #include <audio_tc2.h>
 #include <audiomod.h>
 
-#define snd_conv(sname, stype, dname, dtype, conv)                      \
-static void                                                             \
-sname##_##dname(void *dst, void *src, int samples, int channels)        \
-{                                                                       \
-    stype *s = src;                                                     \
-    dtype *d = dst;                                                     \
-    int i;                                                              \
-                                                                        \
-    for(i = 0; i < samples * channels; i++)                             \
-        d[i] = conv(s[i]);                                              \
-}
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* Sample formats are named [suf]<bits>[le|be][p], e.g. s16le, u8,
+   f32be, s24le, f64lep.  A trailing 'p' means one plane per channel
+   (packet data[c]); output is always interleaved.
+
+   Conversion runs in blocks: samples are loaded into a native work
+   buffer (left-justified int32 when both ends are integer and no
+   mixing is needed, float otherwise), optionally mixed, and stored.
+   Common pairs have single pass kernels. */
+
+#define SF_INT   0
+#define SF_UINT  1
+#define SF_FLOAT 2
+
+#define BLOCK 1024
+#define MAXCH 8
+
+#ifndef min
+#define min(a, b) ((a) < (b)? (a): (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b)? (a): (b))
+#endif
+
+typedef void (*kernel_t)(void *dst, const void *src, int n);
+typedef void (*ilv_t)(void *dst, const u_char **planes, int n, int channels);
+
+typedef struct sndfmt {
+    int type;
+    int size;                   /* bytes per sample */
+    int swap;                   /* opposite of host byte order */
+    int planar;
+} sndfmt_t;
+
+typedef struct conv_priv {
+    sndfmt_t in, out;
+    int ich, och;
+    kernel_t direct;
+    int copy;
+    kernel_t load, store;
+    kernel_t tofloat, fromfloat;
+    ilv_t ilv;
+    float *mix;
+    void *work, *work2, *tmp;
+} conv_priv_t;
+
+static int
+parse_format(char *name, sndfmt_t *sf)
+{
+    char *p = name + 1;
+    int bits;
+
+    memset(sf, 0, sizeof(*sf));
 
-#define s2u8(x) (x + 128)
-#define s32s16(x) (x >> 16)
+    switch(name[0]){
+    case 's':
+        sf->type = SF_INT;
+        break;
+    case 'u':
+        sf->type = SF_UINT;
+        break;
+    case 'f':
+        sf->type = SF_FLOAT;
+        break;
+    default:
+        return -1;
+    }
+
+    bits = strtol(p, &p, 10);
+    if(sf->type == SF_FLOAT){
+        if(bits != 32 && bits != 64)
+            return -1;
+    } else if(bits != 8 && bits != 16 && bits != 24 && bits != 32){
+        return -1;
+    }
+    sf->size = bits / 8;
+
+    if(!strncmp(p, "le", 2) || !strncmp(p, "be", 2)){
+        sf->swap = sf->size > 1 && strncmp(p, TCVP_ENDIAN, 2);
+        p += 2;
+    } else if(sf->size > 1){
+        return -1;
+    }
+
+    if(*p == 'p'){
+        sf->planar = 1;
+        p++;
+    }
+
+    return *p? -1: 0;
+}
 
-snd_conv(le16, int16_t, be16, int16_t, bswap_16)
-snd_conv(s8, char, u8, u_char, s2u8)
-snd_conv(s32, int32_t, s16, int16_t, s32s16);
+/* Scalar kernels.  These are the reference for the vector versions. */
 
-#define copy(ss)                                                \
+#define kernel(name, stype, dtype, conv)                        \
 static void                                                     \
-copy_##ss(void *dst, void *src, int samples, int channels)      \
+name(void *dst, const void *src, int n)                         \
 {                                                               \
-    memcpy(dst, src, samples * channels * ss / 8);              \
+    const stype *s = src;                                       \
+    dtype *d = dst;                                             \
+    int i;                                                      \
+                                                                \
+    for(i = 0; i < n; i++)                                      \
+        d[i] = conv(s[i]);                                      \
+}
+
+#define copy(ss)                                        \
+static void                                             \
+copy_##ss(void *dst, const void *src, int n)            \
+{                                                       \
+    memcpy(dst, src, n * ss / 8);                       \
 }
 
 copy(8)
 copy(16)
+copy(24)
 copy(32)
+copy(64)
 
-#define HE TCVP_ENDIAN
-
-static struct {
-    char *in;
-    char *out;
-    sndconv_t conv;
-} conv_table[] = {
-    { "s16le", "s16be", le16_be16 },
-    { "s16be", "s16le", le16_be16 },
-    { "u16le", "u16be", le16_be16 },
-    { "u16be", "u16le", le16_be16 },
-    { "s16le", "s16le", copy_16 },
-    { "s16be", "s16be", copy_16 },
-    { "u16le", "u16le", copy_16 },
-    { "u16be", "u16be", copy_16 },
-    { "u8",    "u8",    copy_8 },
-    { "s8",    "s8",    copy_8 },
-    { "s8",    "u8",    s8_u8 },
-    { "s32"HE, "s16"HE, s32_s16 },
-    { "f32le", "f32le", copy_32 },
-    { "f32be", "f32be", copy_32 },
-    { NULL, NULL, NULL }
-};
+/* to left-justified int32 */
+#define rd_s8(x)  ((int32_t) ((uint32_t) (uint8_t) (x) << 24))
+#define rd_u8(x)  ((int32_t) ((uint32_t) ((x) ^ 0x80) << 24))
+#define rd_s16(x) ((int32_t) ((uint32_t) (x) << 16))
+#define rd_u16(x) ((int32_t) ((uint32_t) ((x) ^ 0x8000) << 16))
+#define rd_s16s(x) rd_s16(bswap_16(x))
+#define rd_u16s(x) rd_u16(bswap_16(x))
+#define rd_s32(x) ((int32_t) (x))
+#define rd_u32(x) ((int32_t) ((x) ^ 0x80000000))
+#define rd_s32s(x) rd_s32(bswap_32(x))
+#define rd_u32s(x) rd_u32(bswap_32(x))
+
+kernel(s8_i32, uint8_t, int32_t, rd_s8)
+kernel(u8_i32, uint8_t, int32_t, rd_u8)
+kernel(s16_i32, uint16_t, int32_t, rd_s16)
+kernel(u16_i32, uint16_t, int32_t, rd_u16)
+kernel(s16s_i32, uint16_t, int32_t, rd_s16s)
+kernel(u16s_i32, uint16_t, int32_t, rd_u16s)
+kernel(u32_i32, uint32_t, int32_t, rd_u32)
+kernel(s32s_i32, uint32_t, int32_t, rd_s32s)
+kernel(u32s_i32, uint32_t, int32_t, rd_u32s)
+
+/* from left-justified int32, truncating */
+#define wr_s8(x)  ((uint8_t) ((x) >> 24))
+#define wr_u8(x)  ((uint8_t) (((x) >> 24) ^ 0x80))
+#define wr_s16(x) ((uint16_t) ((x) >> 16))
+#define wr_u16(x) ((uint16_t) (((x) >> 16) ^ 0x8000))
+#define wr_s16s(x) bswap_16(wr_s16(x))
+#define wr_u16s(x) bswap_16(wr_u16(x))
+#define wr_u32(x) ((uint32_t) (x) ^ 0x80000000)
+#define wr_s32s(x) bswap_32((uint32_t) (x))
+#define wr_u32s(x) bswap_32(wr_u32(x))
+
+kernel(i32_s8, int32_t, uint8_t, wr_s8)
+kernel(i32_u8, int32_t, uint8_t, wr_u8)
+kernel(i32_s16_c, int32_t, uint16_t, wr_s16)
+kernel(i32_u16, int32_t, uint16_t, wr_u16)
+kernel(i32_s16s, int32_t, uint16_t, wr_s16s)
+kernel(i32_u16s, int32_t, uint16_t, wr_u16s)
+kernel(i32_u32, int32_t, uint32_t, wr_u32)
+kernel(i32_s32s, int32_t, uint32_t, wr_s32s)
+kernel(i32_u32s, int32_t, uint32_t, wr_u32s)
+
+#define s2u8(x) ((x) ^ 0x80)
+kernel(s8_u8, uint8_t, uint8_t, s2u8)
 
-extern sndconv_t
-audio_conv(char *in, char *out)
+kernel(bswap16_c, uint16_t, uint16_t, bswap_16)
+kernel(bswap32, uint32_t, uint32_t, bswap_32)
+kernel(bswap64, uint64_t, uint64_t, bswap_64)
+
+static void
+bswap24(void *dst, const void *src, int n)
 {
+    const u_char *s = src;
+    u_char *d = dst;
     int i;
 
-    for(i = 0; conv_table[i].in; i++){
-        if(!strcmp(in, conv_table[i].in) &&
-           !strcmp(out, conv_table[i].out)){
-            return conv_table[i].conv;
-        }
+    for(i = 0; i < n; i++, s += 3, d += 3){
+        u_char t = s[0];
+        d[0] = s[2];
+        d[1] = s[1];
+        d[2] = t;
+    }
+}
+
+#define s24_kernels(e, b0, b1, b2)                                      \
+static void                                                             \
+s24##e##_i32(void *dst, const void *src, int n)                         \
+{                                                                       \
+    const u_char *s = src;                                              \
+    int32_t *d = dst;                                                   \
+    int i;                                                              \
+                                                                        \
+    for(i = 0; i < n; i++, s += 3)                                      \
+        d[i] = (int32_t) ((uint32_t) s[b0] << 8 | (uint32_t) s[b1] << 16 | \
+                          (uint32_t) s[b2] << 24);                      \
+}                                                                       \
+                                                                        \
+static void                                                             \
+u24##e##_i32(void *dst, const void *src, int n)                         \
+{                                                                       \
+    int32_t *d = dst;                                                   \
+    int i;                                                              \
+                                                                        \
+    s24##e##_i32(dst, src, n);                                          \
+    for(i = 0; i < n; i++)                                              \
+        d[i] ^= 0x80000000;                                             \
+}                                                                       \
+                                                                        \
+static void                                                             \
+i32_s24##e(void *dst, const void *src, int n)                           \
+{                                                                       \
+    const int32_t *s = src;                                             \
+    u_char *d = dst;                                                    \
+    int i;                                                              \
+                                                                        \
+    for(i = 0; i < n; i++, d += 3){                                     \
+        d[b0] = s[i] >> 8;                                              \
+        d[b1] = s[i] >> 16;                                             \
+        d[b2] = s[i] >> 24;                                             \
+    }                                                                   \
+}                                                                       \
+                                                                        \
+static void                                                             \
+i32_u24##e(void *dst, const void *src, int n)                           \
+{                                                                       \
+    u_char *d = dst;                                                    \
+    int i;                                                              \
+                                                                        \
+    i32_s24##e(dst, src, n);                                            \
+    for(i = 0; i < n; i++)                                              \
+        d[3 * i + b2] ^= 0x80;                                          \
+}
+
+s24_kernels(le, 0, 1, 2)
+s24_kernels(be, 2, 1, 0)
+
+/* float */
+static inline float
+f32s(float x)
+{
+    union { float f; uint32_t i; } u = { .f = x };
+    u.i = bswap_32(u.i);
+    return u.f;
+}
+
+static inline double
+f64s(double x)
+{
+    union { double f; uint64_t i; } u = { .f = x };
+    u.i = bswap_64(u.i);
+    return u.f;
+}
+
+#define to_f(x) ((float) (x))
+kernel(f32s_f, float, float, f32s)
+kernel(f64_f, double, float, to_f)
+kernel(f_f32s, float, float, f32s)
+kernel(f_f64, float, double, to_f)
+
+static void
+f64s_f(void *dst, const void *src, int n)
+{
+    const double *s = src;
+    float *d = dst;
+    int i;
+
+    for(i = 0; i < n; i++)
+        d[i] = f64s(s[i]);
+}
+
+static void
+f_f64s(void *dst, const void *src, int n)
+{
+    const float *s = src;
+    double *d = dst;
+    int i;
+
+    for(i = 0; i < n; i++)
+        d[i] = f64s(s[i]);
+}
+
+/* int32 <-> float, full scale is +-1.0 */
+#define I32_SCALE 2147483648.0f
+#define I32_MAX_F 2147483520.0f /* largest float below 2^31 */
+
+static inline int32_t
+f2i32(float x)
+{
+    x *= I32_SCALE;
+    x = x < -I32_SCALE? -I32_SCALE: x;
+    x = x > I32_MAX_F? I32_MAX_F: x;
+    return lrintf(x);
+}
+
+static inline int16_t
+f2s16(float x)
+{
+    x *= 32768.0f;
+    x = x < -32768.0f? -32768.0f: x;
+    x = x > 32767.0f? 32767.0f: x;
+    return lrintf(x);
+}
+
+#define i2f(x) ((float) (x) * (1.0f / I32_SCALE))
+kernel(i32_f_c, int32_t, float, i2f)
+kernel(f_i32_c, float, int32_t, f2i32)
+kernel(f32_s16_c, float, int16_t, f2s16)
+
+static void
+ilv_any(void *dst, const u_char **planes, int n, int channels, int size)
+{
+    u_char *d = dst;
+    int i, c;
+
+    for(i = 0; i < n; i++)
+        for(c = 0; c < channels; c++, d += size)
+            memcpy(d, planes[c] + i * size, size);
+}
+
+#define ilv_fn(ss, type)                                                \
+static void                                                             \
+ilv_##ss##_c(void *dst, const u_char **planes, int n, int channels)     \
+{                                                                       \
+    type *d = dst;                                                      \
+    int i, c;                                                           \
+                                                                        \
+    for(c = 0; c < channels; c++){                                      \
+        const type *s = (const type *) planes[c];                       \
+        for(i = 0; i < n; i++)                                          \
+            d[i * channels + c] = s[i];                                 \
+    }                                                                   \
+}
+
+ilv_fn(8, uint8_t)
+ilv_fn(16, uint16_t)
+ilv_fn(32, uint32_t)
+ilv_fn(64, uint64_t)
+
+static void
+ilv_24(void *dst, const u_char **planes, int n, int channels)
+{
+    ilv_any(dst, planes, n, channels, 3);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void
+bswap16_sse2(void *dst, const void *src, int n)
+{
+    const uint16_t *s = src;
+    uint16_t *d = dst;
+    int i;
+
+    for(i = 0; i + 8 <= n; i += 8){
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *) (d + i), v);
+    }
+
+    bswap16_c(d + i, s + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+i32_s16_sse2(void *dst, const void *src, int n)
+{
+    const int32_t *s = src;
+    int16_t *d = dst;
+    int i;
+
+    for(i = 0; i + 8 <= n; i += 8){
+        __m128i a = _mm_loadu_si128((const __m128i *) (s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (s + i + 4));
+        a = _mm_srai_epi32(a, 16);
+        b = _mm_srai_epi32(b, 16);
+        _mm_storeu_si128((__m128i *) (d + i), _mm_packs_epi32(a, b));
+    }
+
+    i32_s16_c(d + i, s + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+f32_s16_sse2(void *dst, const void *src, int n)
+{
+    const float *s = src;
+    int16_t *d = dst;
+    __m128 sc = _mm_set1_ps(32768.0f);
+    __m128 lo = _mm_set1_ps(-32768.0f);
+    __m128 hi = _mm_set1_ps(32767.0f);
+    int i;
+
+    for(i = 0; i + 8 <= n; i += 8){
+        __m128 a = _mm_mul_ps(_mm_loadu_ps(s + i), sc);
+        __m128 b = _mm_mul_ps(_mm_loadu_ps(s + i + 4), sc);
+        a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+        b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+        _mm_storeu_si128((__m128i *) (d + i),
+                         _mm_packs_epi32(_mm_cvtps_epi32(a),
+                                         _mm_cvtps_epi32(b)));
+    }
+
+    f32_s16_c(d + i, s + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+s16_i32_sse2(void *dst, const void *src, int n)
+{
+    const uint16_t *s = src;
+    int32_t *d = dst;
+    __m128i z = _mm_setzero_si128();
+    int i;
+
+    for(i = 0; i + 8 <= n; i += 8){
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        _mm_storeu_si128((__m128i *) (d + i), _mm_unpacklo_epi16(z, v));
+        _mm_storeu_si128((__m128i *) (d + i + 4), _mm_unpackhi_epi16(z, v));
+    }
+
+    s16_i32(d + i, s + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+i32_f_sse2(void *dst, const void *src, int n)
+{
+    const int32_t *s = src;
+    float *d = dst;
+    __m128 sc = _mm_set1_ps(1.0f / I32_SCALE);
+    int i;
+
+    for(i = 0; i + 4 <= n; i += 4){
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+        _mm_storeu_ps(d + i, _mm_mul_ps(_mm_cvtepi32_ps(v), sc));
+    }
+
+    i32_f_c(d + i, s + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+f_i32_sse2(void *dst, const void *src, int n)
+{
+    const float *s = src;
+    int32_t *d = dst;
+    __m128 sc = _mm_set1_ps(I32_SCALE);
+    __m128 lo = _mm_set1_ps(-I32_SCALE);
+    __m128 hi = _mm_set1_ps(I32_MAX_F);
+    int i;
+
+    for(i = 0; i + 4 <= n; i += 4){
+        __m128 v = _mm_mul_ps(_mm_loadu_ps(s + i), sc);
+        v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+        _mm_storeu_si128((__m128i *) (d + i), _mm_cvtps_epi32(v));
+    }
+
+    f_i32_c(d + i, s + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+ilv_16_sse2(void *dst, const u_char **planes, int n, int channels)
+{
+    const uint16_t *l = (const uint16_t *) planes[0];
+    const uint16_t *r = (const uint16_t *) planes[1];
+    uint16_t *d = dst;
+    int i;
+
+    if(channels != 2){
+        ilv_16_c(dst, planes, n, channels);
+        return;
     }
 
+    for(i = 0; i + 8 <= n; i += 8){
+        __m128i a = _mm_loadu_si128((const __m128i *) (l + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (r + i));
+        _mm_storeu_si128((__m128i *) (d + 2 * i), _mm_unpacklo_epi16(a, b));
+        _mm_storeu_si128((__m128i *) (d + 2 * i + 8),
+                         _mm_unpackhi_epi16(a, b));
+    }
+
+    for(; i < n; i++){
+        d[2 * i] = l[i];
+        d[2 * i + 1] = r[i];
+    }
+}
+
+__attribute__((target("sse2")))
+static void
+ilv_32_sse2(void *dst, const u_char **planes, int n, int channels)
+{
+    const uint32_t *l = (const uint32_t *) planes[0];
+    const uint32_t *r = (const uint32_t *) planes[1];
+    uint32_t *d = dst;
+    int i;
+
+    if(channels != 2){
+        ilv_32_c(dst, planes, n, channels);
+        return;
+    }
+
+    for(i = 0; i + 4 <= n; i += 4){
+        __m128i a = _mm_loadu_si128((const __m128i *) (l + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (r + i));
+        _mm_storeu_si128((__m128i *) (d + 2 * i), _mm_unpacklo_epi32(a, b));
+        _mm_storeu_si128((__m128i *) (d + 2 * i + 4),
+                         _mm_unpackhi_epi32(a, b));
+    }
+
+    for(; i < n; i++){
+        d[2 * i] = l[i];
+        d[2 * i + 1] = r[i];
+    }
+}
+#endif
+
+static kernel_t bswap16 = bswap16_c;
+static kernel_t i32_s16 = i32_s16_c;
+static kernel_t f32_s16 = f32_s16_c;
+static kernel_t s16_i32_v = s16_i32;
+static kernel_t i32_f = i32_f_c;
+static kernel_t f_i32 = f_i32_c;
+static ilv_t ilv_16 = ilv_16_c;
+static ilv_t ilv_32 = ilv_32_c;
+
+static void
+conv_cpu_init(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")){
+        bswap16 = bswap16_sse2;
+        i32_s16 = i32_s16_sse2;
+        f32_s16 = f32_s16_sse2;
+        s16_i32_v = s16_i32_sse2;
+        i32_f = i32_f_sse2;
+        f_i32 = f_i32_sse2;
+        ilv_16 = ilv_16_sse2;
+        ilv_32 = ilv_32_sse2;
+    }
+#endif
+}
+
+/* Kernel to the work format: int32 for integers, float for floats. */
+static kernel_t
+load_kernel(sndfmt_t *f)
+{
+    switch(f->size){
+    case 1:
+        return f->type == SF_INT? s8_i32: u8_i32;
+    case 2:
+        if(f->type == SF_INT)
+            return f->swap? s16s_i32: s16_i32_v;
+        return f->swap? u16s_i32: u16_i32;
+    case 3:
+        if(f->type == SF_INT)
+            return strcmp(TCVP_ENDIAN, "le") ^ f->swap? s24be_i32: s24le_i32;
+        return strcmp(TCVP_ENDIAN, "le") ^ f->swap? u24be_i32: u24le_i32;
+    case 4:
+        if(f->type == SF_FLOAT)
+            return f->swap? f32s_f: copy_32;
+        if(f->type == SF_INT)
+            return f->swap? s32s_i32: copy_32;
+        return f->swap? u32s_i32: u32_i32;
+    case 8:
+        return f->swap? f64s_f: f64_f;
+    }
+    return NULL;
+}
+
+static kernel_t
+store_kernel(sndfmt_t *f)
+{
+    switch(f->size){
+    case 1:
+        return f->type == SF_INT? i32_s8: i32_u8;
+    case 2:
+        if(f->type == SF_INT)
+            return f->swap? i32_s16s: i32_s16;
+        return f->swap? i32_u16s: i32_u16;
+    case 3:
+        if(f->type == SF_INT)
+            return strcmp(TCVP_ENDIAN, "le") ^ f->swap? i32_s24be: i32_s24le;
+        return strcmp(TCVP_ENDIAN, "le") ^ f->swap? i32_u24be: i32_u24le;
+    case 4:
+        if(f->type == SF_FLOAT)
+            return f->swap? f_f32s: copy_32;
+        if(f->type == SF_INT)
+            return f->swap? i32_s32s: copy_32;
+        return f->swap? i32_u32s: i32_u32;
+    case 8:
+        return f->swap? f_f64s: f_f64;
+    }
     return NULL;
 }
 
+/* Single pass kernel for same channel count, or NULL. */
+static kernel_t
+direct_kernel(sndfmt_t *in, sndfmt_t *out)
+{
+    static kernel_t copies[] = { NULL, copy_8, copy_16, copy_24, copy_32,
+                                 NULL, NULL, NULL, copy_64 };
+    static kernel_t swaps[] = { NULL, NULL, NULL, bswap24, bswap32,
+                                NULL, NULL, NULL, bswap64 };
+
+    if(in->type == out->type && in->size == out->size){
+        if(in->swap == out->swap)
+            return copies[in->size];
+        return in->size == 2? bswap16: swaps[in->size];
+    }
+
+    if(in->size == 1 && out->size == 1)
+        return s8_u8;
+
+    if(out->type == SF_INT && out->size == 2 && !out->swap && !in->swap){
+        if(in->type == SF_INT && in->size == 4)
+            return i32_s16;
+        if(in->type == SF_FLOAT && in->size == 4)
+            return f32_s16;
+    }
+
+    return NULL;
+}
+
+static ilv_t
+ilv_kernel(int size)
+{
+    switch(size){
+    case 1:
+        return ilv_8_c;
+    case 2:
+        return ilv_16;
+    case 3:
+        return ilv_24;
+    case 4:
+        return ilv_32;
+    case 8:
+        return ilv_64_c;
+    }
+    return NULL;
+}
+
+/* Channel layouts by count, WAVE order. */
+enum { FL, FR, FC, LFE, BL, BR, BC, SL, SR };
+
+static const int layouts[MAXCH + 1][MAXCH] = {
+    [1] = { FC },
+    [2] = { FL, FR },
+    [3] = { FL, FR, FC },
+    [4] = { FL, FR, BL, BR },
+    [5] = { FL, FR, FC, BL, BR },
+    [6] = { FL, FR, FC, LFE, BL, BR },
+    [7] = { FL, FR, FC, LFE, BC, SL, SR },
+    [8] = { FL, FR, FC, LFE, BL, BR, SL, SR },
+};
+
+#define M3DB 0.7071068f
+#define NOCH -1
+
+/* Where a channel goes when the output layout lacks it, in order of
+   preference, ending at a zero gain.  A route is used if all its
+   channels are present.  LFE has none and is dropped. */
+typedef struct mix_route {
+    int ch[2];
+    float gain[2];
+} mix_route_t;
+
+static const mix_route_t routes[][5] = {
+    [FL]  = { { { FC, NOCH }, { 1 } } },
+    [FR]  = { { { FC, NOCH }, { 1 } } },
+    [FC]  = { { { FL, FR }, { M3DB, M3DB } } },
+    [BL]  = { { { SL, NOCH }, { 1 } },
+              { { BC, NOCH }, { M3DB } },
+              { { FL, NOCH }, { M3DB } },
+              { { FC, NOCH }, { M3DB } } },
+    [BR]  = { { { SR, NOCH }, { 1 } },
+              { { BC, NOCH }, { M3DB } },
+              { { FR, NOCH }, { M3DB } },
+              { { FC, NOCH }, { M3DB } } },
+    [BC]  = { { { BL, BR }, { M3DB, M3DB } },
+              { { SL, SR }, { M3DB, M3DB } },
+              { { FL, FR }, { 0.5f, 0.5f } },
+              { { FC, NOCH }, { M3DB } } },
+    [SL]  = { { { BL, NOCH }, { 1 } },
+              { { FL, NOCH }, { M3DB } },
+              { { FC, NOCH }, { M3DB } } },
+    [SR]  = { { { BR, NOCH }, { 1 } },
+              { { FR, NOCH }, { M3DB } },
+              { { FC, NOCH }, { M3DB } } },
+};
+
+/* Role of channel c in a stream of n channels, or NOCH.  Streams
+   with more than MAXCH channels are taken to start with the MAXCH
+   channel layout. */
+static int
+ch_role(int n, int c)
+{
+    return c < n && c < MAXCH? layouts[min(n, MAXCH)][c]: NOCH;
+}
+
+/* Output channel with role r, or -1. */
+static int
+ch_find(int n, int r)
+{
+    int c;
+
+    for(c = 0; c < n && c < MAXCH; c++)
+        if(ch_role(n, c) == r)
+            return c;
+
+    return -1;
+}
+
+/* och x ich matrix built from the channel roles of both layouts.
+   Each input goes to the output with the same role, or else along
+   the first route in routes[] that the output layout can take.
+   Mono input is sent at full level to both front channels when there
+   is no centre.  Rows are
+   normalised so the mix can't clip. */
+static float *
+mix_matrix(int ich, int och)
+{
+    float *m = calloc(ich * och, sizeof(*m));
+    int o, c, i;
+
+    for(c = 0; c < ich; c++){
+        int r = ch_role(ich, c);
+        const mix_route_t *rt;
+
+        if(r == NOCH)
+            continue;
+
+        if((o = ch_find(och, r)) >= 0){
+            m[o * ich + c] = 1;
+            continue;
+        }
+
+        for(rt = routes[r]; rt->gain[0] > 0; rt++){
+            int o0 = ch_find(och, rt->ch[0]);
+            int o1 = rt->ch[1] == NOCH? -1: ch_find(och, rt->ch[1]);
+
+            if(o0 < 0 || (rt->ch[1] != NOCH && o1 < 0))
+                continue;
+
+            for(i = 0; i < 2; i++){
+                int oi = i? o1: o0;
+                if(oi >= 0)
+                    m[oi * ich + c] = ich == 1? 1: rt->gain[i];
+            }
+            break;
+        }
+    }
+
+    for(o = 0; o < och; o++){
+        float s = 0;
+        for(c = 0; c < ich; c++)
+            s += m[o * ich + c];
+        if(s > 1)
+            for(c = 0; c < ich; c++)
+                m[o * ich + c] /= s;
+    }
+
+    return m;
+}
+
+static void
+mix(conv_priv_t *cp, float *d, const float *s, int n)
+{
+    int i, o, c;
+
+    for(i = 0; i < n; i++){
+        for(o = 0; o < cp->och; o++){
+            const float *m = cp->mix + o * cp->ich;
+            float v = 0;
+            for(c = 0; c < cp->ich; c++)
+                v += m[c] * s[c];
+            d[o] = v;
+        }
+        s += cp->ich;
+        d += cp->och;
+    }
+}
+
+static void
+sc_convert(sndconv_t *sc, void *dst, u_char **src, int offset, int samples)
+{
+    conv_priv_t *cp = sc->private;
+    const u_char *planes[MAXCH];
+    u_char *d = dst;
+    int c;
+
+    if(cp->direct && !cp->in.planar){
+        cp->direct(d, src[0] + offset * sc->ibpf, samples * cp->ich);
+        return;
+    }
+
+    while(samples > 0){
+        int n = min(samples, BLOCK);
+        void *buf = cp->work;
+
+        if(cp->direct){
+            for(c = 0; c < cp->ich; c++){
+                const u_char *s = src[c] + offset * cp->in.size;
+                if(cp->copy){
+                    planes[c] = s;
+                } else {
+                    u_char *t = (u_char *) cp->tmp + c * BLOCK * 8;
+                    cp->direct(t, s, n);
+                    planes[c] = t;
+                }
+            }
+            cp->ilv(d, planes, n, cp->ich);
+        } else {
+            if(cp->in.planar){
+                for(c = 0; c < cp->ich; c++){
+                    u_char *t = (u_char *) cp->tmp + c * BLOCK * 8;
+                    cp->load(t, src[c] + offset * cp->in.size, n);
+                    planes[c] = t;
+                }
+                ilv_32(cp->work, planes, n, cp->ich);
+            } else {
+                cp->load(cp->work, src[0] + offset * sc->ibpf, n * cp->ich);
+            }
+
+            if(cp->tofloat)
+                cp->tofloat(cp->work, cp->work, n * cp->ich);
+            if(cp->mix){
+                mix(cp, cp->work2, cp->work, n);
+                buf = cp->work2;
+            }
+            if(cp->fromfloat)
+                cp->fromfloat(buf, buf, n * cp->och);
+            cp->store(d, buf, n * cp->och);
+        }
+
+        samples -= n;
+        offset += n;
+        d += n * sc->obpf;
+    }
+}
+
+static void
+sc_free(void *p)
+{
+    sndconv_t *sc = p;
+    conv_priv_t *cp = sc->private;
+
+    free(cp->mix);
+    free(cp->work);
+    free(cp->work2);
+    free(cp->tmp);
+    free(cp);
+}
+
+extern sndconv_t *
+audio_conv(char *in, int ichannels, char *out, int ochannels)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    sndconv_t *sc;
+    conv_priv_t *cp;
+    sndfmt_t fi, fo;
+
+    if(parse_format(in, &fi) || parse_format(out, &fo) || fo.planar)
+        return NULL;
+    if(ichannels < 1 || ochannels < 1 ||
+       (fi.planar && ichannels > MAXCH))
+        return NULL;
+
+    pthread_once(&once, conv_cpu_init);
+
+    cp = calloc(1, sizeof(*cp));
+    cp->in = fi;
+    cp->out = fo;
+    cp->ich = ichannels;
+    cp->och = ochannels;
+
+    if(ichannels == ochannels){
+        cp->direct = direct_kernel(&fi, &fo);
+        cp->copy = fi.type == fo.type && fi.size == fo.size &&
+            fi.swap == fo.swap;
+    }
+
+    if(cp->direct){
+        cp->ilv = ilv_kernel(fo.size);
+    } else {
+        int fwork = fi.type == SF_FLOAT || fo.type == SF_FLOAT ||
+            ichannels != ochannels;
+
+        cp->load = load_kernel(&fi);
+        cp->store = store_kernel(&fo);
+        if(fwork && fi.type != SF_FLOAT)
+            cp->tofloat = i32_f;
+        if(fwork && fo.type != SF_FLOAT)
+            cp->fromfloat = f_i32;
+        if(ichannels != ochannels)
+            cp->mix = mix_matrix(ichannels, ochannels);
+
+        cp->work = malloc(BLOCK * max(ichannels, ochannels) * sizeof(float));
+        if(cp->mix)
+            cp->work2 = malloc(BLOCK * ochannels * sizeof(float));
+    }
+
+    if(fi.planar)
+        cp->tmp = malloc(BLOCK * 8 * ichannels);
+
+    sc = tcallocdz(sizeof(*sc), NULL, sc_free);
+    sc->conv = sc_convert;
+    sc->ibpf = fi.planar? fi.size: fi.size * ichannels;
+    sc->obpf = fo.size * ochannels;
+    sc->private = cp;
+
+    return sc;
+}
+
+/* Output formats worth trying for an input format, best first. */
 extern char **
 audio_all_conv(char *in)
 {
-    char **cv = calloc(sizeof(*cv),
-                       sizeof(conv_table) / sizeof(conv_table[0]));
-    int i, j;
+    static char *outputs[] = {
+        "s32" TCVP_ENDIAN, "f32" TCVP_ENDIAN, "s16" TCVP_ENDIAN,
+        "s16le", "s16be", "u16le", "u16be", "s8", "u8", NULL
+    };
+    int no = sizeof(outputs) / sizeof(outputs[0]);
+    char **cv;
+    char *ci;
+    sndfmt_t sf;
+    int i, j, k;
+
+    if(parse_format(in, &sf))
+        return calloc(1, sizeof(*cv));
+
+    cv = calloc(1, (no + 1) * sizeof(*cv) + strlen(in) + 1);
+    ci = (char *) (cv + no + 1);
+    strcpy(ci, in);
+    if(sf.planar)
+        ci[strlen(ci) - 1] = 0;
+    cv[0] = ci;
 
-    cv[0] = in;
-    for(i = 0, j = 1; conv_table[i].in; i++){
-        if(!strcmp(in, conv_table[i].in) &&
-           strcmp(conv_table[i].in, conv_table[i].out))
-            cv[j++] = conv_table[i].out;
+    /* Only go wider than 16 bits if the input has the precision. */
+    i = sf.size > 2 || sf.type == SF_FLOAT? 0: 2;
+    for(j = 1; outputs[i]; i++){
+        for(k = 0; k < j && strcmp(cv[k], outputs[i]); k++);
+        if(k == j)
+            cv[j++] = outputs[i];
     }
 
     return cv;
@@ -0,0 +1,86 @@
+/**
+    Copyright (C) 2007  Michael Ahlberg, Måns Rullgård
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+**/
+
+#include <math.h>
+#include <string.h>
+#include <audio_tc2.h>
+#include <audiomod.h>
+
+/* Offset samples are smoothed over several packets, drift over
+   intervals of at least DRIFT_INTERVAL to average out the jitter in
+   the driver's delay reports. */
+#define OFFSET_WEIGHT  (1.0 / 8)
+#define DRIFT_WEIGHT   (1.0 / 4)
+#define DRIFT_INTERVAL (2 * 27000000)
+
+extern void
+avsync_reset(avsync_t *as)
+{
+    memset(as, 0, sizeof(*as));
+}
+
+/* Feed one measurement of audio clock minus timer, dt, taken at
+   timer time tm.  Returns the timer modulation that brings the
+   offset to zero within sync_slew_time while tracking the estimated
+   clock drift. */
+extern double
+avsync_update(avsync_t *as, uint64_t tm, int64_t dt)
+{
+    double max = tcvp_output_audio_conf_sync_max_slew;
+    double horizon = tcvp_output_audio_conf_sync_slew_time * 27000.0;
+    double mod;
+
+    if(!as->samples++){
+        as->offset = dt;
+        as->dtime = tm;
+        as->doffset = dt;
+        as->modsum = 0;
+    } else {
+        as->offset += (dt - as->offset) * OFFSET_WEIGHT;
+        as->modsum += as->mod * (double) (tm - as->ltime);
+    }
+    as->ltime = tm;
+
+    if(tm - as->dtime >= DRIFT_INTERVAL){
+        double span = tm - as->dtime;
+        /* drift of the audio clock against the timer at its configured rate */
+        double drift = (as->offset - as->doffset + as->modsum) / span;
+        if(as->drifts++)
+            as->drift += (drift - as->drift) * DRIFT_WEIGHT;
+        else
+            as->drift = drift;
+        as->dtime = tm;
+        as->doffset = as->offset;
+        as->modsum = 0;
+    }
+
+    mod = as->drift + as->offset / horizon;
+    if(mod > max)
+        mod = max;
+    else if(mod < -max)
+        mod = -max;
+
+    as->mod = mod;
+    return mod;
+}
@@ -214,6 +214,9 @@ alsa_new(audio_stream_t *as, tcconf_section_t *cs, tcvp_timer_t *timer)
     } else if(strstr(as->codec, "pcm-s8")){
         afmt = SND_PCM_FORMAT_S8;
         format = "s8";
+    } else if(strstr(as->codec, "pcm-s32le")){
+        afmt = SND_PCM_FORMAT_S32_LE;
+        format = "s32le";
     } else if(strstr(as->codec, "pcm-f32le")){
         afmt = SND_PCM_FORMAT_FLOAT_LE;
         format = "f32le";
@@ -253,6 +256,13 @@ alsa_new(audio_stream_t *as, tcconf_section_t *cs, tcvp_timer_t *timer)
         goto err;
     }
 
+    if(channels != as->channels){
+        tc2_print("ALSA", TC2_PRINT_WARNING,
+                  "%i channels not supported, using %i\n",
+                  as->channels, channels);
+        as->channels = channels;
+    }
+
     ao = calloc(1, sizeof(*ao));
     ao->pcm = pcm;
     ao->timer = timer;
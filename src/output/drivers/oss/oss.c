@@ -223,6 +223,7 @@ oss_new(audio_stream_t *as, tcconf_section_t *cs, tcvp_timer_t *timer)
     if(channels != as->channels){
         tc2_print("OSS", TC2_PRINT_WARNING,
                   "%i channels not supported.\n", as->channels);
+        as->channels = channels;
     }
 
     if(rate != as->sample_rate){
@@ -39,6 +39,10 @@
 
 #define FRAMES 64
 
+#ifndef min
+#define min(a,b) ((a)<(b)? (a): (b))
+#endif
+
 typedef struct xv_window {
     Display *dpy;
     Window win;
@@ -231,6 +235,7 @@ xv_open(video_stream_t *vs, tcconf_section_t *cs)
     char *fmt;
     uint32_t fmtid = 0;
     int port = 0;
+    int bw, bh;
 
     fmt = strstr(vs->codec, "raw-");
     if(!fmt)
@@ -378,12 +383,19 @@ xv_open(video_stream_t *vs, tcconf_section_t *cs)
     xvw->gc = DefaultGC(xvw->dpy, DefaultScreen(xvw->dpy));
     xvw->wm = wm;
 
+    /* Leave room for decoder alignment so frames can be decoded
+       in place. */
+    bw = (vs->width + 31) & ~31;
+    bh = ((vs->height + 31) & ~31) + 2;
+
     for(i = 0; i < frames; i++){
         XvImage *xvi;
         XShmSegmentInfo *shm = &xvw->shm[i];
 
         xvi = XvShmCreateImage(xvw->dpy, xvw->port, fmtid, NULL,
-                               vs->width, vs->height, shm);
+                               bw, bh, shm);
+        bw = min(bw, xvi->width);
+        bh = min(bh, xvi->height);
         shm->shmid = shmget(IPC_PRIVATE, xvi->data_size, IPC_CREAT | 0777);
         shm->shmaddr = shmat(shm->shmid, 0, 0);
         shm->readOnly = False;
@@ -399,6 +411,9 @@ xv_open(video_stream_t *vs, tcconf_section_t *cs)
     vd = calloc(1, sizeof(*vd));
     vd->frames = frames;
     vd->pixel_format = fmt;
+    vd->direct = 1;
+    vd->width = bw;
+    vd->height = bh;
     vd->get_frame = xv_get;
     vd->show_frame = xv_show;
     vd->close = xv_close;
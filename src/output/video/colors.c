@@ -27,16 +27,203 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <tcvp_types.h>
 #include <video_tc2.h>
 #include "vid_priv.h"
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
 #ifndef min
 #define min(a,b) ((a)<(b)? (a): (b))
 #endif
 
 #define abs(a) ((a)<0?-(a):(a))
 
+/* Row kernels.  The C versions are the reference; the vector versions
+   must produce identical output and hand any tail to them. */
+
+static void
+yuy2_row_c(uint8_t *dst, const uint8_t *yc, const uint8_t *uc,
+           const uint8_t *vc, int n)
+{
+    int i;
+#if __WORDSIZE >= 64
+    uint64_t *ldst = (uint64_t *) dst;
+    for(i = 0; i < n; i += 4){
+        *ldst++ = (uint64_t)yc[0] + ((uint64_t)uc[0] << 8) +
+            ((uint64_t)yc[1] << 16) + ((uint64_t)vc[0] << 24) +
+            ((uint64_t)yc[2] << 32) + ((uint64_t)uc[1] << 40) +
+            ((uint64_t)yc[3] << 48) + ((uint64_t)vc[1] << 56);
+        yc += 4;
+        uc += 2;
+        vc += 2;
+    }
+#else
+    int32_t *idst = (int32_t *) dst;
+    for(i = 0; i < n; i += 2){
+        *idst++ = yc[0] + (uc[0] << 8) +
+            (yc[1] << 16) + (vc[0] << 24);
+        yc += 2;
+        uc++;
+        vc++;
+    }
+#endif
+}
+
+static void
+exp2_row_c(uint8_t *dst, const uint8_t *src, int n)
+{
+    int k;
+
+    for(k = 0; k < n; k++)
+        dst[2*k] = dst[2*k+1] = src[k];
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void
+yuy2_row_sse2(uint8_t *dst, const uint8_t *yc, const uint8_t *uc,
+              const uint8_t *vc, int n)
+{
+    int i;
+
+    for(i = 0; i + 16 <= n; i += 16){
+        __m128i y = _mm_loadu_si128((const __m128i *) (yc + i));
+        __m128i u = _mm_loadl_epi64((const __m128i *) (uc + i / 2));
+        __m128i v = _mm_loadl_epi64((const __m128i *) (vc + i / 2));
+        __m128i uv = _mm_unpacklo_epi8(u, v);
+        _mm_storeu_si128((__m128i *) (dst + 2 * i),
+                         _mm_unpacklo_epi8(y, uv));
+        _mm_storeu_si128((__m128i *) (dst + 2 * i + 16),
+                         _mm_unpackhi_epi8(y, uv));
+    }
+
+    yuy2_row_c(dst + 2 * i, yc + i, uc + i / 2, vc + i / 2, n - i);
+}
+
+__attribute__((target("avx2")))
+static void
+yuy2_row_avx2(uint8_t *dst, const uint8_t *yc, const uint8_t *uc,
+              const uint8_t *vc, int n)
+{
+    int i;
+
+    for(i = 0; i + 32 <= n; i += 32){
+        __m256i y = _mm256_loadu_si256((const __m256i *) (yc + i));
+        __m128i u = _mm_loadu_si128((const __m128i *) (uc + i / 2));
+        __m128i v = _mm_loadu_si128((const __m128i *) (vc + i / 2));
+        __m256i uv = _mm256_set_m128i(_mm_unpackhi_epi8(u, v),
+                                      _mm_unpacklo_epi8(u, v));
+        __m256i lo = _mm256_unpacklo_epi8(y, uv);
+        __m256i hi = _mm256_unpackhi_epi8(y, uv);
+        _mm256_storeu_si256((__m256i *) (dst + 2 * i),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *) (dst + 2 * i + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    yuy2_row_sse2(dst + 2 * i, yc + i, uc + i / 2, vc + i / 2, n - i);
+}
+
+__attribute__((target("sse2")))
+static void
+exp2_row_sse2(uint8_t *dst, const uint8_t *src, int n)
+{
+    int k;
+
+    for(k = 0; k + 16 <= n; k += 16){
+        __m128i s = _mm_loadu_si128((const __m128i *) (src + k));
+        _mm_storeu_si128((__m128i *) (dst + 2 * k), _mm_unpacklo_epi8(s, s));
+        _mm_storeu_si128((__m128i *) (dst + 2 * k + 16),
+                         _mm_unpackhi_epi8(s, s));
+    }
+
+    exp2_row_c(dst + 2 * k, src + k, n - k);
+}
+
+__attribute__((target("avx2")))
+static void
+exp2_row_avx2(uint8_t *dst, const uint8_t *src, int n)
+{
+    int k;
+
+    for(k = 0; k + 32 <= n; k += 32){
+        __m256i s = _mm256_loadu_si256((const __m256i *) (src + k));
+        __m256i lo = _mm256_unpacklo_epi8(s, s);
+        __m256i hi = _mm256_unpackhi_epi8(s, s);
+        _mm256_storeu_si256((__m256i *) (dst + 2 * k),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *) (dst + 2 * k + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    exp2_row_sse2(dst + 2 * k, src + k, n - k);
+}
+#endif
+
+#ifdef HAVE_NEON
+static void
+yuy2_row_neon(uint8_t *dst, const uint8_t *yc, const uint8_t *uc,
+              const uint8_t *vc, int n)
+{
+    int i;
+
+    for(i = 0; i + 16 <= n; i += 16){
+        uint8x16_t y = vld1q_u8(yc + i);
+        uint8x8x2_t uv = vzip_u8(vld1_u8(uc + i / 2), vld1_u8(vc + i / 2));
+        uint8x16x2_t p = vzipq_u8(y, vcombine_u8(uv.val[0], uv.val[1]));
+        vst1q_u8(dst + 2 * i, p.val[0]);
+        vst1q_u8(dst + 2 * i + 16, p.val[1]);
+    }
+
+    yuy2_row_c(dst + 2 * i, yc + i, uc + i / 2, vc + i / 2, n - i);
+}
+
+static void
+exp2_row_neon(uint8_t *dst, const uint8_t *src, int n)
+{
+    int k;
+
+    for(k = 0; k + 16 <= n; k += 16){
+        uint8x16_t s = vld1q_u8(src + k);
+        uint8x16x2_t p = vzipq_u8(s, s);
+        vst1q_u8(dst + 2 * k, p.val[0]);
+        vst1q_u8(dst + 2 * k + 16, p.val[1]);
+    }
+
+    exp2_row_c(dst + 2 * k, src + k, n - k);
+}
+#endif
+
+static void (*yuy2_row)(uint8_t *, const uint8_t *, const uint8_t *,
+                        const uint8_t *, int) = yuy2_row_c;
+static void (*exp2_row)(uint8_t *, const uint8_t *, int) = exp2_row_c;
+
+static void
+cconv_init(void)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        yuy2_row = yuy2_row_avx2;
+        exp2_row = exp2_row_avx2;
+    } else if(__builtin_cpu_supports("sse2")){
+        yuy2_row = yuy2_row_sse2;
+        exp2_row = exp2_row_sse2;
+    }
+#elif defined(HAVE_NEON)
+    yuy2_row = yuy2_row_neon;
+    exp2_row = exp2_row_neon;
+#endif
+}
+
 static void
 i420_yuy2(int width, int height, const u_char **in, int *istride,
           u_char **out, int *ostride)
@@ -45,33 +232,15 @@ i420_yuy2(int width, int height, const u_char **in, int *istride,
     const u_char *ysrc = in[0];
     const u_char *usrc = in[1];
     const u_char *vsrc = in[2];
-    const u_char *dst = out[0];
-
-    for(y = 0; y < height; y++){
+    u_char *dst = out[0];
 #if __WORDSIZE >= 64
-        int i;
-        uint64_t *ldst = (uint64_t *) dst;
-        const uint8_t *yc = ysrc, *uc = usrc, *vc = vsrc;
-        for(i = 0; i < min(istride[0], ostride[0]); i += 4){
-            *ldst++ = (uint64_t)yc[0] + ((uint64_t)uc[0] << 8) +
-                ((uint64_t)yc[1] << 16) + ((uint64_t)vc[0] << 24) +
-                ((uint64_t)yc[2] << 32) + ((uint64_t)uc[1] << 40) +
-                ((uint64_t)yc[3] << 48) + ((uint64_t)vc[1] << 56);
-            yc += 4;
-            uc += 2;
-            vc += 2;
-        }
+    int n = (min(istride[0], ostride[0]) + 3) & ~3;
 #else
-        int i, *idst = (int32_t *) dst;
-        const uint8_t *yc = ysrc, *uc = usrc, *vc = vsrc;
-        for(i = 0; i < istride[1]; i++){
-            *idst++ = yc[0] + (uc[0] << 8) +
-                (yc[1] << 16) + (vc[0] << 24);
-            yc += 2;
-            uc++;
-            vc++;
-        }
+    int n = 2 * istride[1];
 #endif
+
+    for(y = 0; y < height; y++){
+        yuy2_row(dst, ysrc, usrc, vsrc, n);
         ysrc += istride[0];
         if(y & 1){
             usrc += istride[1];
@@ -90,31 +259,32 @@ i420_yuy2(int width, int height, const u_char **in, int *istride,
     }                                                           \
 } while(0)
 
-#define exp_plane(i, ip, d, x, y) do {                                      \
-    int j, k;                                                               \
-    int w = min(istride[i], min(ostride[i], width / d));                    \
-    for(j = 0; j < height / d; j++){                                        \
-        for(k = 0; k < w; k++){                                             \
-            int p = *(in[ip] + j * istride[i] + k);                         \
-            int xx, yy;                                                     \
-            for(xx = 0; xx < x; xx++)                                       \
-                for(yy = 0; yy < y; yy++)                                   \
-                    *(out[i] + (y * j + yy) * ostride[i] + x * k + xx) = p; \
-        }                                                                   \
-    }                                                                       \
+/* Double each pixel horizontally and each row vertically. */
+#define exp_plane_2x2(i, ip, d) do {                                    \
+    int j;                                                              \
+    int w = min(istride[i], min(ostride[i], width / d));                \
+    for(j = 0; j < height / d; j++){                                    \
+        u_char *o = out[i] + 2 * j * ostride[i];                        \
+        exp2_row(o, in[ip] + j * istride[i], w);                        \
+        memcpy(o + ostride[i], o, 2 * w);                               \
+    }                                                                   \
 } while(0)
 
 #define red_plane(i, ip, dx, dy, x, y) do {                     \
     int j, k;                                                   \
     int w = min(istride[i], min(ostride[i], width / dx));       \
     for(j = 0; j < height / dy / y; j++){                       \
+        if(x == 1){                                             \
+            memcpy(out[i] + j * ostride[i],                     \
+                   in[ip] + j * y * istride[i], w);             \
+            continue;                                           \
+        }                                                       \
         for(k = 0; k < w / x; k++){                             \
             *(out[i] + j * ostride[i] + k) =                    \
                 *(in[ip] + j * y * istride[i] + k * x);         \
         }                                                       \
     }                                                           \
 } while(0)
-                
 
 #define copy_planar(fin, fout, p0, p1, p2, d0, d1, d2)                  \
 static void                                                             \
@@ -148,8 +318,8 @@ yvu9_yv12(int width, int height, const u_char **in, int *istride,
           u_char **out, int *ostride)
 {
     copy_plane(0, 0, 1, 1);
-    exp_plane(1, 2, 4, 2, 2);
-    exp_plane(2, 1, 4, 2, 2);
+    exp_plane_2x2(1, 2, 4);
+    exp_plane_2x2(2, 1, 4);
 }
 
 static void
@@ -183,8 +353,11 @@ static struct {
 extern color_conv_t
 get_cconv(char *in, char *out)
 {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
     int i;
 
+    pthread_once(&once, cconv_init);
+
     for(i = 0; conv_table[i].in; i++)
         if(!strcmp(in, conv_table[i].in) && !strcmp(out, conv_table[i].out))
             break;
@@ -42,40 +42,37 @@ typedef struct video_out {
     tcvp_timer_t *timer;
     color_conv_t cconv;
     uint64_t *pts;
+    int *fq;                    /* driver frame of each queued pts */
+    int *refs;                  /* per driver frame */
+    int shown;
+    int next;
+    int direct;
     int state;
     pthread_mutex_t smx;
     pthread_cond_t scd;
     pthread_t thr;
     int head, tail;
     int frames;
-    int *drop;
     int dropcnt;
+    int64_t cost;               /* convert and queue time per frame */
+    int64_t late;
     int framecnt;
     tcconf_section_t *conf;
     int end;
     int discard;
 } video_out_t;
 
-#define DROPLEN 8
-
-static int drops[][DROPLEN] = {
-    {[0 ... 7] = 0},
-    {[0] = 1},
-    {[0] = 1, [4] = 1},
-    {[0] = 1, [3] = 1, [6] = 1},
-    {[0] = 1, [2] = 1, [4] = 1, [6] = 1},
-    {[0 ... 2] = 1, [4 ... 6] = 1},
-    {[0 ... 6] = 1}
-};
-
-static float drop_thresholds[] = {7.0 / 21,
-                                  6.0 / 21,
-                                  5.0 / 21,
-                                  4.0 / 21,
-                                  3.0 / 21,
-                                  2.0 / 21,
-                                  1.0 / 21,
-                                  0};
+/* Longest run of frames dropped in a row */
+#define MAX_DROPS 7
+
+/* Frames kept out of reach of the decoder so that copied frames and
+   the displayed frame can't be starved by held reference frames. */
+#define DR_RESERVE 2
+
+typedef struct video_buffer {
+    video_out_t *vo;
+    int frame;
+} video_buffer_t;
 
 static void *
 v_play(void *p)
@@ -110,9 +107,12 @@ v_play(void *p)
         if(vo->timer->wait(vo->timer, vo->pts[vo->tail], &vo->smx) < 0)
             continue;
 
-        vo->driver->show_frame(vo->driver, vo->tail);
+        vo->driver->show_frame(vo->driver, vo->fq[vo->tail]);
 
         if(vo->frames > 0){
+            if(vo->shown >= 0)
+                vo->refs[vo->shown]--;
+            vo->shown = vo->fq[vo->tail];
             if(++vo->tail == vo->driver->frames)
                 vo->tail = 0;
             vo->frames--;
@@ -135,31 +135,156 @@ bufr(video_out_t *vo)
     return (float) vo->frames / vo->driver->frames;
 }
 
+/* Find an unused driver frame, leaving at least 'reserve' free.
+   Called with smx held. */
+static int
+v_alloc(video_out_t *vo, int reserve)
+{
+    int nf = vo->driver->frames;
+    int frame = -1, nfree = 0;
+    int i;
+
+    for(i = 0; i < nf; i++){
+        int f = (vo->next + i) % nf;
+        if(!vo->refs[f]){
+            if(frame < 0)
+                frame = f;
+            nfree++;
+        }
+    }
+
+    if(nfree <= reserve)
+        frame = -1;
+
+    /* Copying may overwrite the displayed frame, as with the plain
+       frame ring. */
+    if(frame < 0 && !reserve && vo->shown >= 0 && vo->refs[vo->shown] == 1)
+        frame = vo->shown;
+
+    if(frame >= 0){
+        vo->refs[frame]++;
+        vo->next = (frame + 1) % nf;
+    }
+
+    return frame;
+}
+
 static void
-v_qpts(video_out_t *vo, uint64_t pts)
+v_qpts(video_out_t *vo, uint64_t pts, int frame)
 {
     pthread_mutex_lock(&vo->smx);
     if(vo->framecnt){
         vo->pts[vo->head] = pts;
+        vo->fq[vo->head] = frame;
         vo->frames++;
         if(++vo->head == vo->driver->frames)
             vo->head = 0;
         pthread_cond_broadcast(&vo->scd);
+    } else if(frame >= 0){
+        vo->refs[frame]--;
     }
     pthread_mutex_unlock(&vo->smx);
 }
 
+static void
+v_unref(video_out_t *vo, int frame)
+{
+    if(frame < 0)
+        return;
+
+    pthread_mutex_lock(&vo->smx);
+    vo->refs[frame]--;
+    pthread_cond_broadcast(&vo->scd);
+    pthread_mutex_unlock(&vo->smx);
+}
+
+static void
+v_buffer_free(void *p)
+{
+    video_buffer_t *vb = p;
+
+    v_unref(vb->vo, vb->frame);
+    tcfree(vb->vo);
+}
+
+/* Hand a driver frame to the decoder.  It is queued without copying
+   when the decoded packet comes back with TCVP_PKT_FLAG_DIRECT. */
+static void *
+v_get_buffer(tcvp_pipe_t *p, int width, int height, u_char **data,
+             int *strides)
+{
+    video_out_t *vo = p->private;
+    video_buffer_t *vb;
+    int frame = -1;
+
+    if(!vo->direct || width > vo->driver->width ||
+       height > vo->driver->height)
+        return NULL;
+
+    pthread_mutex_lock(&vo->smx);
+    if(vo->state != STOP)
+        frame = v_alloc(vo, DR_RESERVE);
+    pthread_mutex_unlock(&vo->smx);
+
+    if(frame < 0)
+        return NULL;
+
+    vo->driver->get_frame(vo->driver, frame, data, strides);
+
+    vb = tcallocdz(sizeof(*vb), NULL, v_buffer_free);
+    vb->vo = tcref(vo);
+    vb->frame = frame;
+
+    return vb;
+}
+
+static int64_t
+v_clock(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((int64_t) tv.tv_sec * 1000000 + tv.tv_usec) * 27;
+}
+
+/* Update the lateness reported upstream.  A frame that can't be
+   ready by its display time, judging by the recent cost of
+   converting and queueing a frame, is dropped rather than spending
+   that time on it and falling further behind. */
+static int
+v_late(video_out_t *vo, tcvp_data_packet_t *pk)
+{
+    if(!(pk->flags & TCVP_PKT_FLAG_PTS) || vo->state != PLAY)
+        return 0;
+
+    vo->late = vo->cost - (int64_t) (pk->pts - vo->timer->read(vo->timer));
+
+    if(vo->late <= 0 || !output_video_conf_framedrop ||
+       vo->framecnt <= vo->driver->frames || vo->dropcnt >= MAX_DROPS)
+        return 0;
+
+    tc2_print("VIDEO", TC2_PRINT_VERBOSE, "dropping frame, %lli us late\n",
+              vo->late / 27);
+    return 1;
+}
+
+static int64_t
+v_lateness(tcvp_pipe_t *p)
+{
+    video_out_t *vo = p->private;
+    return vo->state == PLAY? vo->late: 0;
+}
+
 extern int
 v_put(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
 {
     video_out_t *vo = p->private;
     u_char *data[4];
     int strides[4];
-    int planes;
+    int frame;
 
     if(!pk->data){
         vo->end = 1;
-        v_qpts(vo, -1LL);
+        v_qpts(vo, -1LL, -1);
         goto out;
     }
 
@@ -168,37 +293,41 @@ v_put(tcvp_pipe_t *p, tcvp_data_packet_t *pk)
         goto out;
     }
 
-    if(!vo->drop[vo->dropcnt]){
+    if(v_late(vo, pk)){
+        vo->dropcnt++;
+    } else {
+        int64_t st;
+
+        vo->dropcnt = 0;
         pthread_mutex_lock(&vo->smx);
         vo->framecnt++;
         while(vo->frames == vo->driver->frames && vo->state != STOP)
             pthread_cond_wait(&vo->scd, &vo->smx);
+        if(pk->flags & TCVP_PKT_FLAG_DIRECT){
+            video_buffer_t *vb = pk->private;
+            frame = vb->frame;
+            vo->refs[frame]++;
+        } else {
+            while((frame = v_alloc(vo, 0)) < 0 && vo->state != STOP)
+                pthread_cond_wait(&vo->scd, &vo->smx);
+        }
         pthread_mutex_unlock(&vo->smx);
 
         if(!vo->framecnt || vo->state == STOP){
+            v_unref(vo, frame);
             goto out;
         }
 
-        planes = vo->driver->get_frame(vo->driver, vo->head, data, strides);
-        vo->cconv(vo->vstream->width, vo->vstream->height,
-                  (const u_char **) pk->data, pk->sizes, data, strides);
+        st = v_clock();
+        if(!(pk->flags & TCVP_PKT_FLAG_DIRECT)){
+            vo->driver->get_frame(vo->driver, frame, data, strides);
+            vo->cconv(vo->vstream->width, vo->vstream->height,
+                      (const u_char **) pk->data, pk->sizes, data, strides);
+        }
         if(vo->driver->put_frame)
-            vo->driver->put_frame(vo->driver, vo->head);
-        v_qpts(vo, pk->pts);
-    }
-
-    if(output_video_conf_framedrop &&
-       vo->framecnt > vo->driver->frames){
-        int i;
-        float bfr;
-
-        if(++vo->dropcnt == DROPLEN)
-            vo->dropcnt = 0;
-
-        bfr = bufr(vo);
-
-        for(i = 0; bfr < drop_thresholds[i]; i++);
-        vo->drop = drops[i];
+            vo->driver->put_frame(vo->driver, frame);
+        vo->cost += (v_clock() - st - vo->cost) / 8;
+        v_qpts(vo, pk->pts, frame);
     }
 
 out:
@@ -249,8 +378,15 @@ do_flush(video_out_t *vo, int drop)
             pthread_cond_wait(&vo->scd, &vo->smx);
         vo->framecnt = 0;
     } else {
+        while(vo->frames--){
+            if(vo->fq[vo->tail] >= 0)
+                vo->refs[vo->fq[vo->tail]]--;
+            if(++vo->tail == vo->driver->frames)
+                vo->tail = 0;
+        }
         vo->tail = vo->head = 0;
         vo->frames = 0;
+        vo->late = 0;
         if(vo->driver && vo->driver->flush)
             vo->driver->flush(vo->driver);
         vo->framecnt = 0;
@@ -310,6 +446,10 @@ v_free(void *p)
 
     if(vo->pts)
         free(vo->pts);
+    if(vo->fq)
+        free(vo->fq);
+    if(vo->refs)
+        free(vo->refs);
     tcfree(vo->conf);
     tcfree(vo->timer);
 }
@@ -367,6 +507,11 @@ v_probe(tcvp_pipe_t *p, tcvp_data_packet_t *pk, stream_t *s)
     vo->vstream = &p->format.video;
     vo->cconv = cconv;
     vo->pts = malloc(vd->frames * sizeof(*vo->pts));
+    vo->fq = malloc(vd->frames * sizeof(*vo->fq));
+    vo->refs = calloc(vd->frames, sizeof(*vo->refs));
+    vo->direct = vd->direct && !strcmp(pf, vd->pixel_format);
+    if(vo->direct)
+        tc2_print("VIDEO", TC2_PRINT_DEBUG, "direct rendering enabled\n");
 
     return PROBE_OK;
 }
@@ -383,7 +528,7 @@ v_open(tcvp_pipe_t *tp, stream_t *s, tcconf_section_t *cs, tcvp_timer_t *timer,
     pthread_mutex_init(&vo->smx, NULL);
     pthread_cond_init(&vo->scd, NULL);
     vo->state = PAUSE;
-    vo->drop = drops[0];
+    vo->shown = -1;
     vo->conf = tcref(cs);
     vo->timer = tcref(timer);
     vo->discard = tcvp_output_video_conf_discard;
@@ -391,6 +536,8 @@ v_open(tcvp_pipe_t *tp, stream_t *s, tcconf_section_t *cs, tcvp_timer_t *timer,
 
     tp->start = v_start;
     tp->stop = v_stop;
+    tp->get_buffer = v_get_buffer;
+    tp->lateness = v_lateness;
     tp->private = vo;
 
     return 0;
@@ -23,12 +23,17 @@
 **/
 
 #include <stdlib.h>
+#include <limits.h>
 #include <tcstring.h>
 #include <tctypes.h>
 #include <pthread.h>
 #include <tcalloc.h>
-#include <tclist.h>
 #include <tchash.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 #include <tcvp_types.h>
 #include <player_tc2.h>
 
@@ -55,11 +60,42 @@ struct tcvp_player {
     int synctime;
 };
 
+/* Event count.  A waiter samples the count, rechecks its condition
+   and sleeps only if nobody signalled in between.  Signalling is a
+   single atomic increment unless somebody is actually sleeping. */
+typedef struct sp_event {
+    volatile uint32_t seq;
+    volatile int waiters;
+#ifndef __linux__
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+} sp_event_t;
+
+/* Single-producer, single-consumer packet ring.  When a burst
+   overflows the ring the producer chains a larger one and the
+   consumer moves over once the old one is drained. */
+typedef struct sp_ring sp_ring_t;
+struct sp_ring {
+    tcvp_packet_t **pk;
+    u_int size;
+    volatile u_int head, tail;
+    sp_ring_t *volatile next;
+};
+
+typedef struct sp_queue {
+    sp_ring_t *wr, *rd;
+    volatile int count;
+    volatile u_int pushed, popped, dropto;
+    sp_event_t ev;
+} sp_queue_t;
+
 typedef struct stream_play {
     muxed_stream_t *ms;
     struct sp_stream {
         tcvp_pipe_t *pipe, *end;
-        tclist_t *packets;
+        sp_queue_t *packets;
+        int closed;
         uint64_t starttime;
         uint64_t headtime, tailtime;
         int probe, nprobe;
@@ -70,15 +106,288 @@ typedef struct stream_play {
     int *smap;
     int nstreams, pstreams;
     int fail;
-    int waiting;
-    uint64_t nbuf;
-    int state;
+    volatile int waiting;
+    volatile uint64_t nbuf;
+    volatile int state;
     pthread_t rth;
     pthread_mutex_t lock;
-    pthread_cond_t cond;
+    sp_event_t rev;             /* reader: nbuf set or state change */
+    sp_event_t cev;             /* control: nbuf cleared or waiting */
     tcvp_player_t *shared;
 } stream_player_t;
 
+static void
+ev_init(sp_event_t *ev)
+{
+    ev->seq = 0;
+    ev->waiters = 0;
+#ifndef __linux__
+    pthread_mutex_init(&ev->lock, NULL);
+    pthread_cond_init(&ev->cond, NULL);
+#endif
+}
+
+static void
+ev_destroy(sp_event_t *ev)
+{
+#ifndef __linux__
+    pthread_mutex_destroy(&ev->lock);
+    pthread_cond_destroy(&ev->cond);
+#endif
+}
+
+static inline uint32_t
+ev_prepare(sp_event_t *ev)
+{
+    __sync_fetch_and_add(&ev->waiters, 1);
+    return __sync_fetch_and_add(&ev->seq, 0);
+}
+
+static inline void
+ev_cancel(sp_event_t *ev)
+{
+    __sync_fetch_and_sub(&ev->waiters, 1);
+}
+
+static void
+ev_wait(sp_event_t *ev, uint32_t seq)
+{
+#ifdef __linux__
+    syscall(SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&ev->lock);
+    while(ev->seq == seq)
+        pthread_cond_wait(&ev->cond, &ev->lock);
+    pthread_mutex_unlock(&ev->lock);
+#endif
+    __sync_fetch_and_sub(&ev->waiters, 1);
+}
+
+static inline void
+ev_signal(sp_event_t *ev)
+{
+    __sync_fetch_and_add(&ev->seq, 1);
+    if(ev->waiters){
+#ifdef __linux__
+        syscall(SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+                NULL, NULL, 0);
+#else
+        pthread_mutex_lock(&ev->lock);
+        pthread_cond_broadcast(&ev->cond);
+        pthread_mutex_unlock(&ev->lock);
+#endif
+    }
+}
+
+static sp_ring_t *
+spr_new(u_int size)
+{
+    sp_ring_t *r = calloc(1, sizeof(*r));
+    r->pk = calloc(size, sizeof(*r->pk));
+    r->size = size;
+    return r;
+}
+
+static void
+spr_free(sp_ring_t *r)
+{
+    free(r->pk);
+    free(r);
+}
+
+static sp_queue_t *
+spq_new(void)
+{
+    sp_queue_t *q = calloc(1, sizeof(*q));
+    u_int size = 16;
+
+    while(size < max_packets)
+        size <<= 1;
+
+    q->wr = q->rd = spr_new(size);
+    ev_init(&q->ev);
+
+    return q;
+}
+
+/* Only safe once producer and consumer are both gone. */
+static void
+spq_free(sp_queue_t *q)
+{
+    while(q->rd){
+        sp_ring_t *r = q->rd;
+        for(; r->tail != r->head; r->tail++)
+            if(r->pk[r->tail & (r->size - 1)])
+                tcfree(r->pk[r->tail & (r->size - 1)]);
+        q->rd = r->next;
+        spr_free(r);
+    }
+
+    ev_destroy(&q->ev);
+    free(q);
+}
+
+/* Producer side. */
+static void
+spq_push(sp_queue_t *q, tcvp_packet_t *pk)
+{
+    sp_ring_t *r = q->wr;
+
+    if(r->head - r->tail == r->size){
+        sp_ring_t *nr = spr_new(r->size * 2);
+        nr->pk[0] = pk;
+        nr->head = 1;
+        __sync_synchronize();
+        r->next = nr;
+        q->wr = nr;
+    } else {
+        r->pk[r->head & (r->size - 1)] = pk;
+        __sync_synchronize();
+        r->head++;
+    }
+
+    q->pushed++;
+    __sync_fetch_and_add(&q->count, 1);
+    ev_signal(&q->ev);
+}
+
+/* Discard everything pushed so far.  The consumer drops the packets
+   as it reaches them. */
+static void
+spq_drop(sp_queue_t *q)
+{
+    q->dropto = q->pushed;
+    __sync_synchronize();
+}
+
+/* Packets queued and not yet dropped.  Dropped entries stay in the
+   ring, and in count, until the consumer reaches them, so buffer
+   levels must use this instead. */
+static int
+spq_fill(sp_queue_t *q)
+{
+    u_int pushed = q->pushed, from = q->popped, dropto = q->dropto;
+
+    if((int) (dropto - from) > 0)
+        from = dropto;
+
+    return pushed - from;
+}
+
+/* Consumer side.  Returns 0 and sets *pk if a packet was dequeued,
+   -1 if the queue is empty. */
+static int
+spq_shift(sp_queue_t *q, tcvp_packet_t **pk)
+{
+    sp_ring_t *r = q->rd;
+
+    for(;;){
+        sp_ring_t *next = r->next;
+        __sync_synchronize();
+
+        if(r->tail != r->head){
+            tcvp_packet_t *p = r->pk[r->tail & (r->size - 1)];
+            u_int n = q->popped++;
+
+            __sync_synchronize();
+            r->tail++;
+            __sync_fetch_and_sub(&q->count, 1);
+
+            if(p && (int) (q->dropto - n) > 0){
+                tcfree(p);
+                continue;
+            }
+
+            *pk = p;
+            return 0;
+        }
+
+        if(!next)
+            return -1;
+
+        q->rd = next;
+        spr_free(r);
+        r = next;
+    }
+}
+
+static void
+sp_want(stream_player_t *sp, int s)
+{
+    uint64_t b = 1ULL << s;
+
+    if(!(__sync_fetch_and_or(&sp->nbuf, b) & b))
+        ev_signal(&sp->rev);
+}
+
+static void
+sp_full(stream_player_t *sp, int s)
+{
+    if(!__sync_and_and_fetch(&sp->nbuf, ~(1ULL << s)))
+        ev_signal(&sp->cev);
+}
+
+static void
+sp_wakeall(stream_player_t *sp)
+{
+    int i;
+
+    ev_signal(&sp->rev);
+    ev_signal(&sp->cev);
+
+    pthread_mutex_lock(&sp->lock);
+    for(i = 0; i < sp->nstreams; i++)
+        if(sp->streams[i].packets)
+            ev_signal(&sp->streams[i].packets->ev);
+    pthread_mutex_unlock(&sp->lock);
+}
+
+typedef struct gather_packet {
+    tcvp_data_packet_t pk;
+    u_char *data;
+    int size;
+} gather_packet_t;
+
+static void
+gather_free(void *p)
+{
+    gather_packet_t *gp = p;
+    free(gp->data);
+}
+
+/* Copy a scatter packet into a contiguous buffer for pipes that
+   don't accept slices. */
+static tcvp_data_packet_t *
+gather_packet(tcvp_pipe_t *pipe, tcvp_data_packet_t *pk)
+{
+    gather_packet_t *gp;
+    int i, pos = 0;
+
+    if(!pk || !(pk->flags & TCVP_PKT_FLAG_SCATTER) ||
+       (pipe->flags & TCVP_PIPE_FLAG_SCATTER))
+        return pk;
+
+    gp = tcallocdz(sizeof(*gp), NULL, gather_free);
+    gp->pk = *pk;
+    gp->pk.flags &= ~TCVP_PKT_FLAG_SCATTER;
+    gp->pk.data = &gp->data;
+    gp->pk.sizes = &gp->size;
+    gp->pk.planes = 1;
+
+    for(i = 0; i < pk->planes; i++)
+        gp->size += pk->sizes[i];
+
+    gp->data = malloc(gp->size + 8);
+    for(i = 0; i < pk->planes; i++){
+        memcpy(gp->data + pos, pk->data[i], pk->sizes[i]);
+        pos += pk->sizes[i];
+    }
+    memset(gp->data + pos, 0, 8);
+
+    tcfree(pk);
+    return &gp->pk;
+}
+
 static void
 stream_time(muxed_stream_t *stream, int i, tcvp_pipe_t *pipe)
 {
@@ -341,14 +650,14 @@ add_stream(stream_player_t *sp, int s)
 
     sp->streams[s].pipe = tp;
     sp->streams[s].end = pipe_end(tp);
-    sp->streams[s].packets = tclist_new(TC_LOCK_NONE);
+    sp->streams[s].packets = spq_new();
     sp->streams[s].probe = PROBE_AGAIN;
     sp->streams[s].sp = sp;
     sp->streams[s].starttime = -1LL;
 
     sp->ms->used_streams[s] = 1;
     if(!(sp->ms->streams[s].common.flags & TCVP_STREAM_FLAG_NOBUFFER))
-        sp->nbuf |= 1ULL << s;
+        sp_want(sp, s);
 
     r = 0;
 
@@ -382,13 +691,15 @@ del_stream(stream_player_t *sp, int s)
     str->pipe = NULL;
     str->end = NULL;
 
+    /* The reader may still be pushing, so the queue itself stays
+       around until s_free(). */
     if(str->packets){
-        tclist_destroy(str->packets, tcfree);
-        str->packets = NULL;
+        str->closed = 1;
+        spq_drop(str->packets);
     }
 
     sp->ms->used_streams[s] = 0;
-    sp->nbuf &= ~(1ULL << s);
+    sp_full(sp, s);
 
     if(sp->fail == sp->ms->n_streams){
         tcvp_event_send(sh->sq, TCVP_STATE, TCVP_STATE_ERROR);
@@ -404,9 +715,10 @@ del_stream(stream_player_t *sp, int s)
         }
     }
 
-    pthread_cond_broadcast(&sp->cond);
     pthread_mutex_unlock(&sp->lock);
 
+    sp_wakeall(sp);
+
     return 0;
 }
 
@@ -414,47 +726,52 @@ static int
 flush_stream(stream_player_t *sp, int sx, int drop)
 {
     struct sp_stream *str = sp->streams + sx;
-    tcvp_packet_t *pk;
 
     if(!str->packets)
         return 0;
 
     if(drop)
-        while((pk = tclist_shift(str->packets)))
-            tcfree(pk);
+        spq_drop(str->packets);
 
     if(str->pipe)
         str->pipe->flush(str->pipe, drop);
 
-    if(str->probe == PROBE_OK)
+    if(str->probe == PROBE_OK && !str->closed)
         if(!(sp->ms->streams[sx].common.flags & TCVP_STREAM_FLAG_NOBUFFER))
-            sp->nbuf |= 1ULL << sx;
+            sp_want(sp, sx);
 
     return 0;
 }
 
+#define play_ready(sp, q)                                               \
+    (sp->state == STOP || (q->count && sp->state != PAUSE))
+
 static int
-waitplay(stream_player_t *sp, int s)
+waitplay(stream_player_t *sp, sp_queue_t *q)
 {
-    struct sp_stream *sps = sp->streams + s;
     int w = 1;
 
-    pthread_mutex_lock(&sp->lock);
-    while((!tclist_items(sps->packets) || sp->state == PAUSE) &&
-          sp->state != STOP){
+    while(!play_ready(sp, q)){
+        uint32_t seq;
+
         if(w){
-            sp->waiting += w;
-            pthread_cond_broadcast(&sp->cond);
+            __sync_fetch_and_add(&sp->waiting, 1);
+            ev_signal(&sp->cev);
             w = 0;
         }
-        pthread_cond_wait(&sp->cond, &sp->lock);
+
+        seq = ev_prepare(&q->ev);
+        if(play_ready(sp, q)){
+            ev_cancel(&q->ev);
+            break;
+        }
+        ev_wait(&q->ev, seq);
     }
 
     if(!w){
-        sp->waiting--;
-        pthread_cond_broadcast(&sp->cond);
+        __sync_fetch_and_sub(&sp->waiting, 1);
+        ev_signal(&sp->cev);
     }
-    pthread_mutex_unlock(&sp->lock);
 
     return sp->state != STOP;
 }
@@ -466,34 +783,39 @@ play_stream(void *p)
     stream_player_t *sp = str->sp;
     int six = str - sp->streams;
     int shs = sp->smap[six];
-    tcvp_packet_t *pk;
+    sp_queue_t *q = str->packets;
+    tcvp_packet_t *pk = NULL;
 
     tc2_print("STREAM", TC2_PRINT_DEBUG,
               "[%i] starting player thread\n", shs);
 
-    while(waitplay(sp, six)){
-        pthread_mutex_lock(&sp->lock);
-        pk = tclist_shift(str->packets);
+    while(waitplay(sp, q)){
+        int empty = spq_shift(q, &pk);
 
-        if(pk && pk->type == TCVP_PKT_TYPE_DATA &&
+        if(!empty && pk && pk->type == TCVP_PKT_TYPE_DATA &&
            pk->data.flags & TCVP_PKT_FLAG_PTS)
             str->tailtime = pk->data.pts;
 
-        if((tclist_items(str->packets) < min_packets ||
+        if((spq_fill(q) < min_packets ||
             str->headtime - str->tailtime < buffertime) &&
            sp->ms->used_streams[six]){
             if(!(sp->ms->streams[six].common.flags &
                  TCVP_STREAM_FLAG_NOBUFFER))
-                sp->nbuf |= 1ULL << six;
-            pthread_cond_broadcast(&sp->cond);
+                sp_want(sp, six);
         }
-        pthread_mutex_unlock(&sp->lock);
+
+        if(empty)
+            continue;
+
         if(!pk){
             tc2_print("STREAM", TC2_PRINT_DEBUG,
                       "null packet on stream %i\n", shs);
             break;
         }
 
+        if(pk->type == TCVP_PKT_TYPE_DATA)
+            pk = (tcvp_packet_t *) gather_packet(str->pipe, &pk->data);
+
         if(str->pipe->input(str->pipe, pk)){
             tc2_print("STREAM", TC2_PRINT_ERROR,
                       "stream %i pipeline error\n", shs);
@@ -517,13 +839,20 @@ play_stream(void *p)
     return NULL;
 }
 
+#define read_ready(sp)                                                  \
+    (sp->state == STOP || (sp->nbuf && sp->state != PAUSE))
+
 static int
 waitbuf(stream_player_t *sp)
 {
-    pthread_mutex_lock(&sp->lock);
-    while((!sp->nbuf || sp->state == PAUSE) && sp->state != STOP)
-        pthread_cond_wait(&sp->cond, &sp->lock);
-    pthread_mutex_unlock(&sp->lock);
+    while(!read_ready(sp)){
+        uint32_t seq = ev_prepare(&sp->rev);
+        if(read_ready(sp)){
+            ev_cancel(&sp->rev);
+            break;
+        }
+        ev_wait(&sp->rev, seq);
+    }
 
     return sp->state != STOP;
 }
@@ -566,11 +895,8 @@ do_data_packet(stream_player_t *sp, tcvp_data_packet_t *pk)
                       "[%i] end time reached\n", pk->stream);
             tcfree(pk);
             pk = NULL;
-            pthread_mutex_lock(&sp->lock);
             sp->ms->used_streams[ps] = 0;
-            sp->nbuf &= ~(1ULL << ps);
-            pthread_cond_broadcast(&sp->cond);
-            pthread_mutex_unlock(&sp->lock);
+            sp_full(sp, ps);
         } else if(str->starttime == -1LL){
             tc2_print("STREAM", TC2_PRINT_DEBUG,
                       "[%i] start %llu\n",
@@ -589,6 +915,7 @@ do_data_packet(stream_player_t *sp, tcvp_data_packet_t *pk)
         tc2_print("STREAM", TC2_PRINT_DEBUG, "[%i] probing\n",
                   pk->stream);
         sp->ms->streams[ps].common.index = pk->stream;
+        pk = gather_packet(str->pipe, pk);
         str->probe = str->pipe->probe(str->pipe, pk,
                                       sp->ms->streams + ps);
         if(str->probe == PROBE_FAIL ||
@@ -613,22 +940,21 @@ do_data_packet(stream_player_t *sp, tcvp_data_packet_t *pk)
             break;
         }
     case PROBE_OK:
-        pthread_mutex_lock(&sp->lock);
-        if(str->packets){
+        if(str->packets && !str->closed){
             int np;
 
-            tclist_push(str->packets, pk);
             if(pk && pk->flags & TCVP_PKT_FLAG_PTS)
                 str->headtime = pk->pts;
+            spq_push(str->packets, (tcvp_packet_t *) pk);
 
-            np = tclist_items(str->packets);
+            np = spq_fill(str->packets);
             if(str->probe == PROBE_OK && (np > max_packets ||
                ((str->headtime - str->tailtime > buffertime) &&
                 np > min_packets)))
-                sp->nbuf &= ~(1ULL << ps);
+                sp_full(sp, ps);
+        } else if(pk){
+            tcfree(pk);
         }
-        pthread_cond_broadcast(&sp->cond);
-        pthread_mutex_unlock(&sp->lock);
         break;
     }
 
@@ -653,12 +979,9 @@ read_stream(void *p)
 
             tc2_print("STREAM", TC2_PRINT_DEBUG, "end of stream\n");
 
-            pthread_mutex_lock(&sp->lock);
             for(i = 0; i < sp->nstreams; i++)
-                if(sp->streams[i].packets)
-                    tclist_push(sp->streams[i].packets, NULL);
-            pthread_cond_broadcast(&sp->cond);
-            pthread_mutex_unlock(&sp->lock);
+                if(sp->streams[i].packets && !sp->streams[i].closed)
+                    spq_push(sp->streams[i].packets, NULL);
             break;
         }
 
@@ -688,10 +1011,8 @@ read_stream(void *p)
         }
     }
 
-    pthread_mutex_lock(&sp->lock);
-    sp->nbuf = 0;
-    pthread_cond_broadcast(&sp->cond);
-    pthread_mutex_unlock(&sp->lock);
+    __sync_and_and_fetch(&sp->nbuf, 0);
+    ev_signal(&sp->cev);
 
     tc2_print("STREAM", TC2_PRINT_DEBUG, "read_stream done\n");
 
@@ -707,14 +1028,20 @@ s_start(tcvp_pipe_t *tp)
 
     tc2_print("STREAM", TC2_PRINT_DEBUG, "start\n");
 
-    pthread_mutex_lock(&sp->lock);
     sp->state = RUN;
-    pthread_cond_broadcast(&sp->cond);
+    sp_wakeall(sp);
 
     tc2_print("STREAM", TC2_PRINT_DEBUG, "buffering\n");
-    while(sp->nbuf)
-        pthread_cond_wait(&sp->cond, &sp->lock);
+    while(sp->nbuf){
+        uint32_t seq = ev_prepare(&sp->cev);
+        if(!sp->nbuf){
+            ev_cancel(&sp->cev);
+            break;
+        }
+        ev_wait(&sp->cev, seq);
+    }
 
+    pthread_mutex_lock(&sp->lock);
     for(i = 0; i < sp->nstreams; i++){
         if(sp->streams[i].probe == PROBE_OK &&
            sp->streams[i].end && sp->streams[i].end->start){
@@ -746,11 +1073,18 @@ s_stop(tcvp_pipe_t *tp)
 
     tc2_print("STREAM", TC2_PRINT_DEBUG, "stop\n");
 
-    pthread_mutex_lock(&sp->lock);
     sp->state = PAUSE;
     tc2_print("STREAM", TC2_PRINT_DEBUG, "waiting for player threads\n");
-    while(sp->waiting < sp->pstreams)
-        pthread_cond_wait(&sp->cond, &sp->lock);
+    while(sp->waiting < sp->pstreams){
+        uint32_t seq = ev_prepare(&sp->cev);
+        if(sp->waiting >= sp->pstreams){
+            ev_cancel(&sp->cev);
+            break;
+        }
+        ev_wait(&sp->cev, seq);
+    }
+
+    pthread_mutex_lock(&sp->lock);
     for(i = 0; i < sp->nstreams; i++){
         if(sp->streams[i].probe == PROBE_OK &&
            sp->streams[i].end && sp->streams[i].end->stop)
@@ -795,18 +1129,21 @@ s_free(void *p)
     stream_player_t *sp = tp->private;
     int i;
 
-    pthread_mutex_lock(&sp->lock);
     sp->state = STOP;
-    pthread_cond_broadcast(&sp->cond);
-    pthread_mutex_unlock(&sp->lock);
+    sp_wakeall(sp);
 
     pthread_join(sp->rth, NULL);
 
     for(i = 0; i < sp->nstreams; i++){
         if(sp->streams[i].th)
             pthread_join(sp->streams[i].th, NULL);
+        if(sp->streams[i].packets)
+            spq_free(sp->streams[i].packets);
     }
 
+    ev_destroy(&sp->rev);
+    ev_destroy(&sp->cev);
+    pthread_mutex_destroy(&sp->lock);
     tcfree(sp->ms);
     free(sp->streams);
     free(sp->smap);
@@ -825,7 +1162,8 @@ s_play(tcvp_player_t *sh, muxed_stream_t *ms)
     sp->state = PAUSE;
     sp->shared = sh;
     pthread_mutex_init(&sp->lock, NULL);
-    pthread_cond_init(&sp->cond, NULL);
+    ev_init(&sp->rev);
+    ev_init(&sp->cev);
 
     for(i = 0; i < ms->n_streams; i++)
         if(add_stream(sp, i))
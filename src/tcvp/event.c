@@ -83,7 +83,8 @@ extern u_char *
 load_ser(char *name, void *event, int *ssize)
 {
     tcvp_load_event_t *te = event;
-    char *file, *title, *artist, *performer, *album;
+    char *file, *title, *artist, *performer, *album, *stats;
+    tcvp_stats_t *sf;
     u_char *sb, *p;
     int size, i;
 
@@ -104,6 +105,14 @@ load_ser(char *name, void *event, int *ssize)
     get_attr(performer);
     get_attr(album);
 
+    /* take a fresh snapshot if the demuxer keeps live counters */
+    if((sf = tcattr_get(te->stream, "tcvp/stats")))
+        stats = sf->get(sf->private);
+    else if((stats = tcattr_get(te->stream, "stats")))
+        stats = strdup(stats);
+    if(stats)
+        size += strlen("stats") + strlen(stats) + 2;
+
     /* remember to update these sizes if serialization is modified below */
     for(i = 0; i < te->stream->n_streams; i++){
         stream_t *st = te->stream->streams + i;
@@ -163,8 +172,11 @@ load_ser(char *name, void *event, int *ssize)
     write_attr(artist);
     write_attr(performer);
     write_attr(album);
+    write_attr(stats);
     *p = 0;
 
+    free(stats);
+
     *ssize = size;
     return sb;
 }
@@ -222,6 +222,8 @@ print_info(muxed_stream_t *stream)
     char *title = tcattr_get(stream, "title");
     char *album = tcattr_get(stream, "album");
     char *track = tcattr_get(stream, "track");
+    tcvp_stats_t *sf = tcattr_get(stream, "tcvp/stats");
+    char *stats = sf? sf->get(sf->private): NULL;
     int i;
 
     if(file)
@@ -237,6 +239,9 @@ print_info(muxed_stream_t *stream)
     if(stream->time)
         printf("Length:    %lli:%02lli\n", stream->time / 27000000 / 60,
                (stream->time / 27000000) % 60);
+    if(stats)
+        printf("Stats:     %s\n", stats);
+    free(stats);
 
     for(i = 0; i < stream->n_streams; i++){
         int u = stream->used_streams[i];
@@ -21,33 +21,138 @@
     OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
     DEALINGS IN THE SOFTWARE.
 **/
-
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
-#include <sys/time.h>
+#include <time.h>
 #include <tctypes.h>
 #include <pthread.h>
 #include <tcalloc.h>
 #include <swtimer_tc2.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+/* Tickless software timer.  Instead of ticking every 'res' the
+   driver keeps a heap of deadlines, in ticks of running time, and
+   sleeps on CLOCK_MONOTONIC until the earliest one is due. */
 
 typedef struct sw_timer {
-    int res;
     int state;
     tcvp_timer_t *timer;
     pthread_t th;
     pthread_mutex_t mx;
+    pthread_cond_t cd;
+    struct timespec last;       /* clock at last update */
+    uint64_t now;               /* running time at last update */
+    u_int rem;                  /* fractional ticks, 1/1000 */
+    uint64_t *heap;
+    int hsize, hcount;
 } sw_timer_t;
 
 #define RUN   1
 #define PAUSE 2
 #define STOP  3
 
+#define HEAP_INIT 16
+
+static uint64_t
+st_pending(sw_timer_t *st, struct timespec *t, u_int *rem)
+{
+    uint64_t ns, ticks;
+
+    clock_gettime(CLOCK_MONOTONIC, t);
+    ns = (uint64_t) (t->tv_sec - st->last.tv_sec) * 1000000000 +
+        t->tv_nsec - st->last.tv_nsec;
+    ticks = ns * 27 + st->rem;
+    *rem = ticks % 1000;
+
+    return ticks / 1000;
+}
+
+static uint64_t
+st_advance(sw_timer_t *st)
+{
+    struct timespec t;
+    uint64_t ticks;
+    u_int rem;
+
+    ticks = st_pending(st, &t, &rem);
+    st->last = t;
+    st->rem = rem;
+    st->now += ticks;
+
+    return ticks;
+}
+
+static void
+heap_push(sw_timer_t *st, uint64_t d)
+{
+    int i, p;
+
+    if(st->hcount == st->hsize){
+        st->hsize *= 2;
+        st->heap = realloc(st->heap, st->hsize * sizeof(*st->heap));
+    }
+
+    for(i = st->hcount++; i > 0; i = p){
+        p = (i - 1) / 2;
+        if(st->heap[p] <= d)
+            break;
+        st->heap[i] = st->heap[p];
+    }
+
+    st->heap[i] = d;
+}
+
+static void
+heap_pop(sw_timer_t *st)
+{
+    uint64_t d = st->heap[--st->hcount];
+    int i, c;
+
+    for(i = 0; (c = 2 * i + 1) < st->hcount; i = c){
+        if(c + 1 < st->hcount && st->heap[c + 1] < st->heap[c])
+            c++;
+        if(d <= st->heap[c])
+            break;
+        st->heap[i] = st->heap[c];
+    }
+
+    st->heap[i] = d;
+}
+
+/* Called with st->mx held. */
+static void
+st_update(sw_timer_t *st)
+{
+    uint64_t ticks;
+
+    if(st->state != RUN)
+        return;
+
+    ticks = st_advance(st);
+    while(st->hcount && st->heap[0] <= st->now)
+        heap_pop(st);
+
+    if(ticks && st->timer)
+        st->timer->tick(st->timer, ticks);
+}
+
 static int
 st_start(timer_driver_t *t)
 {
     sw_timer_t *st = t->private;
-    st->state = RUN;
+
+    pthread_mutex_lock(&st->mx);
+    if(st->state != RUN){
+        clock_gettime(CLOCK_MONOTONIC, &st->last);
+        st->rem = 0;
+        st->state = RUN;
+        pthread_cond_signal(&st->cd);
+    }
+    pthread_mutex_unlock(&st->mx);
+
     return 0;
 }
 
@@ -55,7 +160,43 @@ static int
 st_stop(timer_driver_t *t)
 {
     sw_timer_t *st = t->private;
-    st->state = PAUSE;
+
+    pthread_mutex_lock(&st->mx);
+    if(st->state == RUN){
+        st_advance(st);
+        st->state = PAUSE;
+    }
+    pthread_mutex_unlock(&st->mx);
+
+    return 0;
+}
+
+static int
+st_wakeup(timer_driver_t *t, uint64_t ticks)
+{
+    sw_timer_t *st = t->private;
+    uint64_t d;
+
+    /* relative to the last tick delivered to the timer */
+    pthread_mutex_lock(&st->mx);
+    d = st->now + ticks;
+    heap_push(st, d);
+    if(st->heap[0] == d)
+        pthread_cond_signal(&st->cd);
+    pthread_mutex_unlock(&st->mx);
+
+    return 0;
+}
+
+static int
+st_sync(timer_driver_t *t)
+{
+    sw_timer_t *st = t->private;
+
+    pthread_mutex_lock(&st->mx);
+    st_update(st);
+    pthread_mutex_unlock(&st->mx);
+
     return 0;
 }
 
@@ -64,9 +205,16 @@ st_free(void *p)
 {
     timer_driver_t *t = p;
     sw_timer_t *st = t->private;
+
+    pthread_mutex_lock(&st->mx);
     st->state = STOP;
+    pthread_cond_signal(&st->cd);
+    pthread_mutex_unlock(&st->mx);
+
     pthread_join(st->th, NULL);
     pthread_mutex_destroy(&st->mx);
+    pthread_cond_destroy(&st->cd);
+    free(st->heap);
     free(st);
 }
 
@@ -84,38 +232,38 @@ static void *
 timer_run(void *p)
 {
     sw_timer_t *st = p;
-    struct timeval stime;
     struct timespec time;
-    pthread_mutex_t mx;
-    pthread_cond_t cd;
+    uint64_t ns;
 
-    pthread_mutex_init(&mx, NULL);
-    pthread_cond_init(&cd, NULL);
-    pthread_mutex_lock(&mx);
+#ifdef PR_SET_TIMERSLACK
+    prctl(PR_SET_TIMERSLACK, 1);
+#endif
 
-    gettimeofday(&stime, NULL);
-    time.tv_sec = stime.tv_sec;
-    time.tv_nsec = stime.tv_usec * 1000;
+    pthread_mutex_lock(&st->mx);
 
     while(st->state != STOP){
-        time.tv_nsec += 1000 * st->res / 27;
-        if(time.tv_nsec > 1000000000){
-            time.tv_sec++;
-            time.tv_nsec -= 1000000000;
+        if(st->state != RUN || !st->hcount){
+            pthread_cond_wait(&st->cd, &st->mx);
+        } else if(st->heap[0] > st->now){
+            ns = ((st->heap[0] - st->now) * 1000 - st->rem + 26) / 27;
+            time.tv_sec = st->last.tv_sec + ns / 1000000000;
+            time.tv_nsec = st->last.tv_nsec + ns % 1000000000;
+            if(time.tv_nsec >= 1000000000){
+                time.tv_sec++;
+                time.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&st->cd, &st->mx, &time);
         }
 
-        pthread_cond_timedwait(&cd, &mx, &time);
-
-        pthread_mutex_lock(&st->mx);
-        if(st->state == RUN && st->timer){
-            st->timer->tick(st->timer, st->res);
+        if(st->state == RUN && st->hcount){
+            struct timespec ts;
+            u_int rem;
+            if(st->now + st_pending(st, &ts, &rem) >= st->heap[0])
+                st_update(st);
         }
-        pthread_mutex_unlock(&st->mx);
     }
 
-    pthread_mutex_unlock(&mx);
-    pthread_mutex_destroy(&mx);
-    pthread_cond_destroy(&cd);
+    pthread_mutex_unlock(&st->mx);
 
     return NULL;
 }
@@ -124,11 +272,17 @@ extern timer_driver_t *
 st_new(tcconf_section_t *cf, int res)
 {
     timer_driver_t *tm;
+    pthread_condattr_t ca;
     sw_timer_t *st;
 
     st = calloc(1, sizeof(*st));
-    st->res = 27000 * res;
     pthread_mutex_init(&st->mx, NULL);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&st->cd, &ca);
+    pthread_condattr_destroy(&ca);
+    st->hsize = HEAP_INIT;
+    st->heap = malloc(st->hsize * sizeof(*st->heap));
     st->state = PAUSE;
 
     pthread_create(&st->th, NULL, timer_run, st);
@@ -137,6 +291,8 @@ st_new(tcconf_section_t *cf, int res)
     tm->start = st_start;
     tm->stop = st_stop;
     tm->set_timer = st_settimer;
+    tm->wakeup = st_wakeup;
+    tm->sync = st_sync;
     tm->private = st;
 
     return tm;
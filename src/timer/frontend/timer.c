@@ -39,18 +39,78 @@
 #define STOP  2
 #define PAUSE 3
 
+/* A thread blocked in tm_wait(), queued by deadline. */
+typedef struct tm_waiter {
+    uint64_t time;
+    int queued;
+    pthread_cond_t cd;
+    struct tm_waiter *next;
+} tm_waiter_t;
+
 typedef struct atimer {
     timer_driver_t *driver;
     uint64_t time;
     int intr;
     int wait;
     pthread_mutex_t mx;
-    pthread_cond_t cd;
+    tm_waiter_t *waiters;
     int state;
     double mod;
     double mticks;
 } atimer_t;
 
+/* The functions below are called with at->mx held. */
+
+static void
+tm_enqueue(atimer_t *at, tm_waiter_t *w)
+{
+    tm_waiter_t **wp = &at->waiters;
+
+    while(*wp && (*wp)->time <= w->time)
+        wp = &(*wp)->next;
+
+    w->next = *wp;
+    *wp = w;
+    w->queued = 1;
+}
+
+static void
+tm_dequeue(atimer_t *at, tm_waiter_t *w)
+{
+    tm_waiter_t **wp = &at->waiters;
+
+    while(*wp != w)
+        wp = &(*wp)->next;
+
+    *wp = w->next;
+    w->queued = 0;
+}
+
+/* Wake waiters whose deadline has passed. */
+static void
+tm_wake(atimer_t *at)
+{
+    tm_waiter_t *w;
+
+    while((w = at->waiters) && w->time <= at->time){
+        at->waiters = w->next;
+        w->queued = 0;
+        pthread_cond_signal(&w->cd);
+    }
+}
+
+static void
+tm_wake_all(atimer_t *at)
+{
+    tm_waiter_t *w;
+
+    while((w = at->waiters)){
+        at->waiters = w->next;
+        w->queued = 0;
+        pthread_cond_signal(&w->cd);
+    }
+}
+
 static void
 free_timer(void *p)
 {
@@ -61,19 +121,53 @@ free_timer(void *p)
         at->driver->set_timer(at->driver, NULL);
         tcfree(at->driver);
     }
+    pthread_mutex_lock(&at->mx);
     at->time = -1;
-    pthread_cond_broadcast(&at->cd);
+    tm_wake_all(at);
+    pthread_mutex_unlock(&at->mx);
     sched_yield();
     pthread_mutex_destroy(&at->mx);
-    pthread_cond_destroy(&at->cd);
     free(at);
 }
 
+static timer_driver_t *
+tm_getdriver(atimer_t *at)
+{
+    timer_driver_t *td;
+
+    pthread_mutex_lock(&at->mx);
+    td = at->driver? tcref(at->driver): NULL;
+    pthread_mutex_unlock(&at->mx);
+
+    return td;
+}
+
+/* Ask a tickless driver for a tick when the timer should reach time.
+   Called without at->mx held since the driver may tick from within. */
+static void
+tm_arm(atimer_t *at, timer_driver_t *td, uint64_t time, uint64_t now)
+{
+    uint64_t ticks = time - now;
+
+    /* rounding in tm_tick() may lose up to one tick */
+    if(at->mod != 0.0)
+        ticks = ceil((ticks + 1) / (1.0 + at->mod));
+
+    td->wakeup(td, ticks);
+}
+
 static int
 tm_wait(tcvp_timer_t *t, uint64_t time, pthread_mutex_t *lock)
 {
     atimer_t *at = t->private;
-    int intr = 1, wait, l = 1;
+    int intr = 1, wait, l = 1, arm = 1;
+    timer_driver_t *td;
+    tm_waiter_t w;
+    uint64_t now;
+
+    w.time = time;
+    w.queued = 0;
+    pthread_cond_init(&w.cd, NULL);
 
     pthread_mutex_lock(&at->mx);
     wait = ++at->wait;
@@ -82,9 +176,25 @@ tm_wait(tcvp_timer_t *t, uint64_t time, pthread_mutex_t *lock)
             pthread_mutex_unlock(lock);
             l = 0;
         }
-        pthread_cond_wait(&at->cd, &at->mx);
+        if(!w.queued)
+            tm_enqueue(at, &w);
+        if(arm && at->driver && at->driver->wakeup){
+            td = tcref(at->driver);
+            now = at->time;
+            pthread_mutex_unlock(&at->mx);
+            tm_arm(at, td, time, now);
+            tcfree(td);
+            pthread_mutex_lock(&at->mx);
+            arm = at->time != now;
+            continue;
+        }
+        pthread_cond_wait(&w.cd, &at->mx);
+        arm = 1;
     }
+    if(w.queued)
+        tm_dequeue(at, &w);
     pthread_mutex_unlock(&at->mx);
+    pthread_cond_destroy(&w.cd);
     if(!l && lock)
         pthread_mutex_lock(lock);
 
@@ -95,6 +205,14 @@ static uint64_t
 tm_read(tcvp_timer_t *t)
 {
     atimer_t *at = t->private;
+    timer_driver_t *td;
+
+    if((td = tm_getdriver(at))){
+        if(td->sync && at->state == RUN)
+            td->sync(td);
+        tcfree(td);
+    }
+
     return at->time;
 }
 
@@ -105,7 +223,11 @@ tm_reset(tcvp_timer_t *t, uint64_t time)
 
     pthread_mutex_lock(&at->mx);
     at->time = time;
-    pthread_cond_broadcast(&at->cd);
+    /* deadlines armed with a tickless driver are now off */
+    if(at->driver && at->driver->wakeup)
+        tm_wake_all(at);
+    else
+        tm_wake(at);
     pthread_mutex_unlock(&at->mx);
 
     return 0;
@@ -118,7 +240,7 @@ tm_intr(tcvp_timer_t *t)
 
     pthread_mutex_lock(&at->mx);
     at->intr = at->wait;
-    pthread_cond_broadcast(&at->cd);
+    tm_wake_all(at);
     pthread_mutex_unlock(&at->mx);
 
     return 0;
@@ -138,6 +260,8 @@ static int
 tm_stop(tcvp_timer_t *t)
 {
     atimer_t *at = t->private;
+    if(at->driver && at->driver->sync && at->state == RUN)
+        at->driver->sync(at->driver);
     at->state = PAUSE;
     if(at->driver)
         at->driver->stop(at->driver);
@@ -159,17 +283,19 @@ tm_tick(tcvp_timer_t *t, uint64_t ticks)
     pthread_mutex_lock(&at->mx);
     if(at->state == RUN)
         at->time += ticks;
-    pthread_cond_broadcast(&at->cd);
+    tm_wake(at);
     pthread_mutex_unlock(&at->mx);
 }
 
+/* Callers adjust the rate relative to the configured modulation, so
+   e.g. audio sync corrections leave the user's setting in effect. */
 static int
 tm_modulate(tcvp_timer_t *t, double mod)
 {
     atimer_t *at = t->private;
     if(mod <= -1.0)
         return -1;
-    at->mod = mod;
+    at->mod = (1.0 + tcvp_timer_conf_modulate) * (1.0 + mod) - 1.0;
     return 0;
 }
 
@@ -177,14 +303,18 @@ static int
 tm_setdriver(tcvp_timer_t *t, timer_driver_t *td)
 {
     atimer_t *at = t->private;
+    timer_driver_t *otd;
 
-    if(at->driver){
-        at->driver->set_timer(at->driver, NULL);
-        at->driver->stop(at->driver);
-        tcfree(at->driver);
-    }
-
+    pthread_mutex_lock(&at->mx);
+    otd = at->driver;
     at->driver = td;
+    pthread_mutex_unlock(&at->mx);
+
+    if(otd){
+        otd->set_timer(otd, NULL);
+        otd->stop(otd);
+        tcfree(otd);
+    }
 
     if(td){
         td->set_timer(td, t);
@@ -194,6 +324,11 @@ tm_setdriver(tcvp_timer_t *t, timer_driver_t *td)
 
     t->have_driver = !!td;
 
+    /* waiters re-arm with the new driver */
+    pthread_mutex_lock(&at->mx);
+    tm_wake_all(at);
+    pthread_mutex_unlock(&at->mx);
+
     return 0;
 }
 
@@ -205,7 +340,6 @@ tm_new(tcconf_section_t *cf)
 
     at = calloc(1, sizeof(*at));
     pthread_mutex_init(&at->mx, NULL);
-    pthread_cond_init(&at->cd, NULL);
     at->state = PAUSE;
     at->mod = tcvp_timer_conf_modulate;
 
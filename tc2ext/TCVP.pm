@@ -313,6 +313,12 @@ END_C
             print $fh <<END_C;
     return p->next? p->next->flush(p->next, drop): 0;
 }
+
+static int64_t
+$$_{w}lateness(tcvp_pipe_t *p)
+{
+    return p->next && p->next->lateness? p->next->lateness(p->next): 0;
+}
 END_C
             print $fh <<END_C;
 extern tcvp_pipe_t *
@@ -327,6 +333,7 @@ $$_{w}new(stream_t *s, tcconf_section_t *cs, tcvp_timer_t *t,
     p->filter.input = $$_{w}packet;
     p->filter.probe = $$_{w}probe;
     p->filter.flush = $$_{w}flush;
+    p->filter.lateness = $$_{w}lateness;
 END_C
             print $fh <<END_C if $$_{new};
     if($$_{new}(&p->filter, s, cs, t, ms)){
@@ -0,0 +1,166 @@
+/**
+    Copyright (C) 2006  Michael Ahlberg, Måns Rullgård
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+**/
+
+/* Colour conversion bit-exactness test.
+
+   Runs every conversion in the video output's table with the C row
+   kernels and with each vector set the CPU supports, on random
+   planes with odd sizes and strides so that the vector loops leave
+   tails of every length, and compares the outputs byte for byte.
+   The conversions are taken from the output source itself.  Build
+   from the top of a configured tree:
+
+     cc -O2 -Iinclude -I<tc2 include dir> -Isrc/output/video \
+        -o cconvtest tools/cconvtest.c -ltc2 -lpthread
+
+   and run as cconvtest [iterations]. */
+
+#include "../src/output/video/colors.c"
+
+#define PLANES 3
+
+static struct {
+    char *name;
+    void (*yuy2)(uint8_t *, const uint8_t *, const uint8_t *,
+                 const uint8_t *, int);
+    void (*exp2)(uint8_t *, const uint8_t *, int);
+    int ok;
+} kernels[] = {
+    { "c", yuy2_row_c, exp2_row_c, 1 },
+#ifdef HAVE_X86_SIMD
+    { "sse2", yuy2_row_sse2, exp2_row_sse2 },
+    { "avx2", yuy2_row_avx2, exp2_row_avx2 },
+#endif
+#ifdef HAVE_NEON
+    { "neon", yuy2_row_neon, exp2_row_neon, 1 },
+#endif
+    { NULL }
+};
+
+static void
+fill(u_char *p, size_t size)
+{
+    while(size--)
+        *p++ = rand();
+}
+
+int
+main(int argc, char **argv)
+{
+    int iter = argc > 1? atoi(argv[1]): 2000;
+    int nconv = 0, fail = 0;
+    int i, j, k, t;
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    kernels[1].ok = __builtin_cpu_supports("sse2");
+    kernels[2].ok = __builtin_cpu_supports("avx2");
+#endif
+
+    for(k = 0; kernels[k].name; k++)
+        if(kernels[k].ok)
+            printf("%s ", kernels[k].name);
+    printf("kernels\n");
+
+    srand(1);
+
+    for(i = 0; conv_table[i].in; i++){
+        color_conv_t conv = conv_table[i].conv;
+        int bad = 0;
+
+        for(t = 0; t < iter && !bad; t++){
+            int width = 1 + rand() % 300, height = 1 + rand() % 24;
+            int istride[PLANES], ostride[PLANES];
+            const u_char *in[PLANES];
+            u_char *ibuf[PLANES], *out[PLANES], *ref[PLANES];
+            size_t isize[PLANES], osize[PLANES];
+
+            /* odd sizes and strides give every tail length */
+            width |= rand() & 1;
+            height |= rand() & 1;
+
+            /* some conversions swap U and V, which share strides */
+            for(j = 0; j < PLANES; j++){
+                int w = j? width / 2 + 1: width;
+                if(j < 2){
+                    istride[j] = w + rand() % 37;
+                    ostride[j] = 2 * w + rand() % 37;
+                } else {
+                    istride[j] = istride[1];
+                    ostride[j] = ostride[1];
+                }
+                isize[j] = (size_t) istride[j] * (height + 2) + 64;
+                osize[j] = (size_t) (ostride[j] + 2 * istride[j] + 64) *
+                    (2 * height + 2);
+                ibuf[j] = malloc(isize[j]);
+                fill(ibuf[j], isize[j]);
+                in[j] = ibuf[j];
+                out[j] = malloc(osize[j]);
+                ref[j] = malloc(osize[j]);
+            }
+
+            for(k = 0; kernels[k].name; k++){
+                u_char **o = k? out: ref;
+
+                if(!kernels[k].ok)
+                    continue;
+
+                for(j = 0; j < PLANES; j++)
+                    memset(o[j], 0xa5, osize[j]);
+
+                yuy2_row = kernels[k].yuy2;
+                exp2_row = kernels[k].exp2;
+                conv(width, height, in, istride, o, ostride);
+
+                if(!k)
+                    continue;
+
+                for(j = 0; j < PLANES; j++){
+                    if(memcmp(out[j], ref[j], osize[j])){
+                        printf("%s_%s %s: plane %i differs at %ix%i, "
+                               "strides %i/%i\n", conv_table[i].in,
+                               conv_table[i].out, kernels[k].name, j,
+                               width, height, istride[j], ostride[j]);
+                        bad = 1;
+                        break;
+                    }
+                }
+            }
+
+            for(j = 0; j < PLANES; j++){
+                free(ibuf[j]);
+                free(out[j]);
+                free(ref[j]);
+            }
+        }
+
+        fail |= bad;
+        nconv++;
+    }
+
+    printf("%i conversions, %i iterations each: %s\n", nconv, iter,
+           fail? "FAILED": "ok");
+
+    return fail;
+}
@@ -0,0 +1,207 @@
+/**
+    Copyright (C) 2006  Michael Ahlberg, Måns Rullgård
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+**/
+
+/* Equalizer benchmark.
+
+   Runs the per-sample loop the equalizer used before block
+   processing and the current block loop, with the C and SSE2 band
+   kernels, over the same noise and reports ns/sample and the largest
+   difference from the old output.  The current code is taken from
+   the filter source itself.  Build from the top of a configured tree:
+
+     cc -O2 -Iinclude -I<tc2 include dir> -Isrc/filters/equalizer \
+        -o eqbench tools/eqbench.c -ltc2 -lm
+
+   and run as eqbench [channels [seconds]]. */
+
+#include "../src/filters/equalizer/equalizer.c"
+
+#include <time.h>
+
+#define RATE 48000
+
+/* The filter loop as it was, s16 native endian only. */
+typedef struct old_eq {
+    float alpha[EQ_BANDS];
+    float beta[EQ_BANDS];
+    float gamma[EQ_BANDS];
+    float amp[EQ_BANDS];
+    float preamp;
+    float x[EQ_CHANNELS][2];
+    float y[EQ_CHANNELS][EQ_BANDS][2];
+} old_eq_t;
+
+static void
+old_input(old_eq_t *eq, int16_t *ptrs16, int samples, int nch)
+{
+    int ch, i, j;
+
+    for(i = 0; i < samples; i += nch){
+        for(ch = 0; ch < nch; ch++){
+            int16_t x = ptrs16[ch];
+            float o = 0.0;
+
+            for(j = 0; j < EQ_BANDS; j++){
+                float y =
+                    eq->alpha[j] * (x - eq->x[ch][1]) -
+                    eq->beta[j]  * eq->y[ch][j][1] +
+                    eq->gamma[j] * eq->y[ch][j][0];
+
+                eq->y[ch][j][1] = eq->y[ch][j][0];
+                eq->y[ch][j][0] = y;
+
+                o += y * eq->amp[j];
+            }
+            eq->x[ch][1] = eq->x[ch][0];
+            eq->x[ch][0] = x;
+            ptrs16[ch] = (int16_t) (eq->preamp * (EQ_IN_FACTOR * x + o));
+        }
+        ptrs16 += nch;
+    }
+}
+
+/* The body of eq_input with a fixed kernel. */
+static void
+new_input(equalizer_t *eq, int16_t *data, int frames, int nch,
+          void (*kernel)(equalizer_t *, float *, int, int, int))
+{
+    int ch;
+
+    while(frames > 0){
+        int n = min(frames, EQ_BLOCK);
+
+        dec_s16(eq->buf, data, n * nch);
+        for(ch = 0; ch < nch; ch++)
+            kernel(eq, eq->buf + ch, n, nch, ch);
+        enc_s16(data, eq->buf, n * nch);
+
+        data += n * nch;
+        frames -= n;
+    }
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Gains of a typical preset, in dB. */
+static const float gains[EQ_BANDS] = { 6, 4, 2, 0, -2, -2, 0, 2, 4, 6 };
+
+static void
+setup(equalizer_t *eq, old_eq_t *oq)
+{
+    int i;
+
+    memset(eq, 0, sizeof(*eq));
+    memset(oq, 0, sizeof(*oq));
+
+    for(i = 0; i < EQ_BANDS; i++){
+        eq->alpha[i] = oq->alpha[i] = eq_config_48000.band[i].alpha;
+        eq->beta[i] = oq->beta[i] = eq_config_48000.band[i].beta;
+        eq->gamma[i] = oq->gamma[i] = eq_config_48000.band[i].gamma;
+        eq->amp[i] = oq->amp[i] = fconvertdB(gains[i]);
+    }
+    eq->preamp = oq->preamp = convertdB(-6);
+}
+
+static void
+report(const char *name, double t, long samples, int16_t *out, int16_t *ref)
+{
+    int maxd = 0;
+    long i;
+
+    for(i = 0; ref && i < samples; i++){
+        int d = abs(out[i] - ref[i]);
+        if(d > maxd)
+            maxd = d;
+    }
+
+    printf("%-6s %7.2f ns/sample", name, t * 1e9 / samples);
+    if(ref)
+        printf("  max diff %i", maxd);
+    printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int nch = argc > 1? atoi(argv[1]): 6;
+    int secs = argc > 2? atoi(argv[2]): 10;
+    int frames = RATE * secs;
+    long samples = (long) frames * nch;
+    int16_t *src, *ref, *buf;
+    equalizer_t *eq = malloc(sizeof(*eq));
+    old_eq_t oq;
+    double t;
+    long i;
+
+    if(nch < 1 || nch > EQ_CHANNELS || secs < 1){
+        fprintf(stderr, "usage: eqbench [channels [seconds]]\n");
+        return 1;
+    }
+
+    src = malloc(samples * sizeof(*src));
+    ref = malloc(samples * sizeof(*ref));
+    buf = malloc(samples * sizeof(*buf));
+
+    srand(1);
+    for(i = 0; i < samples; i++)
+        src[i] = (rand() & 0x3fff) - 0x2000;
+
+    printf("%i channels, %i s at %i Hz\n", nch, secs, RATE);
+
+    setup(eq, &oq);
+    memcpy(ref, src, samples * sizeof(*src));
+    t = now();
+    old_input(&oq, ref, samples, nch);
+    report("old", now() - t, samples, ref, NULL);
+
+    setup(eq, &oq);
+    memcpy(buf, src, samples * sizeof(*src));
+    t = now();
+    new_input(eq, buf, frames, nch, eq_channel_c);
+    report("c", now() - t, samples, buf, ref);
+
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")){
+        setup(eq, &oq);
+        memcpy(buf, src, samples * sizeof(*src));
+        t = now();
+        new_input(eq, buf, frames, nch, eq_channel_sse2);
+        report("sse2", now() - t, samples, buf, ref);
+    }
+#endif
+
+    free(src);
+    free(ref);
+    free(buf);
+    free(eq);
+
+    return 0;
+}
@@ -0,0 +1,295 @@
+/**
+    Copyright (C) 2006  Michael Ahlberg, Måns Rullgård
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+    WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+    DEALINGS IN THE SOFTWARE.
+**/
+
+/* Transport stream sync and header benchmark.
+
+   Runs the byte-wise resync loop and per-packet header decode the
+   demuxer used before, and the current scalar, SSE2 and AVX2 sync
+   scanners and batched header decode, over the same data.  Reports
+   ns/packet and exits nonzero if any result differs from the old
+   code.  The current code is taken from the demuxer source itself.
+   Build from the top of a configured tree:
+
+     cc -O2 -Iinclude -I<tc2 include dir> -Isrc/demuxer/mpeg \
+        -o tsbench tools/tsbench.c -ltc2
+
+   and run as tsbench [packets]. */
+
+#include "../src/demuxer/mpeg/tssync.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ROUNDS 16
+
+struct ts_header {
+    int transport_error;
+    int unit_start;
+    int priority;
+    int pid;
+    int scrambling;
+    int adaptation;
+    int cont_counter;
+};
+
+/* The resync loop as it was. */
+static const uint8_t *
+old_scan(const uint8_t *p, const uint8_t *end)
+{
+    while(p < end){
+        if(p[0] == MPEGTS_SYNC && p[TS_PACKET_SIZE] == MPEGTS_SYNC)
+            break;
+        p++;
+    }
+    return p;
+}
+
+/* The header decode as it was, one packet at a time. */
+static int
+old_headers(const uint8_t *p, int n, struct ts_header *h)
+{
+    int i, bad = 0;
+
+    for(i = 0; i < n; i++, p += TS_PACKET_SIZE){
+        const uint8_t *q = p;
+        unsigned v;
+
+        if(*q++ != MPEGTS_SYNC){
+            bad++;
+            continue;
+        }
+
+        v = *q++;
+        h[i].transport_error = (v >> 7) & 1;
+        h[i].unit_start = (v >> 6) & 1;
+        h[i].priority = (v >> 5) & 1;
+        h[i].pid = (v & 0x1f) << 8 | *q++;
+        v = *q++;
+        h[i].scrambling = (v >> 6) & 3;
+        h[i].adaptation = (v >> 4) & 3;
+        h[i].cont_counter = v & 0xf;
+    }
+
+    return bad;
+}
+
+/* The same fields through mpegts_parse_headers. */
+static int
+new_headers(const uint8_t *p, int n, struct ts_header *h)
+{
+    struct mpegts_headers hdr;
+    int i, j, bad = 0;
+
+    for(i = 0; i < n; i += hdr.n, p += hdr.n * TS_PACKET_SIZE){
+        mpegts_parse_headers(p, n - i, &hdr);
+        for(j = 0; j < hdr.n; j++){
+            struct ts_header *t = h + i + j;
+            unsigned v = hdr.flags[j];
+
+            if(!(v & MPEGTS_HDR_SYNC)){
+                bad++;
+                continue;
+            }
+
+            t->transport_error = !!(v & MPEGTS_HDR_TEI);
+            t->unit_start = !!(v & MPEGTS_HDR_START);
+            t->priority = !!(v & MPEGTS_HDR_PRIORITY);
+            t->pid = hdr.pid[j];
+            t->scrambling = (hdr.ctl[j] >> 6) & 3;
+            t->adaptation = (hdr.ctl[j] >> 4) & 3;
+            t->cont_counter = hdr.ctl[j] & 0xf;
+        }
+    }
+
+    return bad;
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Noise with stray sync bytes, and a real sync pair every few
+   hundred bytes at an odd offset, so that every scanner hits both
+   false candidates and matches in all lanes. */
+static uint8_t *
+make_noise(int size)
+{
+    uint8_t *b = malloc(size + TS_PACKET_SIZE);
+    int i;
+
+    for(i = 0; i < size + TS_PACKET_SIZE; i++)
+        b[i] = rand() % 31 ? rand(): MPEGTS_SYNC;
+
+    for(i = rand() % 512; i < size; i += 1 + rand() % 1024){
+        b[i] = MPEGTS_SYNC;
+        b[i + TS_PACKET_SIZE] = MPEGTS_SYNC;
+    }
+
+    return b;
+}
+
+/* Packets with random headers, some with a broken sync byte. */
+static uint8_t *
+make_packets(int n)
+{
+    uint8_t *b = malloc(n * TS_PACKET_SIZE);
+    int i, j;
+
+    for(i = 0; i < n; i++){
+        uint8_t *p = b + i * TS_PACKET_SIZE;
+        for(j = 0; j < TS_PACKET_SIZE; j++)
+            p[j] = rand();
+        p[0] = rand() % 97? MPEGTS_SYNC: rand();
+    }
+
+    return b;
+}
+
+typedef const uint8_t *(*scan_fn)(const uint8_t *, const uint8_t *);
+
+/* Find every match in the buffer.  Returns the number of matches
+   and a checksum of their offsets. */
+static long
+run_scan(scan_fn scan, const uint8_t *b, int size, uint64_t *sum)
+{
+    const uint8_t *p = b, *end = b + size;
+    long n = 0;
+
+    *sum = 0;
+    while((p = scan(p, end)) < end){
+        *sum = *sum * 31 + (p - b);
+        n++;
+        p++;
+    }
+
+    return n;
+}
+
+static int
+bench_scan(const char *name, scan_fn scan, const uint8_t *b, int size,
+           long rn, uint64_t rsum)
+{
+    uint64_t sum;
+    double t;
+    long n = 0;
+    int i;
+
+    t = now();
+    for(i = 0; i < ROUNDS; i++)
+        n = run_scan(scan, b, size, &sum);
+    t = now() - t;
+
+    printf("scan    %-6s %7.2f ns/packet", name,
+           t * 1e9 / ROUNDS / (size / TS_PACKET_SIZE));
+
+    if(rn >= 0 && (n != rn || sum != rsum)){
+        printf("  MISMATCH (%li matches, old %li)\n", n, rn);
+        return 1;
+    }
+
+    printf("  %li matches\n", n);
+    return 0;
+}
+
+static int
+bench_headers(const char *name,
+              int (*decode)(const uint8_t *, int, struct ts_header *),
+              const uint8_t *b, int n, struct ts_header *h,
+              struct ts_header *ref)
+{
+    double t;
+    int i, bad = 0;
+
+    memset(h, 0, n * sizeof(*h));
+
+    t = now();
+    for(i = 0; i < ROUNDS; i++)
+        bad = decode(b, n, h);
+    t = now() - t;
+
+    printf("headers %-6s %7.2f ns/packet", name, t * 1e9 / ROUNDS / n);
+
+    if(ref && memcmp(h, ref, n * sizeof(*h))){
+        printf("  MISMATCH\n");
+        return 1;
+    }
+
+    printf("  %i bad sync\n", bad);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int n = argc > 1? atoi(argv[1]): 100000;
+    int size = n * TS_PACKET_SIZE;
+    struct ts_header *h, *ref;
+    uint8_t *noise, *pk;
+    uint64_t rsum;
+    long rn;
+    int fail = 0;
+
+    if(n < 1){
+        fprintf(stderr, "usage: tsbench [packets]\n");
+        return 1;
+    }
+
+    srand(1);
+    noise = make_noise(size);
+    pk = make_packets(n);
+    h = malloc(n * sizeof(*h));
+    ref = malloc(n * sizeof(*ref));
+
+    rn = run_scan(old_scan, noise, size, &rsum);
+    fail |= bench_scan("old", old_scan, noise, size, -1, 0);
+    fail |= bench_scan("c", sync_scan_c, noise, size, rn, rsum);
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2"))
+        fail |= bench_scan("sse2", sync_scan_sse2, noise, size, rn, rsum);
+    if(__builtin_cpu_supports("avx2"))
+        fail |= bench_scan("avx2", sync_scan_avx2, noise, size, rn, rsum);
+#endif
+
+    memset(ref, 0, n * sizeof(*ref));
+    old_headers(pk, n, ref);
+    fail |= bench_headers("old", old_headers, pk, n, h, NULL);
+    fail |= bench_headers("batch", new_headers, pk, n, h, ref);
+
+    free(noise);
+    free(pk);
+    free(h);
+    free(ref);
+
+    if(fail)
+        printf("results differ from the old code\n");
+
+    return fail;
+}